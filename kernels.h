@@ -0,0 +1,308 @@
+// SIMD versions of the hot loops. raycast.cc includes this file once
+// per instruction set tier, with these defined:
+//
+//   KERNEL_NAMESPACE  namespace to put this tier's kernels in
+//   KERNEL_TARGET     function attribute enabling the instruction set
+//   KERNEL_WIDTH      number of 32-bit lanes per vector
+//
+// Everything here is written with GCC/Clang vector extensions, so the
+// same code is compiled for every tier. The scalar versions, which are
+// also the reference implementations, live in raycast.cc.
+
+namespace KERNEL_NAMESPACE {
+
+typedef float   f32v __attribute__((vector_size(KERNEL_WIDTH * 4)));
+typedef int32_t i32v __attribute__((vector_size(KERNEL_WIDTH * 4)));
+typedef uint32_t u32v __attribute__((vector_size(KERNEL_WIDTH * 4)));
+typedef uint8_t  u8v  __attribute__((vector_size(KERNEL_WIDTH)));
+
+#define KERNEL_INLINE KERNEL_TARGET __attribute__((always_inline)) static inline
+
+KERNEL_INLINE i32v lanes() {
+    i32v v;
+    for (int i = 0; i < KERNEL_WIDTH; i++) {
+        v[i] = i;
+    }
+    return v;
+}
+
+KERNEL_INLINE f32v load(const float* p) {
+    f32v v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+KERNEL_INLINE u32v load(const uint32_t* p) {
+    u32v v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+template <typename T, typename V>
+KERNEL_INLINE void store(T* p, V v) {
+    static_assert(sizeof(T) * KERNEL_WIDTH == sizeof(V), "lane size mismatch");
+    memcpy(p, &v, sizeof(v));
+}
+
+KERNEL_INLINE i32v select(i32v mask, i32v a, i32v b) {
+    return (a & mask) | (b & ~mask);
+}
+
+KERNEL_INLINE f32v select(i32v mask, f32v a, f32v b) {
+    return (f32v) select(mask, (i32v) a, (i32v) b);
+}
+
+KERNEL_INLINE u32v select(i32v mask, u32v a, u32v b) {
+    return (u32v) select(mask, (i32v) a, (i32v) b);
+}
+
+KERNEL_INLINE f32v abs(f32v x) {
+    return (f32v) ((i32v) x & 0x7fffffff);
+}
+
+KERNEL_INLINE f32v min(f32v a, f32v b) {
+    return select(a < b, a, b);
+}
+
+KERNEL_INLINE f32v max(f32v a, f32v b) {
+    return select(a > b, a, b);
+}
+
+KERNEL_INLINE i32v floor_int(f32v x) {
+    i32v truncated = __builtin_convertvector(x, i32v);
+    // Comparisons give -1 for true, which steps negatives down
+    return truncated + (__builtin_convertvector(truncated, f32v) > x);
+}
+
+KERNEL_INLINE bool any(i32v mask) {
+#if KERNEL_WIDTH == 16
+    return _mm512_test_epi32_mask((__m512i) mask, (__m512i) mask) != 0;
+#elif KERNEL_WIDTH == 8
+    return _mm256_movemask_ps((__m256) mask) != 0;
+#else
+    return _mm_movemask_ps((__m128) mask) != 0;
+#endif
+}
+
+// Lanes not in `mask` get `fallback` rather than touching memory
+KERNEL_INLINE i32v gather(const int32_t* base, i32v index, i32v mask, i32v fallback) {
+#if KERNEL_WIDTH == 16
+    __mmask16 m = _mm512_test_epi32_mask((__m512i) mask, (__m512i) mask);
+    return (i32v) _mm512_mask_i32gather_epi32((__m512i) fallback, m, (__m512i) index, base, 4);
+#elif KERNEL_WIDTH == 8
+    return (i32v) _mm256_mask_i32gather_epi32(
+        (__m256i) fallback, (const int*) base, (__m256i) index, (__m256i) mask, 4
+    );
+#else
+    i32v v = fallback;
+    for (int i = 0; i < KERNEL_WIDTH; i++) {
+        if (mask[i]) {
+            v[i] = base[index[i]];
+        }
+    }
+    return v;
+#endif
+}
+
+KERNEL_TARGET static void fill_span(uint32_t* dest, int count, uint32_t color) {
+    u32v v = u32v {} + color;
+    int i = 0;
+    for (; i + KERNEL_WIDTH <= count; i += KERNEL_WIDTH) {
+        store(dest + i, v);
+    }
+    for (; i < count; i++) {
+        dest[i] = color;
+    }
+}
+
+KERNEL_TARGET static void scale_span(
+    uint32_t* dest, const uint32_t* src, int count, uint32_t pos, uint32_t step)
+{
+    u32v positions = (u32v) lanes() * step + pos;
+    u32v advance = u32v {} + step * KERNEL_WIDTH;
+    i32v all = i32v {} - 1;
+    int i = 0;
+    for (; i + KERNEL_WIDTH <= count; i += KERNEL_WIDTH) {
+        i32v texels = gather((const int32_t*) src, (i32v) (positions >> 16), all, all);
+        store(dest + i, texels);
+        positions += advance;
+    }
+    pos += step * i;
+    for (; i < count; i++) {
+        dest[i] = src[pos >> 16];
+        pos += step;
+    }
+}
+
+KERNEL_TARGET static void scale_column(
+    uint32_t* dest, int pitch, int surface_height,
+    int top, int column_height,
+    const uint32_t* texels, int texel_pitch, int texture_height)
+{
+    uint32_t step = ((uint32_t) texture_height << 16) / column_height;
+    int start = top < 0 ? -top : 0;
+    int end = top + column_height > surface_height ? surface_height - top : column_height;
+    dest += (top + start) * pitch;
+
+    // The texel lookups vectorize; the stores are strided, so they
+    // stay scalar.
+    u32v positions = (u32v) lanes() * step + start * step;
+    u32v advance = u32v {} + step * KERNEL_WIDTH;
+    i32v all = i32v {} - 1;
+    int i = start;
+    for (; i + KERNEL_WIDTH <= end; i += KERNEL_WIDTH) {
+        i32v rows = (i32v) (positions >> 16) * texel_pitch;
+        i32v column = gather((const int32_t*) texels, rows, all, all);
+        for (int lane = 0; lane < KERNEL_WIDTH; lane++) {
+            *dest = column[lane];
+            dest += pitch;
+        }
+        positions += advance;
+    }
+    uint32_t pos = i * step;
+    for (; i < end; i++) {
+        *dest = texels[(pos >> 16) * texel_pitch];
+        dest += pitch;
+        pos += step;
+    }
+}
+
+// Grid DDA over KERNEL_WIDTH rays at once. Lanes that have found their
+// wall keep stepping harmlessly until every lane is done. Lanes can't
+// skip empty blocks independently, so `occupancy` only helps the
+// leftover rays.
+KERNEL_TARGET static void cast_rays(
+    const Block* walls, int width, int height, const OccupancyPyramid* occupancy,
+    v2 origin, RayBatch* rays)
+{
+    const int32_t* cells = (const int32_t*) walls;
+    int cell_x = floor(origin.x), cell_y = floor(origin.y);
+    f32v zero = {};
+    i32v outer = i32v {} + (int32_t) OUTER_WALL;
+
+    int n = 0;
+    for (; n + KERNEL_WIDTH <= rays->count; n += KERNEL_WIDTH) {
+        f32v dx = load(rays->dir_x.data() + n);
+        f32v dy = load(rays->dir_y.data() + n);
+
+        i32v positive_x = dx > zero, positive_y = dy > zero;
+        i32v step_x = select(positive_x, i32v {} + 1, i32v {} - 1);
+        i32v step_y = select(positive_y, i32v {} + 1, i32v {} - 1);
+        f32v huge = zero + 1e30f;
+        f32v delta_x = select(dx == zero, huge, abs(1.0f / dx));
+        f32v delta_y = select(dy == zero, huge, abs(1.0f / dy));
+        f32v side_x = select(
+            positive_x, zero + ((cell_x + 1) - origin.x), zero + (origin.x - cell_x)
+        ) * delta_x;
+        f32v side_y = select(
+            positive_y, zero + ((cell_y + 1) - origin.y), zero + (origin.y - cell_y)
+        ) * delta_y;
+
+        i32v x = i32v {} + cell_x, y = i32v {} + cell_y;
+        i32v active = i32v {} - 1;
+        f32v t = zero;
+        i32v vertical = {}, cell = outer;
+        while (any(active)) {
+            // Finished lanes stay put, so once every lane is done the
+            // state describes the wall each one hit.
+            vertical = select(active, side_x < side_y, vertical);
+            t = select(active, select(vertical, side_x, side_y), t);
+            i32v step_along_x = active & vertical, step_along_y = active & ~vertical;
+            x += step_x & step_along_x;
+            y += step_y & step_along_y;
+            side_x += (f32v) ((i32v) delta_x & step_along_x);
+            side_y += (f32v) ((i32v) delta_y & step_along_y);
+
+            i32v inside = (x >= 0) & (x < width) & (y >= 0) & (y < height);
+            cell = select(active, gather(cells, x + y * width, inside & active, outer), cell);
+            active &= cell == 0;
+        }
+
+        // The edge we crossed, on the axis we crossed it
+        f32v edge = __builtin_convertvector(
+            select(vertical, x + (~positive_x & 1), y + (~positive_y & 1)), f32v
+        );
+        f32v ox = zero + origin.x, oy = zero + origin.y;
+        store(rays->hit_x.data() + n, select(vertical, edge, ox + dx * t));
+        store(rays->hit_y.data() + n, select(vertical, oy + dy * t, edge));
+        store(rays->dist.data() + n, t);
+        store(rays->hit_dir.data() + n, select(vertical, i32v {} + (int32_t) VERTICAL, i32v {} + (int32_t) HORIZONTAL));
+        store(rays->hit_type.data() + n, cell);
+    }
+    cast_rays_scalar(walls, width, height, occupancy, origin, rays, n);
+}
+
+// Entities whose whole path lies in open cells move the full step;
+// the rest are left in place and flagged in `blocked`. Only paths
+// within a 2x2 block of cells are checked, which is nearly everything
+// moving less than a cell per tick.
+KERNEL_TARGET static void move_clear(
+    const Block* walls, int width, int height, float delta, int count,
+    float* pos_x, float* pos_y, const float* vel_x, const float* vel_y,
+    const float* radius, uint8_t* blocked)
+{
+    const int32_t* cells = (const int32_t*) walls;
+    f32v dt = f32v {} + delta;
+    i32v outer = i32v {} + (int32_t) OUTER_WALL;
+
+    int i = 0;
+    for (; i + KERNEL_WIDTH <= count; i += KERNEL_WIDTH) {
+        f32v x = load(pos_x + i), y = load(pos_y + i);
+        f32v next_x = x + load(vel_x + i) * dt;
+        f32v next_y = y + load(vel_y + i) * dt;
+        f32v r = load(radius + i);
+        i32v x1 = floor_int(min(x, next_x) - r), x2 = floor_int(max(x, next_x) + r);
+        i32v y1 = floor_int(min(y, next_y) - r), y2 = floor_int(max(y, next_y) + r);
+
+        i32v clear = (x2 - x1 <= 1) & (y2 - y1 <= 1);
+        i32v in_x1 = (x1 >= 0) & (x1 < width), in_x2 = (x2 >= 0) & (x2 < width);
+        i32v in_y1 = (y1 >= 0) & (y1 < height), in_y2 = (y2 >= 0) & (y2 < height);
+        clear &= gather(cells, x1 + y1 * width, in_x1 & in_y1, outer) == 0;
+        clear &= gather(cells, x2 + y1 * width, in_x2 & in_y1, outer) == 0;
+        clear &= gather(cells, x1 + y2 * width, in_x1 & in_y2, outer) == 0;
+        clear &= gather(cells, x2 + y2 * width, in_x2 & in_y2, outer) == 0;
+
+        store(pos_x + i, select(clear, next_x, x));
+        store(pos_y + i, select(clear, next_y, y));
+        for (int lane = 0; lane < KERNEL_WIDTH; lane++) {
+            blocked[i + lane] = !clear[lane];
+        }
+    }
+    move_clear_scalar(walls, width, height, delta, count, pos_x, pos_y, vel_x, vel_y, radius, blocked, i);
+}
+
+// KERNEL_WIDTH cells at a time, looking at each of their neighbours in
+// turn. Rows of the cost grid are read straight through, so this is
+// all plain loads.
+KERNEL_TARGET static void flow_steps(const uint32_t* cost, int stride, int count, uint8_t* steps) {
+    int offsets[8];
+    for (int k = 0; k < 8; k++) {
+        offsets[k] = flow_dx[k] + flow_dy[k] * stride;
+    }
+    u32v zero = {};
+
+    int i = 0;
+    for (; i + KERNEL_WIDTH <= count; i += KERNEL_WIDTH) {
+        u32v here = load(cost + i);
+        u32v lowest = select(here != zero, here - 1, zero);
+        i32v best = i32v {} + FlowField::NO_STEP;
+        for (int k = 0; k < 8; k++) {
+            i32v take = load(cost + i + offsets[k]) - 1 < lowest;
+            if (k & 1) {
+                take &= (load(cost + i + offsets[k - 1]) != zero) & (load(cost + i + offsets[(k + 1) & 7]) != zero);
+            }
+            lowest = select(take, load(cost + i + offsets[k]) - 1, lowest);
+            best = select(take, i32v {} + k, best);
+        }
+        store(steps + i, __builtin_convertvector(best, u8v));
+    }
+    flow_steps_scalar(cost, stride, count, steps, i);
+}
+
+#undef KERNEL_INLINE
+
+}
+
+#undef KERNEL_NAMESPACE
+#undef KERNEL_TARGET
+#undef KERNEL_WIDTH
@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdint.h>
@@ -5,7 +6,16 @@
 #include <stdlib.h>
 #include <time.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include <tuple>
+#include <utility>
 #include <vector>
 
 #include <SDL2/SDL.h>
@@ -16,6 +26,11 @@
 
 #include "raycast.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
 [[ noreturn ]] static void fatal(const char * fmt, ...)
 {
 	va_list args;
@@ -29,7 +44,112 @@
 	abort();
 }
 
-static void draw_line(SDL_Surface* surface, uint32_t color, int x1, int y1, int x2, int y2) {
+static double seconds_since(uint64_t start) {
+    return (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+}
+
+// Bound by Kernels::select before anything is drawn
+static Kernels kernels;
+
+//
+// Raster
+//
+
+// Compile-time description of a packed 32-bit pixel format. Formats
+// without an alpha channel pass a negative alpha shift.
+template <uint32_t sdl_format, int r_shift, int g_shift, int b_shift, int a_shift>
+struct PixelFormat {
+    static constexpr uint32_t format = sdl_format;
+    static constexpr uint32_t rgb(uint8_t r, uint8_t g, uint8_t b) {
+        return
+            ((uint32_t) r << r_shift) |
+            ((uint32_t) g << g_shift) |
+            ((uint32_t) b << b_shift) |
+            (a_shift >= 0 ? 0xffu << (a_shift & 31) : 0);
+    }
+};
+
+typedef PixelFormat<SDL_PIXELFORMAT_RGB888,   16,  8,  0, -1> FormatRGB888;
+typedef PixelFormat<SDL_PIXELFORMAT_BGR888,    0,  8, 16, -1> FormatBGR888;
+typedef PixelFormat<SDL_PIXELFORMAT_ARGB8888, 16,  8,  0, 24> FormatARGB8888;
+typedef PixelFormat<SDL_PIXELFORMAT_ABGR8888,  0,  8, 16, 24> FormatABGR8888;
+typedef PixelFormat<SDL_PIXELFORMAT_RGBA8888, 24, 16,  8,  0> FormatRGBA8888;
+typedef PixelFormat<SDL_PIXELFORMAT_BGRA8888,  8, 16, 24,  0> FormatBGRA8888;
+
+static void lock(SDL_Surface* surface) {
+    if (SDL_LockSurface(surface) != 0) {
+        fatal(SDL_GetError());
+    }
+}
+
+// Clip `rect` (or the whole surface, if null) to the surface. Returns
+// false if nothing is left.
+static bool clip_rect(SDL_Surface* surface, const SDL_Rect* rect, SDL_Rect* clipped) {
+    SDL_Rect r = rect ? *rect : SDL_Rect { 0, 0, surface->w, surface->h };
+    int x1 = std::max(r.x, 0), y1 = std::max(r.y, 0);
+    int x2 = std::min(r.x + r.w, surface->w), y2 = std::min(r.y + r.h, surface->h);
+    *clipped = { x1, y1, x2 - x1, y2 - y1 };
+    return clipped->w > 0 && clipped->h > 0;
+}
+
+// Cohen-Sutherland: clip a line to the pixels of a w x h surface.
+// Returns false if none of it is on the surface.
+static bool clip_line(int w, int h, Line* line) {
+    enum { INSIDE = 0, LEFT = 1, RIGHT = 2, TOP = 4, BOTTOM = 8 };
+    double x_min = 0, y_min = 0, x_max = w - 1, y_max = h - 1;
+    auto outcode =
+        [&](double x, double y) {
+            int code = INSIDE;
+            code |= x < x_min ? LEFT : (x > x_max ? RIGHT : 0);
+            code |= y < y_min ? TOP : (y > y_max ? BOTTOM : 0);
+            return code;
+        };
+
+    double x1 = line->x1, y1 = line->y1, x2 = line->x2, y2 = line->y2;
+    int code1 = outcode(x1, y1), code2 = outcode(x2, y2);
+    while (code1 | code2) {
+        if (code1 & code2) {
+            // Both ends are off the same side
+            return false;
+        }
+        int code = code1 ? code1 : code2;
+        double x, y;
+        if (code & TOP) {
+            x = x1 + (x2 - x1) * (y_min - y1) / (y2 - y1);
+            y = y_min;
+        } else if (code & BOTTOM) {
+            x = x1 + (x2 - x1) * (y_max - y1) / (y2 - y1);
+            y = y_max;
+        } else if (code & LEFT) {
+            y = y1 + (y2 - y1) * (x_min - x1) / (x2 - x1);
+            x = x_min;
+        } else {
+            y = y1 + (y2 - y1) * (x_max - x1) / (x2 - x1);
+            x = x_max;
+        }
+        if (code == code1) {
+            x1 = x;
+            y1 = y;
+            code1 = outcode(x1, y1);
+        } else {
+            x2 = x;
+            y2 = y;
+            code2 = outcode(x2, y2);
+        }
+    }
+
+    // Rounding can't push an endpoint further than half a pixel out,
+    // but clamp anyway so the rasterizer never has to check.
+    auto snap = [](double v, int max) { return std::min(std::max((int) lround(v), 0), max); };
+    line->x1 = snap(x1, w - 1);
+    line->y1 = snap(y1, h - 1);
+    line->x2 = snap(x2, w - 1);
+    line->y2 = snap(y2, h - 1);
+    return true;
+}
+
+// Bresenham, for a line already clipped to the surface
+static void draw_clipped_line(uint32_t* pixels, int pitch, uint32_t color, int x1, int y1, int x2, int y2) {
     // Copied, cleaned up, and slightly modified from
     // https://stackoverflow.com/questions/10060046/drawing-lines-with-bresenhams-line-algorithm
     int x, y, dx, dy, dx1, dy1, px, py, xe, ye, i;
@@ -40,18 +160,11 @@ static void draw_line(SDL_Surface* surface, uint32_t color, int x1, int y1, int
     px = 2 * dy1 - dx1;
     py = 2 * dx1 - dy1;
 
-    if (SDL_LockSurface(surface) != 0) {
-        fatal(SDL_GetError());
-    }
-    uint32_t* pixels = (uint32_t*) surface->pixels;
-
     auto put_pixel =
         [&](int x, int y) {
-            if (x >= 0 && x < surface->w && y >= 0 && y < surface->h) {
-                pixels[x + y * surface->w] = color;
-            }
+            pixels[x + y * pitch] = color;
         };
-    
+
     if (dy1 <= dx1) {
         if (dx >= 0) {
             x = x1;
@@ -103,10 +216,655 @@ static void draw_line(SDL_Surface* surface, uint32_t color, int x1, int y1, int
             put_pixel(x, y);
         }
     }
-    
+
+}
+
+void Raster::fill(SDL_Surface* surface, const SDL_Rect* rect, uint32_t color) {
+    SDL_Rect r;
+    if (!clip_rect(surface, rect, &r)) {
+        return;
+    }
+    lock(surface);
+    int pitch = surface->pitch / sizeof(uint32_t);
+    uint32_t* row = (uint32_t*) surface->pixels + r.x + r.y * pitch;
+    for (int y = 0; y < r.h; y++) {
+        kernels.fillSpan(row, r.w, color);
+        row += pitch;
+    }
+    SDL_UnlockSurface(surface);
+}
+
+// Nearest-neighbour scale of `src_rect` onto `dest_rect`, stepping
+// through the source in 16.16 fixed point.
+void Raster::blitScaled(
+    SDL_Surface* src, const SDL_Rect* src_rect,
+    SDL_Surface* dest, const SDL_Rect* dest_rect)
+{
+    SDL_Rect s, d;
+    if (!clip_rect(src, src_rect, &s)) {
+        return;
+    }
+    SDL_Rect full = dest_rect ? *dest_rect : SDL_Rect { 0, 0, dest->w, dest->h };
+    if (!clip_rect(dest, &full, &d)) {
+        return;
+    }
+    lock(src);
+    lock(dest);
+    int src_pitch = src->pitch / sizeof(uint32_t);
+    int dest_pitch = dest->pitch / sizeof(uint32_t);
+    const uint32_t* src_pixels = (const uint32_t*) src->pixels + s.x + s.y * src_pitch;
+    uint32_t* dest_row = (uint32_t*) dest->pixels + d.x + d.y * dest_pitch;
+
+    if (s.w == full.w && s.h == full.h) {
+        // Unscaled, so just copy rows
+        src_pixels += (d.x - full.x) + (d.y - full.y) * src_pitch;
+        for (int y = 0; y < d.h; y++) {
+            memcpy(dest_row, src_pixels, d.w * sizeof(uint32_t));
+            src_pixels += src_pitch;
+            dest_row += dest_pitch;
+        }
+    } else {
+        uint32_t step_x = ((uint32_t) s.w << 16) / full.w;
+        uint32_t step_y = ((uint32_t) s.h << 16) / full.h;
+        uint32_t start_x = (d.x - full.x) * step_x;
+        uint32_t pos_y = (d.y - full.y) * step_y;
+        for (int y = 0; y < d.h; y++) {
+            const uint32_t* src_row = src_pixels + (pos_y >> 16) * src_pitch;
+            kernels.scaleSpan(dest_row, src_row, d.w, start_x, step_x);
+            pos_y += step_y;
+            dest_row += dest_pitch;
+        }
+    }
+    SDL_UnlockSurface(dest);
+    SDL_UnlockSurface(src);
+}
+
+// Every line is drawn under one lock, and clipped to the surface
+// before it's rasterized.
+void Raster::lines(SDL_Surface* surface, const Line* lines, int count) {
+    lock(surface);
+    uint32_t* pixels = (uint32_t*) surface->pixels;
+    int pitch = surface->pitch / sizeof(uint32_t);
+    for (int i = 0; i < count; i++) {
+        Line line = lines[i];
+        if (clip_line(surface->w, surface->h, &line)) {
+            draw_clipped_line(pixels, pitch, line.color, line.x1, line.y1, line.x2, line.y2);
+        }
+    }
     SDL_UnlockSurface(surface);
 }
 
+template <typename Format>
+static constexpr Raster make_raster() {
+    return { Format::format, &Format::rgb };
+}
+
+static const Raster rasters[] = {
+    make_raster<FormatRGB888>(),
+    make_raster<FormatBGR888>(),
+    make_raster<FormatARGB8888>(),
+    make_raster<FormatABGR8888>(),
+    make_raster<FormatRGBA8888>(),
+    make_raster<FormatBGRA8888>(),
+};
+
+const Raster* Raster::forFormat(uint32_t format) {
+    for (const Raster& raster : rasters) {
+        if (raster.format == format) {
+            return &raster;
+        }
+    }
+    return nullptr;
+}
+
+//
+// Column scalers
+//
+
+// Wall textures are square and this tall. Anything else goes through
+// the generic scaler.
+static const int wall_texture_size = 256;
+// Columns up to this many pixels tall get an unrolled scaler.
+static const int max_unrolled_height = 256;
+
+typedef void (*ColumnScaler)(uint32_t* dest, int pitch, const uint32_t* texels, int texel_pitch);
+
+// Every texel row is known at compile time, so the whole column is a
+// straight run of loads and stores with no branches or division.
+template <int height, int... rows>
+static void scale_column_rows(
+    uint32_t* dest, int pitch, const uint32_t* texels, int texel_pitch,
+    std::integer_sequence<int, rows...>)
+{
+    ((dest[rows * pitch] = texels[(rows * wall_texture_size / height) * texel_pitch]), ...);
+}
+
+template <int height>
+static void scale_column(uint32_t* dest, int pitch, const uint32_t* texels, int texel_pitch) {
+    scale_column_rows<height>(
+        dest, pitch, texels, texel_pitch,
+        std::make_integer_sequence<int, height>()
+    );
+}
+
+template <int... heights>
+static constexpr std::array<ColumnScaler, sizeof...(heights) + 1> make_column_scalers(
+    std::integer_sequence<int, heights...>)
+{
+    return { nullptr, &scale_column<heights + 1>... };
+}
+
+// Indexed by on-screen column height
+static constexpr auto column_scalers =
+    make_column_scalers(std::make_integer_sequence<int, max_unrolled_height>());
+
+// Generic 16.16 fixed-point scaler, used for columns that are clipped
+// by the top/bottom of the surface or are taller than the table.
+static void scale_column_generic(
+    uint32_t* dest, int pitch, int surface_height,
+    int top, int column_height,
+    const uint32_t* texels, int texel_pitch, int texture_height)
+{
+    uint32_t step = ((uint32_t) texture_height << 16) / column_height;
+    int start = top < 0 ? -top : 0;
+    int end = top + column_height > surface_height ? surface_height - top : column_height;
+    uint32_t pos = start * step;
+    dest += (top + start) * pitch;
+    for (int i = start; i < end; i++) {
+        *dest = texels[(pos >> 16) * texel_pitch];
+        dest += pitch;
+        pos += step;
+    }
+}
+
+// Darken a column draw_wall_column() drew to `level` out of 255,
+// leaving alpha alone
+static void shade_wall_column(
+    uint32_t* dest, int pitch, int surface_height,
+    int top, int column_height, uint8_t level, uint32_t alpha_mask)
+{
+    int start = std::max(top, 0), end = std::min(top + column_height, surface_height);
+    uint32_t scale = level + (level >> 7); // 0 to 256
+    dest += start * pitch;
+    for (int i = start; i < end; i++) {
+        uint32_t c = *dest;
+        uint32_t rb = ((c & 0x00ff00ff) * scale >> 8) & 0x00ff00ff;
+        uint32_t ga = ((c >> 8 & 0x00ff00ff) * scale) & 0xff00ff00;
+        *dest = ((rb | ga) & ~alpha_mask) | (c & alpha_mask);
+        dest += pitch;
+    }
+}
+
+// Draw one textured wall column into `dest` (which points at the top of
+// the column's x on the surface).
+static void draw_wall_column(
+    uint32_t* dest, int pitch, int surface_height,
+    int top, int column_height,
+    const uint32_t* texels, int texel_pitch, int texture_height)
+{
+    if (column_height <= 0) {
+        return;
+    }
+    if (column_height <= max_unrolled_height &&
+        texture_height == wall_texture_size &&
+        top >= 0 && top + column_height <= surface_height) {
+        column_scalers[column_height](dest + top * pitch, pitch, texels, texel_pitch);
+        return;
+    }
+    kernels.scaleColumn(
+        dest, pitch, surface_height, top, column_height,
+        texels, texel_pitch, texture_height
+    );
+}
+
+// A frame with `bars` bars each way across it, cut out of a square
+// texture laid out in rows `pitch` apart
+MaskedTexture MaskedTexture::grate(const uint32_t* texels, int pitch, int size, int bars) {
+    MaskedTexture texture;
+    texture.size = size;
+    texture.texels.resize(size * size);
+    int spacing = size / bars, thickness = std::max(size / 32, 1);
+    auto opaque = [&] (int x, int y) {
+        return x % spacing < thickness || y % spacing < thickness ||
+            x >= size - thickness || y >= size - thickness;
+    };
+    for (int x = 0; x < size; x++) {
+        texture.starts.push_back(texture.runs.size());
+        for (int y = 0; y < size; y++) {
+            texture.texels[x * size + y] = texels[x + y * pitch];
+            if (!opaque(x, y)) {
+                continue;
+            }
+            if (y > 0 && opaque(x, y - 1)) {
+                texture.runs.back().end = y + 1;
+            } else {
+                texture.runs.push_back({ (uint16_t) y, (uint16_t) (y + 1) });
+            }
+        }
+    }
+    texture.starts.push_back(texture.runs.size());
+    return texture;
+}
+
+// Draw column `u` of a masked texture as a wall column, darkened to
+// `level` out of 255, leaving what's behind its gaps alone
+static void draw_masked_column(
+    uint32_t* dest, int pitch, int surface_height,
+    int top, int column_height,
+    const MaskedTexture& texture, int u, uint8_t level, uint32_t alpha_mask)
+{
+    if (column_height <= 0) {
+        return;
+    }
+    int size = texture.size;
+    uint32_t step = ((uint32_t) size << 16) / column_height;
+    const uint32_t* texels = &texture.texels[u * size];
+    for (uint32_t r = texture.starts[u]; r < texture.starts[u + 1]; r++) {
+        const MaskedTexture::Run& run = texture.runs[r];
+        // The rows of the column that land in the run, as in scale_column_generic
+        int start = std::max((int) (((int64_t) run.start * column_height + size - 1) / size), -top);
+        int end = std::min((int) (((int64_t) run.end * column_height + size - 1) / size), surface_height - top);
+        if (start >= end) {
+            continue;
+        }
+        uint32_t pos = std::max(start * step, (uint32_t) run.start << 16);
+        uint32_t* row = dest + (top + start) * pitch;
+        for (int i = start; i < end; i++) {
+            *row = texels[pos >> 16];
+            row += pitch;
+            pos += step;
+        }
+        if (level < 255) {
+            shade_wall_column(dest, pitch, surface_height, top + start, end - start, level, alpha_mask);
+        }
+    }
+}
+
+//
+// Kernels
+//
+
+static void fill_span_scalar(uint32_t* dest, int count, uint32_t color) {
+    for (int i = 0; i < count; i++) {
+        dest[i] = color;
+    }
+}
+
+static void scale_span_scalar(
+    uint32_t* dest, const uint32_t* src, int count, uint32_t pos, uint32_t step)
+{
+    for (int i = 0; i < count; i++) {
+        dest[i] = src[pos >> 16];
+        pos += step;
+    }
+}
+
+// Largest empty block of `occupancy` containing cell (x, y), as its
+// level, or -1 if even the 2x2 block around it has a wall.
+static int empty_level(const OccupancyPyramid* occupancy, int x, int y) {
+    int level = -1;
+    while (level + 1 < (int) occupancy->levels.size() &&
+           occupancy->count(level + 1, x >> (level + 2), y >> (level + 2)) == 0) {
+        level++;
+    }
+    return level;
+}
+
+// Where a ray entering the door or thin wall cell x, y at `t` crosses
+// the plane through the middle of the cell, if it does before leaving
+// the cell at `leave` and where the door hasn't slid out of the way.
+// `along_x` is set when the plane runs west to east. Cells with no
+// door entry are thin walls that way.
+static bool door_plane(
+    const Doors::Door* door, int x, int y, v2 origin, v2 dir, float t, float leave,
+    float* plane_t, bool* along_x)
+{
+    *along_x = door == nullptr || door->along == HORIZONTAL;
+    *plane_t = *along_x ? (y + 0.5f - origin.y) / dir.y : (x + 0.5f - origin.x) / dir.x;
+    float across = *along_x ? origin.x + dir.x * *plane_t - x : origin.y + dir.y * *plane_t - y;
+    return *plane_t >= t && *plane_t < leave && across >= (door != nullptr ? door->open : 0);
+}
+
+// Grid DDA: step from cell edge to cell edge until we enter a wall.
+// Returns the distance travelled, in multiples of `dir`. A ray that
+// gets `max_t` along without entering a wall stops there, with a
+// `hit_type` of NO_WALL.
+//
+// With `occupancy`, a ray in an empty block jumps straight to the last
+// cell it visits in that block, rather than looking at every cell on
+// the way. It lands where the plain DDA would have got to, give or take
+// float rounding.
+//
+// With `passed`, the ray carries on through up to `max_passed` grates,
+// noting each one there and counting them in `passed_count`.
+//
+// With `doors`, a door or thin wall is hit where the ray crosses its
+// plane, or passed through where it doesn't or the door is open. Without
+// them, their cells are hit at the edge like any other wall. Either way
+// it costs nothing in ordinary cells.
+static float cast_ray(
+    const Block* walls, int width, int height, const OccupancyPyramid* occupancy,
+    v2 origin, v2 dir, v2* hit, Direction* hit_dir, Block* hit_type, float max_t = INFINITY,
+    WallHit* passed = nullptr, int max_passed = 0, int* passed_count = nullptr,
+    const Doors* doors = nullptr)
+{
+    int x = floor(origin.x), y = floor(origin.y);
+    int step_x = dir.x > 0 ? 1 : -1, step_y = dir.y > 0 ? 1 : -1;
+    float delta_x = dir.x == 0 ? 1e30f : fabs(1.0f / dir.x);
+    float delta_y = dir.y == 0 ? 1e30f : fabs(1.0f / dir.y);
+    float side_x = (dir.x > 0 ? (x + 1) - origin.x : origin.x - x) * delta_x;
+    float side_y = (dir.y > 0 ? (y + 1) - origin.y : origin.y - y) * delta_y;
+
+    float t;
+    bool vertical;
+    Block cell;
+    bool on_plane = false;
+    // Snap to the edge we crossed so texture lookups don't wobble
+    auto edge_point = [&] {
+        if (on_plane) {
+            return vertical
+                ? v2(x + 0.5f, origin.y + dir.y * t)
+                : v2(origin.x + dir.x * t, y + 0.5f);
+        }
+        if (vertical) {
+            return v2(x + (step_x > 0 ? 0 : 1), origin.y + dir.y * t);
+        }
+        return v2(origin.x + dir.x * t, y + (step_y > 0 ? 0 : 1));
+    };
+    int count = 0;
+    for (;;) {
+        do {
+            int level = -1;
+            if (occupancy != nullptr && x >= 0 && x < width && y >= 0 && y < height) {
+                level = empty_level(occupancy, x, y);
+            }
+            if (level >= 0) {
+                // Edges left to cross on each axis before leaving the block,
+                // and when the last of them comes. Blocks can hang over the
+                // edge of the world, which is all wall, so stop there too.
+                int mask = (2 << level) - 1;
+                int left_x = step_x > 0 ? std::min(mask - (x & mask), width - 1 - x) : x & mask;
+                int left_y = step_y > 0 ? std::min(mask - (y & mask), height - 1 - y) : y & mask;
+                float exit_x = side_x + left_x * delta_x;
+                float exit_y = side_y + left_y * delta_y;
+
+                // Every crossing on the other axis that comes first still
+                // happens inside the block. Ties go to y, as below.
+                int skip_x = left_x, skip_y = left_y;
+                if (exit_x < exit_y) {
+                    skip_y = exit_x < side_y ? 0 : std::min((int) ((exit_x - side_y) / delta_y) + 1, left_y);
+                } else {
+                    skip_x = exit_y <= side_x ? 0 : std::min((int) ceil((exit_y - side_x) / delta_x), left_x);
+                }
+                x += skip_x * step_x;
+                y += skip_y * step_y;
+                side_x += skip_x * delta_x;
+                side_y += skip_y * delta_y;
+            }
+
+            vertical = side_x < side_y;
+            if (vertical) {
+                t = side_x;
+                x += step_x;
+                side_x += delta_x;
+            } else {
+                t = side_y;
+                y += step_y;
+                side_y += delta_y;
+            }
+            if (t >= max_t) {
+                cell = NO_WALL;
+                break;
+            }
+            cell = (x >= 0 && x < width && y >= 0 && y < height) ? walls[x + y * width] : OUTER_WALL;
+        } while (cell == NO_WALL);
+        if ((cell == DOOR_WALL || cell == THIN_WALL) && doors != nullptr) {
+            float plane_t;
+            bool along_x;
+            if (door_plane(doors->find(x + y * width), x, y, origin, dir, t, std::min(side_x, side_y), &plane_t, &along_x)) {
+                if (plane_t >= max_t) {
+                    cell = NO_WALL;
+                    break;
+                }
+                t = plane_t;
+                vertical = !along_x;
+                on_plane = true;
+                break;
+            }
+            continue;
+        }
+        if (cell != GRATE_WALL || count >= max_passed) {
+            break;
+        }
+        passed[count].point = edge_point();
+        passed[count].t = t;
+        passed[count].dir = vertical ? VERTICAL : HORIZONTAL;
+        passed[count].type = cell;
+        count++;
+    }
+    if (passed_count != nullptr) {
+        *passed_count = count;
+    }
+
+    *hit = edge_point();
+    *hit_dir = vertical ? VERTICAL : HORIZONTAL;
+    *hit_type = cell;
+    return t;
+}
+
+static void cast_rays_scalar(
+    const Block* walls, int width, int height, const OccupancyPyramid* occupancy,
+    v2 origin, RayBatch* rays, int first)
+{
+    for (int n = first; n < rays->count; n++) {
+        v2 hit(0, 0);
+        rays->dist[n] = cast_ray(
+            walls, width, height, occupancy, origin, v2(rays->dir_x[n], rays->dir_y[n]),
+            &hit, &rays->hit_dir[n], &rays->hit_type[n]
+        );
+        rays->hit_x[n] = hit.x;
+        rays->hit_y[n] = hit.y;
+    }
+}
+
+static void cast_rays_scalar(
+    const Block* walls, int width, int height, const OccupancyPyramid* occupancy,
+    v2 origin, RayBatch* rays)
+{
+    cast_rays_scalar(walls, width, height, occupancy, origin, rays, 0);
+}
+
+static void move_clear_scalar(
+    const Block* walls, int width, int height, float delta, int count,
+    float* pos_x, float* pos_y, const float* vel_x, const float* vel_y,
+    const float* radius, uint8_t* blocked, int first)
+{
+    for (int i = first; i < count; i++) {
+        float next_x = pos_x[i] + vel_x[i] * delta;
+        float next_y = pos_y[i] + vel_y[i] * delta;
+        int x1 = floor(fmin(pos_x[i], next_x) - radius[i]), x2 = floor(fmax(pos_x[i], next_x) + radius[i]);
+        int y1 = floor(fmin(pos_y[i], next_y) - radius[i]), y2 = floor(fmax(pos_y[i], next_y) + radius[i]);
+
+        auto open = [&] (int x, int y) {
+            return x >= 0 && x < width && y >= 0 && y < height && walls[x + y * width] == NO_WALL;
+        };
+        bool clear = x2 - x1 <= 1 && y2 - y1 <= 1 &&
+            open(x1, y1) && open(x2, y1) && open(x1, y2) && open(x2, y2);
+        if (clear) {
+            pos_x[i] = next_x;
+            pos_y[i] = next_y;
+        }
+        blocked[i] = !clear;
+    }
+}
+
+static void move_clear_scalar(
+    const Block* walls, int width, int height, float delta, int count,
+    float* pos_x, float* pos_y, const float* vel_x, const float* vel_y,
+    const float* radius, uint8_t* blocked)
+{
+    move_clear_scalar(walls, width, height, delta, count, pos_x, pos_y, vel_x, vel_y, radius, blocked, 0);
+}
+
+// Neighbours in step order, clockwise from east. Even steps are the
+// 4 neighbours flow field paths are measured over; odd steps are the
+// diagonals between them.
+static const int flow_dx[] = { 1, 1, 0, -1, -1, -1,  0,  1 };
+static const int flow_dy[] = { 0, 1, 1,  1,  0, -1, -1, -1 };
+
+// Point each of `count` cells of a flow field row at its lowest cost
+// neighbour, if that's lower than it. `cost` is laid out as in
+// FlowField, with rows `stride` apart. Costs are whole steps, so a
+// diagonal, where it doesn't cut a corner, is always preferred.
+static void flow_steps_scalar(const uint32_t* cost, int stride, int count, uint8_t* steps, int first) {
+    int offsets[8];
+    for (int k = 0; k < 8; k++) {
+        offsets[k] = flow_dx[k] + flow_dy[k] * stride;
+    }
+    for (int i = first; i < count; i++) {
+        uint8_t best = FlowField::NO_STEP;
+        // Walls wrap around to the highest cost of all
+        uint32_t lowest = cost[i] ? cost[i] - 1 : 0;
+        for (int k = 0; k < 8; k++) {
+            uint32_t c = cost[i + offsets[k]] - 1;
+            bool corner_open = !(k & 1) || (cost[i + offsets[k - 1]] && cost[i + offsets[(k + 1) & 7]]);
+            if (c < lowest && corner_open) {
+                lowest = c;
+                best = k;
+            }
+        }
+        steps[i] = best;
+    }
+}
+
+static void flow_steps_scalar(const uint32_t* cost, int stride, int count, uint8_t* steps) {
+    flow_steps_scalar(cost, stride, count, steps, 0);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+#define KERNEL_NAMESPACE kernels_sse2
+#define KERNEL_TARGET __attribute__((target("sse2")))
+#define KERNEL_WIDTH 4
+#include "kernels.h"
+
+#define KERNEL_NAMESPACE kernels_avx2
+#define KERNEL_TARGET __attribute__((target("avx2,fma")))
+#define KERNEL_WIDTH 8
+#include "kernels.h"
+
+#define KERNEL_NAMESPACE kernels_avx512
+#define KERNEL_TARGET __attribute__((target("avx512f")))
+#define KERNEL_WIDTH 16
+#include "kernels.h"
+
+#endif
+
+static const char* tier_names[] = {
+    "scalar",
+    "sse2",
+    "avx2",
+    "avx512",
+};
+
+CpuTier Kernels::detect() {
+#ifdef HAVE_X86_KERNELS
+    if (SDL_HasAVX512F()) {
+        return TIER_AVX512;
+    }
+    if (SDL_HasAVX2()) {
+        return TIER_AVX2;
+    }
+    if (SDL_HasSSE2()) {
+        return TIER_SSE2;
+    }
+#endif
+    return TIER_SCALAR;
+}
+
+#ifdef HAVE_X86_KERNELS
+#define KERNEL_TIERS(scalar, name) \
+    { scalar, kernels_sse2::name, kernels_avx2::name, kernels_avx512::name }
+#else
+#define KERNEL_TIERS(scalar, name) \
+    { scalar, scalar, scalar, scalar }
+#endif
+
+// Whether each tier beats the one below it, going by --bench. SSE2 has
+// no gather, so anything doing table lookups loses there. The wide ray
+// DDAs win on dense maps, but only the scalar one can jump over empty
+// blocks of the occupancy pyramid, which wins by far more on open maps.
+// The losing tiers are only used when forced with --cpu.
+static const bool fill_profitable[]   = { true, true,  true,  true  };
+static const bool span_profitable[]   = { true, false, true,  true  };
+static const bool column_profitable[] = { true, false, false, true  };
+static const bool ray_profitable[]    = { true, false, false, false };
+static const bool move_profitable[]   = { true, true,  true,  true  };
+static const bool flow_profitable[]   = { true, true,  true,  true  };
+
+template <typename F>
+static void select_kernel(
+    CpuTier limit, bool force, const F (&tiers)[4], const bool (&profitable)[4],
+    F* kernel, CpuTier* tier)
+{
+    int best = TIER_SCALAR;
+    for (int i = TIER_SCALAR; i <= limit; i++) {
+        if (force || profitable[i]) {
+            best = i;
+        }
+    }
+    *kernel = tiers[best];
+    *tier = (CpuTier) best;
+}
+
+void Kernels::select(CpuTier limit, bool force) {
+    CpuTier supported = detect();
+    if (limit > supported) {
+        if (force) {
+            printf("kernels: %s is not supported, using %s\n", tier_names[limit], tier_names[supported]);
+        }
+        limit = supported;
+    }
+
+    typedef decltype(kernels.fillSpan) FillSpan;
+    typedef decltype(kernels.scaleSpan) ScaleSpan;
+    typedef decltype(kernels.scaleColumn) ScaleColumn;
+    typedef decltype(kernels.castRays) CastRays;
+    typedef decltype(kernels.moveClear) MoveClear;
+    typedef decltype(kernels.flowSteps) FlowSteps;
+    const FillSpan fill_spans[] = KERNEL_TIERS(fill_span_scalar, fill_span);
+    const ScaleSpan scale_spans[] = KERNEL_TIERS(scale_span_scalar, scale_span);
+    const ScaleColumn scale_columns[] = KERNEL_TIERS(scale_column_generic, scale_column);
+    const CastRays cast_rays[] = KERNEL_TIERS(cast_rays_scalar, cast_rays);
+    const MoveClear move_clears[] = KERNEL_TIERS(move_clear_scalar, move_clear);
+    const FlowSteps flow_steps[] = KERNEL_TIERS(flow_steps_scalar, flow_steps);
+
+    select_kernel(limit, force, fill_spans, fill_profitable, &kernels.fillSpan, &kernels.fill_tier);
+    select_kernel(limit, force, scale_spans, span_profitable, &kernels.scaleSpan, &kernels.span_tier);
+    select_kernel(limit, force, scale_columns, column_profitable, &kernels.scaleColumn, &kernels.column_tier);
+    select_kernel(limit, force, cast_rays, ray_profitable, &kernels.castRays, &kernels.ray_tier);
+    select_kernel(limit, force, move_clears, move_profitable, &kernels.moveClear, &kernels.move_tier);
+    select_kernel(limit, force, flow_steps, flow_profitable, &kernels.flowSteps, &kernels.flow_tier);
+
+    printf(
+        "kernels: fill %s, span %s, column %s, rays %s, move %s, flow %s\n",
+        tier_names[kernels.fill_tier], tier_names[kernels.span_tier],
+        tier_names[kernels.column_tier], tier_names[kernels.ray_tier],
+        tier_names[kernels.move_tier], tier_names[kernels.flow_tier]
+    );
+}
+
+#undef KERNEL_TIERS
+
+static CpuTier parse_tier(const char* name) {
+    for (int i = 0; i < (int) (sizeof(tier_names) / sizeof(tier_names[0])); i++) {
+        if (strcmp(name, tier_names[i]) == 0) {
+            return (CpuTier) i;
+        }
+    }
+    fatal("Unknown CPU tier '%s'", name);
+}
+
 static SDL_Surface* loadSurface(const char* path, uint32_t format) {
     int w, h, c;
     uint8_t* pixels = stbi_load(path, &w, &h, &c, 4);
@@ -133,88 +891,141 @@ static float clamp_angle(float theta) {
     return theta;
 }
 
-static bool circle_aabb_intersect(v2 c, float r, v2 b1, v2 b2) {
-    float top    = b1.y;
-    float bottom = b2.y;
-    float left   = b1.x;
-    float right  = b2.x;
-
-    bool within_x = c.x >= left && c.x <= right;
-    bool within_y = c.y >= top && c.y <= bottom;
-
-    // Inside
-    if (within_x && within_y) {
+// When a circle of radius `r` at `p` moving by `d` first touches the box
+// from `b1` to `b2`, as a fraction of `d`, and the box's outward normal
+// there. Equivalently, where the ray p + t * d enters the box grown by
+// `r` with rounded corners. A circle already touching the box only
+// collides if it's moving further in.
+static bool sweep_circle_box(v2 p, float r, v2 d, v2 b1, v2 b2, float* toi, v2* normal) {
+    v2 closest(fmin(fmax(p.x, b1.x), b2.x), fmin(fmax(p.y, b1.y), b2.y));
+    v2 offset = p - closest;
+    float distance = offset.size();
+    if (distance < r) {
+        v2 n(0, 0);
+        if (distance > 0) {
+            n = offset / distance;
+        } else {
+            // Center inside the box: out through the nearest side
+            float left = p.x - b1.x, right = b2.x - p.x;
+            float top = p.y - b1.y, bottom = b2.y - p.y;
+            float nearest = fmin(fmin(left, right), fmin(top, bottom));
+            n = nearest == left  ? v2(-1, 0) :
+                nearest == right ? v2(+1, 0) :
+                nearest == top   ? v2(0, -1) : v2(0, +1);
+        }
+        if (d.dot(n) >= 0) {
+            return false;
+        }
+        *toi = 0;
+        *normal = n;
         return true;
     }
-    // Above/Below
-    if (within_x && !within_y) {
-        return fmin(abs(c.y - top), abs(c.y - bottom)) < r;
-    }
-    // Left/Right
-    if (!within_x && within_y) {
-        return fmin(abs(c.x - left), abs(c.x - right)) < r;
-    }
-    // Top-left?
-    if ((c - b1).size() < r) {
-        return true;
+
+    // Slabs of the box grown by r on every side
+    float enter = -INFINITY, exit = INFINITY;
+    v2 enter_normal(0, 0);
+    float starts[2] = {p.x, p.y}, moves[2] = {d.x, d.y};
+    float lows[2] = {b1.x - r, b1.y - r}, highs[2] = {b2.x + r, b2.y + r};
+    for (int axis = 0; axis < 2; axis++) {
+        if (moves[axis] == 0) {
+            if (starts[axis] < lows[axis] || starts[axis] > highs[axis]) {
+                return false;
+            }
+            continue;
+        }
+        float t1 = (lows[axis] - starts[axis]) / moves[axis];
+        float t2 = (highs[axis] - starts[axis]) / moves[axis];
+        float sign = -1;
+        if (t1 > t2) {
+            std::swap(t1, t2);
+            sign = +1;
+        }
+        if (t1 > enter) {
+            enter = t1;
+            enter_normal = axis == 0 ? v2(sign, 0) : v2(0, sign);
+        }
+        exit = fmin(exit, t2);
     }
-    // Top-right?
-    if ((c - v2(right, top)).size() < r) {
-        return true;
+    if (enter > exit || enter > 1 || exit < 0) {
+        return false;
     }
-    // Bottom-left?
-    if ((c - v2(left, bottom)).size() < r) {
+
+    // Entering next to a corner means the rounded corner is what we hit,
+    // if anything
+    v2 q = p + d * fmax(enter, 0);
+    bool beside_x = q.x < b1.x || q.x > b2.x;
+    bool beside_y = q.y < b1.y || q.y > b2.y;
+    if (beside_x && beside_y) {
+        v2 corner(q.x < b1.x ? b1.x : b2.x, q.y < b1.y ? b1.y : b2.y);
+        v2 f = p - corner;
+        float a = d.dot(d), b = f.dot(d), c = f.dot(f) - r * r;
+        float discriminant = b * b - a * c;
+        if (discriminant < 0) {
+            return false;
+        }
+        float t = (-b - sqrt(discriminant)) / a;
+        if (t < 0 || t > 1) {
+            return false;
+        }
+        *toi = t;
+        *normal = (p + d * t - corner) / r;
         return true;
     }
-    // Bottom-right?
-    if ((c - b2).size() < r) {
-        return true;
+    if (enter < 0) {
+        return false;
     }
-    // No corners are inside circle
-    return false;
+    *toi = enter;
+    *normal = enter_normal;
+    return true;
 }
 
 //
 // v2
 //
 
-v2::v2(float x, float y) : x(x), y(y) {}
-
-float v2::size() {
-    return sqrt(x * x + y * y);
-}
-
-v2 v2::operator +(v2 v) {
-    return v2(x + v.x, y + v.y);
-}
-
-void v2::operator +=(v2 v) {
-    *this = *this + v;
-}
-
-v2 v2::operator -(v2 v) {
-    return v2(x - v.x, y - v.y);
-}
-
-void v2::operator -=(v2 v) {
-    *this = *this - v;
-}
-
-v2 v2::operator *(float f) {
-    return v2(x * f, y * f);
-}
-
-void v2::operator *=(float f) {
-    *this = *this * f;
-}
+// The batch types have to agree with v2 lane for lane. size() and
+// floor() go through libm, so only the arithmetic can be checked at
+// compile time.
+template <int N>
+static constexpr bool batch_matches_v2() {
+    v2xN<N> a, b;
+    for (int i = 0; i < N; i++) {
+        a.set(i, v2(i + 0.5f, -2.0f * i));
+        b.set(i, v2(3.0f - i, i * 0.25f));
+    }
+    v2xN<N> sum = a + b, difference = a - b, scaled = a * 1.5f, divided = a / 4.0f;
+    v2xN<N> rotated = a.rotate(0.6f, 0.8f);
+    v2xN<N> accumulated = a;
+    accumulated += b;
+    accumulated -= a;
+    accumulated *= 3.0f;
+    accumulated /= 2.0f;
+    auto dots = a.dot(b);
 
-v2 v2::operator /(float f) {
-    return v2(x / f, y / f);
+    auto same = [](v2 p, v2 q) { return p.x == q.x && p.y == q.y; };
+    for (int i = 0; i < N; i++) {
+        v2 p = a.get(i), q = b.get(i);
+        v2 acc = p;
+        acc += q;
+        acc -= p;
+        acc *= 3.0f;
+        acc /= 2.0f;
+        if (!same(sum.get(i), p + q) ||
+            !same(difference.get(i), p - q) ||
+            !same(scaled.get(i), p * 1.5f) ||
+            !same(divided.get(i), p / 4.0f) ||
+            !same(rotated.get(i), p.rotate(0.6f, 0.8f)) ||
+            !same(accumulated.get(i), acc) ||
+            dots[i] != p.dot(q) ||
+            !same(v2xN<N>(p).get(N - 1), p)) {
+            return false;
+        }
+    }
+    return true;
 }
 
-void v2::operator /=(float f) {
-    *this = *this / f;
-}
+static_assert(batch_matches_v2<4>(), "v2x4 disagrees with v2");
+static_assert(batch_matches_v2<8>(), "v2x8 disagrees with v2");
 
 //
 // Box
@@ -281,6 +1092,7 @@ void Input::resetCache() {
     mouse_state = SDL_GetMouseState(nullptr, nullptr);
 
     motion = v2(0, 0);
+    wheel = 0;
 }
 
 bool Input::keyPressed(SDL_Scancode code) {
@@ -313,6 +1125,97 @@ v2 Input::mousePos() {
     return v2((float) mx, (float) my);
 }
 
+//
+// Worker pool
+//
+
+WorkerPool::WorkerPool() {
+    for (unsigned n = 1; n < std::thread::hardware_concurrency(); n++) {
+        threads.emplace_back([this] { work(); });
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> held(lock);
+        quitting = true;
+    }
+    wake.notify_all();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+// Helper threads, not counting whoever forks
+int WorkerPool::size() const {
+    return threads.size();
+}
+
+// Runs on each thread of the pool. The newest fork is served first,
+// since whoever made it is holding up an older one.
+void WorkerPool::work() {
+    std::unique_lock<std::mutex> held(lock);
+    for (;;) {
+        wake.wait(held, [&] { return quitting || !forks.empty(); });
+        if (quitting) {
+            return;
+        }
+        Fork* fork = forks.back();
+        if (--fork->wanted == 0) {
+            forks.pop_back();
+        }
+        fork->running++;
+        held.unlock();
+        (*fork->job)();
+        held.lock();
+        if (--fork->running == 0) {
+            finished.notify_all();
+        }
+    }
+}
+
+// Run `job` on this thread and on up to `helpers` idle threads of the
+// pool at once, and return once every copy has. Copies should share
+// out the work between them, so it's done whether or not any helpers
+// could be had; once this thread's copy is done, helpers that haven't
+// started yet aren't waited for.
+void WorkerPool::fork(int helpers, const std::function<void()>& job) {
+    helpers = std::min(helpers, size());
+    if (helpers <= 0) {
+        job();
+        return;
+    }
+    Fork fork = {&job, helpers, 0};
+    {
+        std::lock_guard<std::mutex> held(lock);
+        forks.push_back(&fork);
+    }
+    wake.notify_all();
+    job();
+
+    std::unique_lock<std::mutex> held(lock);
+    if (fork.wanted > 0) {
+        forks.erase(std::find(forks.begin(), forks.end(), &fork));
+        fork.wanted = 0;
+    }
+    finished.wait(held, [&] { return fork.running == 0; });
+}
+
+// Call work(i) for every i in [0, count), handed out `grain` at a time
+// to every core of `pool` that's free, in order
+template <typename Work>
+static void parallel_for(WorkerPool& pool, int count, int grain, Work work) {
+    std::atomic<int> next(0);
+    int chunks = (count + grain - 1) / grain;
+    pool.fork(chunks - 1, [&] {
+        for (int start; (start = next.fetch_add(grain)) < count; ) {
+            for (int i = start; i < std::min(start + grain, count); i++) {
+                work(i);
+            }
+        }
+    });
+}
+
 //
 // World
 //
@@ -321,15 +1224,39 @@ World::World(int width, int height)
     : width(width), height(height)
 {
     walls = new Block[width * height]();
+    occupancy.resize(width, height);
 }
 
 World::~World() {
     delete[] walls;
 }
 
+// Anything set over a door or thin wall replaces it
 void World::set(int x, int y, Block type) {
     if (x >= 0 && x < width && y >= 0 && y < height) {
+        Doors::Door* door = doors.find(x + width * y);
+        if (door != nullptr) {
+            doors.doors.erase(doors.doors.begin() + (door - doors.doors.data()));
+        }
+    }
+    put(x, y, type);
+}
+
+void World::put(int x, int y, Block type) {
+    if (x >= 0 && x < width && y >= 0 && y < height && walls[x + width * y] != type) {
+        if (!walls[x + width * y] != !type) {
+            occupancy.add(x, y, type ? 1 : -1);
+        }
         walls[x + width * y] = type;
+
+        // Nobody needs history this old, so forget the older half rather
+        // than growing forever. Anyone that far behind starts over.
+        const size_t max_edits = 4096;
+        if (edit_log.size() == max_edits) {
+            edit_log.erase(edit_log.begin(), edit_log.begin() + max_edits / 2);
+            edit_base += max_edits / 2;
+        }
+        edit_log.push_back(x + width * y);
     }
 }
 
@@ -340,6 +1267,145 @@ Block World::get(int x, int y) {
     return OUTER_WALL; // Anything outside of the map is untraversable, so consider it a wall.
 }
 
+Doors::Door* Doors::find(int cell) {
+    auto it = std::lower_bound(doors.begin(), doors.end(), cell, [] (const Door& door, int cell) {
+        return door.cell < cell;
+    });
+    return it != doors.end() && it->cell == cell ? &*it : nullptr;
+}
+
+const Doors::Door* Doors::find(int cell) const {
+    return const_cast<Doors*>(this)->find(cell);
+}
+
+// A shut door, or with `sliding` false a thin wall, across the middle of
+// cell x, y
+void World::placeDoor(int x, int y, Direction along, bool sliding) {
+    if (x < 0 || x >= width || y < 0 || y >= height) {
+        return;
+    }
+    set(x, y, sliding ? DOOR_WALL : THIN_WALL);
+    Doors::Door door;
+    door.cell = x + width * y;
+    door.along = along;
+    door.sliding = sliding;
+    auto it = std::lower_bound(doors.doors.begin(), doors.doors.end(), door.cell, [] (const Doors::Door& d, int cell) {
+        return d.cell < cell;
+    });
+    doors.doors.insert(it, door);
+}
+
+// Start the door at x, y opening, or closing if it's open or on its way.
+// Returns false if there's no door there.
+bool World::toggleDoor(int x, int y) {
+    Doors::Door* door = x >= 0 && x < width && y >= 0 && y < height ? doors.find(x + width * y) : nullptr;
+    if (door == nullptr || !door->sliding) {
+        return false;
+    }
+    door->opening = !door->opening;
+    return true;
+}
+
+// Slide every moving door along. Only doors that finish opening or
+// start closing touch the grid. A door all the way open doesn't start
+// to close until none of `entities` overlaps its cell, since from then
+// on the cell is solid and anything caught in it could never leave.
+void World::moveDoors(float delta, const Entities& entities) {
+    float step = delta / Doors::seconds_to_open;
+    for (Doors::Door& door : doors.doors) {
+        int x = door.cell % width, y = door.cell / width;
+        if (door.opening && door.open < 1) {
+            door.open = std::min(door.open + step, 1.0f);
+            if (door.open == 1) {
+                put(x, y, NO_WALL);
+            }
+        } else if (!door.opening && door.open > 0) {
+            if (walls[door.cell] == NO_WALL) {
+                bool occupied = false;
+                for (int i = 0; i < entities.count && !occupied; i++) {
+                    float dx = entities.pos_x[i] - std::clamp(entities.pos_x[i], (float) x, x + 1.0f);
+                    float dy = entities.pos_y[i] - std::clamp(entities.pos_y[i], (float) y, y + 1.0f);
+                    occupied = dx * dx + dy * dy < entities.radius[i] * entities.radius[i];
+                }
+                if (occupied) {
+                    continue;
+                }
+                put(x, y, DOOR_WALL);
+            }
+            door.open = std::max(door.open - step, 0.0f);
+        }
+    }
+}
+
+const Doors::Door* World::door(int x, int y) const {
+    if (x < 0 || x >= width || y < 0 || y >= height) {
+        return nullptr;
+    }
+    return doors.find(x + width * y);
+}
+
+// Bumped by every change to a cell
+uint64_t World::revision() {
+    return edit_base + edit_log.size();
+}
+
+// Fill `cells` with the grid indices changed after `revision`. Returns
+// false if the log doesn't go back that far, in which case anything
+// might have changed.
+bool World::editsSince(uint64_t revision, std::vector<int>* cells) {
+    cells->clear();
+    if (revision < edit_base) {
+        return false;
+    }
+    cells->assign(edit_log.begin() + (revision - edit_base), edit_log.end());
+    return true;
+}
+
+// Fill `out` with what a copy as of `*revision` needs to catch up, and
+// move `*revision` on to now. A revision of 0 takes everything.
+void World::changes(uint64_t* revision, WorldChanges* out) {
+    out->whole = *revision == 0 || !editsSince(*revision, &out->cells);
+    out->width = width;
+    out->height = height;
+    if (out->whole) {
+        out->cells.clear();
+        out->blocks.assign(walls, walls + (size_t) width * height);
+        out->occupancy = occupancy;
+        out->lights = lights;
+        out->ambient = ambient;
+    } else {
+        out->blocks.resize(out->cells.size());
+        for (size_t n = 0; n < out->cells.size(); n++) {
+            out->blocks[n] = walls[out->cells[n]];
+        }
+    }
+    out->doors = doors;
+    *revision = this->revision();
+}
+
+// Catch up with the world `changes` came from
+void World::apply(const WorldChanges& changes) {
+    if (changes.whole) {
+        if (changes.width != width || changes.height != height) {
+            delete[] walls;
+            width = changes.width;
+            height = changes.height;
+            walls = new Block[(size_t) width * height];
+        }
+        std::copy(changes.blocks.begin(), changes.blocks.end(), walls);
+        occupancy = changes.occupancy;
+        lights = changes.lights;
+        ambient = changes.ambient;
+        edit_base = revision() + 1;
+        edit_log.clear();
+    } else {
+        for (size_t n = 0; n < changes.cells.size(); n++) {
+            put(changes.cells[n] % width, changes.cells[n] / width, changes.blocks[n]);
+        }
+    }
+    doors = changes.doors;
+}
+
 v2 World::nextBoundary(v2 pos, v2 dir, Direction* hit_dir) {
     v2 x_boundary(0, 0);
     float xb_dist;
@@ -371,188 +1437,3061 @@ v2 World::nextBoundary(v2 pos, v2 dir, Direction* hit_dir) {
 WallInfo::WallInfo(Direction dir, Block type) : dir(dir), type(type) {}
 
 v2 World::wallBoundary(v2 pos, v2 dir, WallInfo* wall_info) {
+    v2 hit(0, 0);
     Direction hit_dir;
-    while (pos.x >= 0 && pos.x < width && pos.y >= 0 && pos.y < height) {
-        v2 boundary = nextBoundary(pos, dir, &hit_dir);
-        // Go slightly into the block we're facing so we can floor()
-        v2 test_pos = boundary + dir * 0.0001;
-        int x = floor(test_pos.x), y = floor(test_pos.y);
-        if (get(x, y)) {
-            if (wall_info != nullptr) {
-                *wall_info = WallInfo(hit_dir, get(x, y));
+    Block hit_type;
+    cast_ray(walls, width, height, &occupancy, pos, dir, &hit, &hit_dir, &hit_type, INFINITY, nullptr, 0, nullptr, &doors);
+    if (wall_info != nullptr) {
+        *wall_info = WallInfo(hit_dir, hit_type);
+    }
+    return hit;
+}
+
+// Up to `max_hits` walls along a ray, nearest first: the grates it sees
+// through, then the wall that stops it. The last hit is a grate only if
+// there were more than `max_hits` to go through. Returns the count.
+int World::wallBoundary(v2 pos, v2 dir, WallHit* hits, int max_hits) {
+    int passed = 0;
+    WallHit stop;
+    stop.t = cast_ray(
+        walls, width, height, &occupancy, pos, dir, &stop.point, &stop.dir, &stop.type,
+        INFINITY, hits, max_hits - 1, &passed, &doors
+    );
+    hits[passed] = stop;
+    return passed + 1;
+}
+
+void World::castRays(v2 origin, RayBatch* rays) {
+    kernels.castRays(walls, width, height, &occupancy, origin, rays);
+}
+
+// Whether any cell in [x1, x2] x [y1, y2] is solid. Cells outside the
+// world don't count. Empty blocks are ruled out whole, and blocks lying
+// entirely inside the rect answer from their count, so only blocks
+// straddling the rect's edges get looked into.
+bool World::anySolid(int x1, int y1, int x2, int y2) {
+    x1 = std::max(x1, 0);
+    y1 = std::max(y1, 0);
+    x2 = std::min(x2, width - 1);
+    y2 = std::min(y2, height - 1);
+    if (x1 > x2 || y1 > y2) {
+        return false;
+    }
+
+    auto search = [&] (auto& search, int level, int bx, int by) -> bool {
+        if (level < 0) {
+            return walls[bx + by * width] != NO_WALL;
+        }
+        if (occupancy.count(level, bx, by) == 0) {
+            return false;
+        }
+        int shift = level + 1;
+        int left = bx << shift, top = by << shift;
+        int right = left + (1 << shift) - 1, bottom = top + (1 << shift) - 1;
+        if (left >= x1 && right <= x2 && top >= y1 && bottom <= y2) {
+            return true;
+        }
+        // Children that overlap the rect
+        int cx1 = std::max(bx * 2, x1 >> level), cx2 = std::min(bx * 2 + 1, x2 >> level);
+        int cy1 = std::max(by * 2, y1 >> level), cy2 = std::min(by * 2 + 1, y2 >> level);
+        for (int cy = cy1; cy <= cy2; cy++) {
+            for (int cx = cx1; cx <= cx2; cx++) {
+                if (search(search, level - 1, cx, cy)) {
+                    return true;
+                }
             }
-            return boundary;
         }
-        pos = test_pos;
-    }
-    if (wall_info != nullptr) {
-        *wall_info = WallInfo(hit_dir, OUTER_WALL);
+        return false;
+    };
+    return search(search, (int) occupancy.levels.size() - 1, 0, 0);
+}
+
+// Move a circle by `move`, stopping at walls and sliding along them.
+// Every wall the circle could touch on the way is tested exactly, so
+// any distance is safe to cover in one call, and the result doesn't
+// depend on how the move is split up across frames beyond where the
+// slides happen.
+v2 World::sweepCircle(v2 pos, float radius, v2 move) {
+    // Contacts to slide along, at most. Two covers sliding into a
+    // corner; the third absorbs rounding at the seam between cells.
+    const int max_slides = 3;
+    // Kept between the circle and a wall it stopped at, so the next
+    // slide starts clear of it
+    const float skin = 1e-4;
+
+    for (int slide = 0; slide < max_slides; slide++) {
+        float length = move.size();
+        if (length == 0) {
+            break;
+        }
+
+        // Walk the path in pieces at most a cell long, only testing the
+        // cells near each piece, until no later piece could beat the
+        // earliest hit so far
+        int pieces = std::max((int) ceil(length), 1);
+        float toi = INFINITY;
+        v2 normal(0, 0);
+        for (int piece = 0; piece < pieces && piece / (float) pieces <= toi; piece++) {
+            v2 a = pos + move * (piece / (float) pieces);
+            v2 b = pos + move * ((piece + 1) / (float) pieces);
+            int x1 = floor(fmin(a.x, b.x) - radius), y1 = floor(fmin(a.y, b.y) - radius);
+            int x2 = floor(fmax(a.x, b.x) + radius), y2 = floor(fmax(a.y, b.y) + radius);
+            bool inside = x1 >= 0 && y1 >= 0 && x2 < width && y2 < height;
+            if (inside && !anySolid(x1, y1, x2, y2)) {
+                continue;
+            }
+            for (int y = y1; y <= y2; y++) {
+                for (int x = x1; x <= x2; x++) {
+                    float t;
+                    v2 n(0, 0);
+                    if (get(x, y) &&
+                        sweep_circle_box(pos, radius, move, v2(x, y), v2(x + 1, y + 1), &t, &n) &&
+                        t < toi) {
+                        toi = t;
+                        normal = n;
+                    }
+                }
+            }
+        }
+
+        if (toi > 1) {
+            return pos + move;
+        }
+        // Stop at the wall and keep whatever's left of the move along it
+        pos += move * toi + normal * skin;
+        move *= 1 - toi;
+        move -= normal * move.dot(normal);
     }
     return pos;
 }
 
+// Whether the segment from `from` to `to` stays out of walls. Short
+// lines rarely cross an empty block big enough to pay for looking it
+// up, so only long ones use the occupancy pyramid.
+bool World::clearLine(v2 from, v2 to) {
+    const float skip_length = 32;
+    v2 dir = to - from;
+    const OccupancyPyramid* skip = dir.dot(dir) > skip_length * skip_length ? &occupancy : nullptr;
+    v2 hit(0, 0);
+    Direction hit_dir;
+    Block hit_type;
+    cast_ray(walls, width, height, skip, from, dir, &hit, &hit_dir, &hit_type, 1);
+    return hit_type == NO_WALL;
+}
+
+// Move every circle whose path is clear of walls, flagging the rest in
+// `blocked` for sweepCircle()
+void World::stepCircles(
+    float delta, int count, float* pos_x, float* pos_y,
+    const float* vel_x, const float* vel_y, const float* radius, uint8_t* blocked)
+{
+    kernels.moveClear(walls, width, height, delta, count, pos_x, pos_y, vel_x, vel_y, radius, blocked);
+}
+
+const OccupancyPyramid& World::pyramid() {
+    return occupancy;
+}
+
 //
-// Game
+// OccupancyPyramid
 //
 
-Game::Game(Engine* engine)
-    : engine(engine), world(15, 15), player(v2(4.778035, 0.495602)), view_angle(-0.667112)
-{
-    world.set(6, 6, INNER_WALL);
-    world.set(6, 7, INNER_WALL);
-    world.set(7, 6, INNER_WALL);
-    world.set(8, 6, INNER_WALL);
-    world.set(8, 7, INNER_WALL);
+void OccupancyPyramid::resize(int width, int height) {
+    levels.clear();
+    while (width > 1 || height > 1 || levels.empty()) {
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        Level level;
+        level.width = width;
+        level.height = height;
+        level.counts.assign((size_t) width * height, 0);
+        levels.push_back(std::move(level));
+    }
+}
 
-    dark_wall  = loadSurface("res/dark-wall.bmp", engine->canvas->format->format);
-    light_wall = loadSurface("res/light-wall.bmp", engine->canvas->format->format);
-    sky        = loadSurface("res/cloud.bmp", engine->canvas->format->format);
+// Cell (x, y) became solid (delta 1) or empty (delta -1)
+void OccupancyPyramid::add(int x, int y, int delta) {
+    for (Level& level : levels) {
+        x /= 2;
+        y /= 2;
+        level.counts[x + y * level.width] += delta;
+    }
 }
 
-Game::~Game() {
-    SDL_FreeSurface(dark_wall);
-    SDL_FreeSurface(light_wall);
-    SDL_FreeSurface(sky);
+// Redo every level past the first from the one below it, once the
+// first has been filled in directly
+void OccupancyPyramid::recount() {
+    for (size_t k = 1; k < levels.size(); k++) {
+        Level& level = levels[k];
+        const Level& below = levels[k - 1];
+        std::fill(level.counts.begin(), level.counts.end(), 0);
+        for (int y = 0; y < below.height; y++) {
+            for (int x = 0; x < below.width; x++) {
+                level.counts[x / 2 + (y / 2) * level.width] += below.counts[x + y * below.width];
+            }
+        }
+    }
 }
 
-void Game::update() {
-    { // Move player
-        v2 inp = v2(0, 0);
-        inp.x += engine->input->keyDown(SDL_SCANCODE_A) ? -1.0 : 0.0;
-        inp.x += engine->input->keyDown(SDL_SCANCODE_D) ? +1.0 : 0.0;
-        inp.y += engine->input->keyDown(SDL_SCANCODE_W) ? -1.0 : 0.0;
-        inp.y += engine->input->keyDown(SDL_SCANCODE_S) ? +1.0 : 0.0;
+// Solid cells in block (x, y) of level `level` (0 being 2x2 blocks)
+uint32_t OccupancyPyramid::count(int level, int x, int y) const {
+    const Level& l = levels[level];
+    return l.counts[x + y * l.width];
+}
 
-        // Rotate vector
-        // view angle: 0.0 is -->
-        float rotation = view_angle + M_PI / 2.0; // rotation: 0.0 is ^
-        v2 dir = v2(
-            inp.x * cos(rotation) - inp.y * sin(rotation),
-            inp.x * sin(rotation) + inp.y * cos(rotation)
-        );
-        
-        const float speed = 5.0;
-        v2 next = player + dir * speed * engine->delta;
-
-        const float player_radius = 0.25;
-
-        { // Collide
-            int px = floor(player.x), py = floor(player.y);
-            int horiz_x = px + (dir.x > 0 ? 1 : -1),
-                horiz_y = py;
-            int vert_x  = px,
-                vert_y  = py + (dir.y > 0 ? 1 : -1);
-
-            // We resolve collisions by looking at the three blocks in
-            // the direction we are moving. Depending on which we
-            // intersect, we gradually scoot away until we're in a
-            // good spot.
-            const float fudge_factor = 0.001;
-            size_t limit = 500;
-            bool ok;
-            do {
-                ok = true;
-                // Check the block next to us on the X axis. Slide horizontally.
-                if (world.get(horiz_x, horiz_y) &&
-                    circle_aabb_intersect(
-                        next, player_radius,
-                        v2(horiz_x, horiz_y), v2(horiz_x + 1, horiz_y + 1))) {
-                    ok = false;
-                    next.x -= dir.x * fudge_factor;
-                }
-                // Check the block next to us on the Y axis. Slide vertically.
-                if (world.get(vert_x, vert_y) &&
-                    circle_aabb_intersect(
-                        next, player_radius,
-                        v2(vert_x, vert_y), v2(vert_x + 1, vert_y + 1))) {
-                    ok = false;
-                    next.y -= dir.y * fudge_factor;
-                }
-                // If we're NOT intersecting with the blocks
-                // immediately next to us, make sure we're not walking
-                // into the corner of the block diagonal from
-                // us. Slide vertically if we are.
-                if (ok &&
-                    world.get(horiz_x, vert_y) &&
-                    circle_aabb_intersect(
-                        next, player_radius,
-                        v2(horiz_x, vert_y), v2(horiz_x + 1, vert_y + 1))) {
-                    ok = false;
-                    next.y -= dir.y * fudge_factor;
-                }
-                limit--;
-            } while (!ok && limit > 0);
-            player = next;
+void RayBatch::resize(int count) {
+    this->count = count;
+    dir_x.resize(count);
+    dir_y.resize(count);
+    hit_x.resize(count);
+    hit_y.resize(count);
+    dist.resize(count);
+    hit_dir.resize(count);
+    hit_type.resize(count);
+}
+
+//
+// Level generation
+//
+
+// SplitMix64's finalizer: every bit of `x` affects every bit of the
+// result, and no two inputs give the same one
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+// SplitMix64. Unlike rand(), it's the same everywhere and there can be
+// one per thread, so a seed always makes the same level.
+struct Random {
+    uint64_t state;
+
+    explicit Random(uint64_t seed) : state(seed) {}
+    uint64_t next() {
+        state += 0x9e3779b97f4a7c15;
+        return mix(state);
+    }
+    // In [lo, hi]
+    int range(int lo, int hi) {
+        return lo + (int) ((next() >> 32) * (uint64_t) (hi - lo + 1) >> 32);
+    }
+};
+
+struct LevelRect {
+    int x, y, w, h;
+};
+
+// Open an L-shaped corridor from (x1, y1) to (x2, y2) in a `w` wide
+// grid, going across first or down first
+static void dig(uint8_t* solid, int w, int x1, int y1, int x2, int y2, bool across_first) {
+    int row = across_first ? y1 : y2, column = across_first ? x2 : x1;
+    for (int x = std::min(x1, x2); x <= std::max(x1, x2); x++) {
+        solid[x + row * w] = 0;
+    }
+    for (int y = std::min(y1, y2); y <= std::max(y1, y2); y++) {
+        solid[column + y * w] = 0;
+    }
+}
+
+// Split `r` in two until the pieces are small, put a room in each, and
+// join the halves of every split through a room from each. Returns the
+// room standing in for all of `r`.
+static int split_rooms(Random& random, LevelRect r, uint8_t* solid, int w, std::vector<LevelRect>* rooms) {
+    const int min_leaf = 12;
+    bool across = r.w >= 2 * min_leaf && (r.w >= r.h || r.h < 2 * min_leaf);
+    bool down = !across && r.h >= 2 * min_leaf;
+    if (!across && !down) {
+        // Leave a wall round the room where there's space for one
+        int margin_x = r.w >= 3, margin_y = r.h >= 3;
+        LevelRect room;
+        room.w = random.range(std::min(4, r.w - 2 * margin_x), r.w - 2 * margin_x);
+        room.h = random.range(std::min(4, r.h - 2 * margin_y), r.h - 2 * margin_y);
+        room.x = r.x + random.range(margin_x, r.w - margin_x - room.w);
+        room.y = r.y + random.range(margin_y, r.h - margin_y - room.h);
+        for (int y = room.y; y < room.y + room.h; y++) {
+            memset(solid + room.x + y * w, 0, room.w);
         }
+        rooms->push_back(room);
+        return rooms->size() - 1;
     }
-    { // Rotate player
-        float dir = 0.0;
-        dir += engine->input->keyDown(SDL_SCANCODE_RIGHT) ? +1.0 : 0.0;
-        dir += engine->input->keyDown(SDL_SCANCODE_LEFT)  ? -1.0 : 0.0;
 
-        if (mouse_control) {
-            float amt = engine->input->motion.x;
-            const float sensitivity = 0.2;
-            dir += amt * sensitivity;
+    LevelRect first = r, second = r;
+    if (across) {
+        first.w = random.range(min_leaf, r.w - min_leaf);
+        second.x += first.w;
+        second.w -= first.w;
+    } else {
+        first.h = random.range(min_leaf, r.h - min_leaf);
+        second.y += first.h;
+        second.h -= first.h;
+    }
+    int a = split_rooms(random, first, solid, w, rooms);
+    int b = split_rooms(random, second, solid, w, rooms);
+    const LevelRect& from = (*rooms)[a];
+    const LevelRect& to = (*rooms)[b];
+    dig(solid, w, from.x + from.w / 2, from.y + from.h / 2, to.x + to.w / 2, to.y + to.h / 2, random.next() & 1);
+    return random.next() & 1 ? a : b;
+}
+
+// The cell a region's doorway on `border` is at, in the region
+static void door_cell(int border, int offset, int w, int h, int* x, int* y) {
+    switch (border) {
+    case 0:  *x = offset; *y = 0; break;     // North
+    case 1:  *x = w - 1; *y = offset; break; // East
+    case 2:  *x = offset; *y = h - 1; break; // South
+    default: *x = 0; *y = offset; break;     // West
+    }
+}
+
+static void generate_rooms(Random& random, int w, int h, const int doors[4], uint8_t* solid) {
+    std::vector<LevelRect> rooms;
+    LevelRect all = { 0, 0, w, h };
+    split_rooms(random, all, solid, w, &rooms);
+
+    // Lead each doorway to the nearest room, setting off straight
+    // away from the border
+    for (int b = 0; b < 4; b++) {
+        if (doors[b] < 0) {
+            continue;
         }
-        
-        const float speed = 2.0;
-        view_angle += dir * speed * engine->delta;
-        view_angle = clamp_angle(view_angle);
+        int x, y;
+        door_cell(b, doors[b], w, h, &x, &y);
+        int nearest = 0, best = INT_MAX;
+        for (size_t n = 0; n < rooms.size(); n++) {
+            int distance = abs(rooms[n].x + rooms[n].w / 2 - x) + abs(rooms[n].y + rooms[n].h / 2 - y);
+            if (distance < best) {
+                best = distance;
+                nearest = n;
+            }
+        }
+        const LevelRect& room = rooms[nearest];
+        dig(solid, w, x, y, room.x + room.w / 2, room.y + room.h / 2, b % 2);
     }
-    { // Hotkeys
-        if (engine->input->keyPressed(SDL_SCANCODE_DOWN)) {
-            fov_degrees -= 5.0;
+}
+
+// Cellular automaton over noise: a cell ends up solid if at least 5 of
+// the 3x3 block round it were. The noise comes from hashing where each
+// cell is, and the region is worked on with a margin as wide as the
+// number of rounds, so it comes out as if the whole map had been done
+// at once and caves run on across seams. Then tunnels lead from the
+// doorways to a hub, and whatever the hub can't reach is filled in, so
+// the region is in one piece.
+//
+// Rows are packed 64 cells to a word, and the 9 cells round each one
+// are counted for a whole word at a time by a circuit of adders.
+static void generate_caves(
+    Random& random, uint64_t seed, int x0, int y0, int w, int h, int width, int height,
+    const int doors[4], uint8_t* solid, std::vector<uint64_t>* scratch, std::vector<int>* stack)
+{
+    const int rounds = 4;
+    const int fill = 115; // Out of 256
+    const int m = rounds;
+    int bw = w + 2 * m, bh = h + 2 * m;
+    int words = (bw + 63) / 64;
+    scratch->assign(3 * words * bh + 4 * words, 0);
+    uint64_t* cells = scratch->data();
+    uint64_t* next = cells + words * bh;
+    // Cells that are always solid, in every row that's in the map: the
+    // buffer's own edge, which would need cells beyond it, and
+    // anything off the side of the map
+    uint64_t* solid_columns = next + words * bh;
+    uint64_t* ones = solid_columns + words;
+    uint64_t* twos = ones + words;
+    int first = std::max(m - x0, 1), last = std::min(width - x0 + m, bw - 1);
+    for (int x = 0; x < words * 64; x++) {
+        if (x < first || x >= last) {
+            solid_columns[x / 64] |= 1ull << (x % 64);
         }
-        if (engine->input->keyPressed(SDL_SCANCODE_UP)) {
-            fov_degrees += 5.0;
+    }
+    auto row_solid = [&] (int y) {
+        return y == 0 || y == bh - 1 || y0 - m + y < 0 || y0 - m + y >= height;
+    };
+
+    // One hash makes the noise for 8 cells in a row
+    for (int y = 0; y < bh; y++) {
+        uint64_t* row = cells + y * words;
+        if (row_solid(y)) {
+            memset(row, 0xff, words * sizeof(uint64_t));
+            continue;
         }
-        fov = fov_degrees * (M_PI / 180.0);
-        half_fov = fov / 2.0;
+        // Cells before `first` and from `last` on are made solid after,
+        // so whole runs of 8 can be written past them
+        uint64_t gy = (uint32_t) (y0 - m + y);
+        for (int gx = (x0 - m + first) & ~7; gx < x0 - m + last; gx += 8) {
+            uint64_t bits = mix(seed ^ ((uint64_t) (gx / 8) << 32 | gy)), run = 0;
+            for (int k = 0; k < 8; k++) {
+                run |= (uint64_t) ((bits >> (8 * k) & 0xff) < fill) << k;
+            }
+            int x = gx - (x0 - m);
+            if (x < 0) {
+                run >>= -x;
+                x = 0;
+            }
+            row[x / 64] |= run << (x % 64);
+            if (x % 64 > 56 && x / 64 + 1 < words) {
+                row[x / 64 + 1] |= run >> (64 - x % 64);
+            }
+        }
+        for (int i = 0; i < words; i++) {
+            row[i] |= solid_columns[i];
+        }
+    }
 
-        if (engine->input->keyPressed(SDL_SCANCODE_SPACE)) {
-            if (mouse_control) {
-                SDL_SetRelativeMouseMode(SDL_FALSE);
-                mouse_control = false;
-            } else {
-                SDL_SetRelativeMouseMode(SDL_TRUE);
-                mouse_control = true;
+    for (int round = 0; round < rounds; round++) {
+        for (int y = 0; y < bh; y++) {
+            uint64_t* out = next + y * words;
+            if (row_solid(y)) {
+                memset(out, 0xff, words * sizeof(uint64_t));
+                continue;
+            }
+            // Each column of the three rows summed, as a 2-bit number
+            const uint64_t* above = cells + (y - 1) * words;
+            const uint64_t* row = cells + y * words;
+            const uint64_t* below = cells + (y + 1) * words;
+            for (int i = 0; i < words; i++) {
+                ones[i] = above[i] ^ row[i] ^ below[i];
+                twos[i] = (above[i] & row[i]) | (below[i] & (above[i] ^ row[i]));
+            }
+            // Then three columns of those summed
+            for (int i = 0; i < words; i++) {
+                uint64_t one_left = ones[i] << 1 | (i > 0 ? ones[i - 1] >> 63 : 0);
+                uint64_t one_right = ones[i] >> 1 | (i < words - 1 ? ones[i + 1] << 63 : 0);
+                uint64_t two_left = twos[i] << 1 | (i > 0 ? twos[i - 1] >> 63 : 0);
+                uint64_t two_right = twos[i] >> 1 | (i < words - 1 ? twos[i + 1] << 63 : 0);
+                uint64_t bit1 = one_left ^ ones[i] ^ one_right;
+                uint64_t carry2 = (one_left & ones[i]) | (one_right & (one_left ^ ones[i]));
+                uint64_t sum2 = two_left ^ twos[i] ^ two_right;
+                uint64_t carry4 = (two_left & twos[i]) | (two_right & (two_left ^ twos[i]));
+                uint64_t bit2 = carry2 ^ sum2, carry = carry2 & sum2;
+                uint64_t bit4 = carry4 ^ carry, bit8 = carry4 & carry;
+                out[i] = bit8 | (bit4 & (bit2 | bit1)) | solid_columns[i];
             }
         }
+        std::swap(cells, next);
     }
-    { // Add/remove tiles
-        if (!mouse_control && engine->input->btnPressed(SDL_BUTTON_LEFT)) {
-            v2 mpos = engine->input->mousePos();
-            int x_start = engine->width / 2;
-            if (mpos.x > x_start) {
-                int x = floor((mpos.x - x_start) / ((engine->width / 2) / world.width)),
-                    y = floor(mpos.y / (engine->height / world.height));
-                world.set(x, y, world.get(x, y) ? NO_WALL : INNER_WALL);
+    for (int y = 0; y < h; y++) {
+        const uint64_t* row = cells + (y + m) * words;
+        for (int x = 0; x < w; x++) {
+            solid[x + y * w] = row[(x + m) / 64] >> ((x + m) % 64) & 1;
+        }
+    }
+
+    // The hub is the open cell nearest somewhere in the middle, looking
+    // in growing squares. Most of the open cells are in one big cave,
+    // so that's nearly always where it ends up.
+    int mid_x = random.range(w / 4, w - 1 - w / 4), mid_y = random.range(h / 4, h - 1 - h / 4);
+    int hub_x = mid_x, hub_y = mid_y;
+    bool found = false;
+    for (int r = 0; r < std::max(w, h) && !found; r++) {
+        for (int y = std::max(mid_y - r, 0); y <= std::min(mid_y + r, h - 1) && !found; y++) {
+            // All of the square's top and bottom rows, the ends of the others
+            int step = y == mid_y - r || y == mid_y + r ? 1 : 2 * r;
+            for (int x = mid_x - r; x <= mid_x + r && !found; x += std::max(step, 1)) {
+                if (x >= 0 && x < w && !solid[x + y * w]) {
+                    hub_x = x;
+                    hub_y = y;
+                    found = true;
+                }
+            }
+        }
+    }
+    solid[hub_x + hub_y * w] = 0;
+    for (int b = 0; b < 4; b++) {
+        if (doors[b] >= 0) {
+            int x, y;
+            door_cell(b, doors[b], w, h, &x, &y);
+            dig(solid, w, x, y, hub_x, hub_y, b % 2);
+        }
+    }
+    // Scanline flood fill, marking what it reaches with 2
+    stack->assign(1, hub_x + hub_y * w);
+    while (!stack->empty()) {
+        int p = stack->back();
+        stack->pop_back();
+        if (solid[p]) {
+            continue;
+        }
+        int y = p / w, x1 = p % w, x2 = x1;
+        uint8_t* row = solid + y * w;
+        while (x1 > 0 && !row[x1 - 1]) {
+            x1--;
+        }
+        while (x2 < w - 1 && !row[x2 + 1]) {
+            x2++;
+        }
+        memset(row + x1, 2, x2 - x1 + 1);
+        for (int ny = y - 1; ny <= y + 1; ny += 2) {
+            if (ny < 0 || ny >= h) {
+                continue;
+            }
+            const uint8_t* beside = solid + ny * w;
+            for (int x = x1; x <= x2; x++) {
+                if (!beside[x] && (x == x1 || beside[x - 1])) {
+                    stack->push_back(x + ny * w);
+                }
             }
         }
     }
+    for (int i = 0; i < w * h; i++) {
+        solid[i] = solid[i] != 2;
+    }
 }
 
-void Game::render3D(SDL_Surface* surface, int width, int height) {
-    { // Floor
-        SDL_Rect floor_rect;
-        floor_rect.x = 0;
-        floor_rect.y = height / 2;
-        floor_rect.w = width;
-        floor_rect.h = height / 2;
-        SDL_FillRect(
-            surface, &floor_rect,
-            SDL_MapRGB(surface->format, 0x20, 0x20, 0x20)
-        );
+// Depth-first maze between the cells at odd coordinates. Regions start
+// on even cells, so those line up across seams: a region opens the
+// wall on its north and west borders at its doorways, and the odd cell
+// on the far side of each is already open.
+static void generate_maze(Random& random, int w, int h, const int doors[4], uint8_t* solid, std::vector<int>* stack) {
+    int cells_x = w / 2, cells_y = h / 2;
+    if (!cells_x || !cells_y) {
+        return;
     }
-    { // Sky
-        float percent_sky_visible = fov / (2 * M_PI);
+    // North, east, south and west. Cells on the stack are x | y << 16.
+    const int steps[4] = { -w, 1, w, -1 };
+    const int step_x[4] = { 0, 1, 0, -1 }, step_y[4] = { -1, 0, 1, 0 };
+    int start_x = random.range(0, cells_x - 1), start_y = random.range(0, cells_y - 1);
+    solid[(2 * start_x + 1) + (2 * start_y + 1) * w] = 0;
+    stack->assign(1, start_x | start_y << 16);
+    while (!stack->empty()) {
+        int cx = stack->back() & 0xffff, cy = stack->back() >> 16;
+        int p = (2 * cx + 1) + (2 * cy + 1) * w;
+        int options[4], count = 0;
+        if (cy > 0 && solid[p - 2 * w]) {
+            options[count++] = 0;
+        }
+        if (cx < cells_x - 1 && solid[p + 2]) {
+            options[count++] = 1;
+        }
+        if (cy < cells_y - 1 && solid[p + 2 * w]) {
+            options[count++] = 2;
+        }
+        if (cx > 0 && solid[p - 2]) {
+            options[count++] = 3;
+        }
+        if (!count) {
+            stack->pop_back();
+            continue;
+        }
+        int step = options[count > 1 ? random.range(0, count - 1) : 0];
+        solid[p + steps[step]] = 0;
+        solid[p + 2 * steps[step]] = 0;
+        stack->push_back((cx + step_x[step]) | (cy + step_y[step]) << 16);
+    }
+    if (doors[0] >= 0) {
+        solid[doors[0]] = 0;
+    }
+    if (doors[3] >= 0) {
+        solid[doors[3] * w] = 0;
+    }
+}
 
-        if (view_angle - half_fov >= 0 && view_angle + half_fov < 2 * M_PI) {
-            // No tiling necessary
-            SDL_Rect src;
-            src.x = (view_angle - half_fov) / (2 * M_PI) * sky->w;
-            src.y = 0;
+// Replace the level with a new one, `width` by `height`, of `style`.
+// The map is cut into regions that are made on their own, across the
+// cores of `pool`. Regions share nothing but where the doorways through the seams
+// between them go, which is worked out from each seam's own seed, so a
+// seed makes the same level however many threads there are.
+void World::generate(WorkerPool& pool, int width, int height, LevelStyle style, uint64_t seed) {
+    const int region_size = 256;
+    if (width != this->width || height != this->height) {
+        delete[] walls;
+        this->width = width;
+        this->height = height;
+        walls = new Block[(size_t) width * height];
+        occupancy.resize(width, height);
+    }
+
+    // The last region of each row and column takes what's left, so
+    // none are slivers
+    int regions_x = std::max(width / region_size, 1), regions_y = std::max(height / region_size, 1);
+    auto span = [&] (int index, int count, int size, int* start, int* length) {
+        *start = index * region_size;
+        *length = index == count - 1 ? size - *start : region_size;
+    };
+    // An odd offset along a seam, the same from both sides
+    auto doorway = [&] (int seam, int length) {
+        Random random(mix(seed ^ mix(2 * seam + 1)));
+        return length >= 3 ? 1 + 2 * random.range(0, (length - 3) / 2) : 0;
+    };
+    seed = mix(seed ^ style);
+
+    std::atomic<int> next_region(0);
+    OccupancyPyramid::Level& blocks = occupancy.levels[0];
+    auto work = [&] {
+        std::vector<uint8_t> solid;
+        std::vector<uint64_t> scratch;
+        std::vector<int> stack;
+        for (int r; (r = next_region++) < regions_x * regions_y; ) {
+            int rx = r % regions_x, ry = r / regions_x;
+            int x0, y0, w, h;
+            span(rx, regions_x, width, &x0, &w);
+            span(ry, regions_y, height, &y0, &h);
+            // A seam is named after the region to its south or east
+            int doors[4] = {
+                ry > 0 ? doorway(2 * r, w) : -1,
+                rx < regions_x - 1 ? doorway(2 * (r + 1) + 1, h) : -1,
+                ry < regions_y - 1 ? doorway(2 * (r + regions_x), w) : -1,
+                rx > 0 ? doorway(2 * r + 1, h) : -1,
+            };
+
+            Random random(mix(seed ^ mix(~(uint64_t) r)));
+            solid.assign((size_t) w * h, 1);
+            switch (style) {
+            case LEVEL_ROOMS: generate_rooms(random, w, h, doors, solid.data()); break;
+            case LEVEL_CAVES: generate_caves(random, seed, x0, y0, w, h, width, height, doors, solid.data(), &scratch, &stack); break;
+            case LEVEL_MAZE:  generate_maze(random, w, h, doors, solid.data(), &stack); break;
+            }
+
+            for (int y = 0; y < h; y++) {
+                Block* row = walls + x0 + (size_t) (y0 + y) * width;
+                for (int x = 0; x < w; x++) {
+                    row[x] = solid[x + y * w] ? INNER_WALL : NO_WALL;
+                }
+            }
+            // Regions start on even cells, so none shares a 2x2 block
+            for (int y = 0; y < h; y += 2) {
+                for (int x = 0; x < w; x += 2) {
+                    uint32_t count = solid[x + y * w];
+                    count += x + 1 < w && solid[x + 1 + y * w];
+                    count += y + 1 < h && solid[x + (y + 1) * w];
+                    count += x + 1 < w && y + 1 < h && solid[x + 1 + (y + 1) * w];
+                    blocks.counts[(x0 + x) / 2 + (size_t) (y0 + y) / 2 * blocks.width] = count;
+                }
+            }
+        }
+    };
+    pool.fork(regions_x * regions_y - 1, work);
+    occupancy.recount();
+
+    // A light in an open cell of every block of the map that has one
+    // where it looks
+    const int light_spacing = 16;
+    Random random(mix(seed ^ mix(light_spacing)));
+    doors.doors.clear();
+    lights.clear();
+    ambient = 0.35;
+    for (int by = 0; by < height; by += light_spacing) {
+        for (int bx = 0; bx < width; bx += light_spacing) {
+            for (int tries = 0; tries < 8; tries++) {
+                int x = bx + random.range(0, std::min(light_spacing, width - bx) - 1);
+                int y = by + random.range(0, std::min(light_spacing, height - by) - 1);
+                if (!walls[x + (size_t) y * width]) {
+                    lights.push_back({v2(x + 0.5f, y + 0.5f), 12, 1});
+                    break;
+                }
+            }
+        }
+    }
+
+    // Everything changed: start the log after anyone's last look, so
+    // they all start over
+    edit_base = revision() + 1;
+    edit_log.clear();
+}
+
+//
+// Entities
+//
+
+EntityHandle Entities::spawn(EntityType type, v2 pos, v2 vel, float radius, float angle) {
+    uint32_t slot;
+    if (free_slots.empty()) {
+        slot = slots.size();
+        slots.push_back({0, 1});
+    } else {
+        slot = free_slots.back();
+        free_slots.pop_back();
+    }
+    slots[slot].index = count;
+    slot_of.push_back(slot);
+
+    pos_x.push_back(pos.x);
+    pos_y.push_back(pos.y);
+    vel_x.push_back(vel.x);
+    vel_y.push_back(vel.y);
+    this->radius.push_back(radius);
+    this->angle.push_back(angle);
+    this->type.push_back(type);
+    count++;
+
+    EntityHandle handle;
+    handle.slot = slot;
+    handle.generation = slots[slot].generation;
+    return handle;
+}
+
+// Stale handles are ignored
+void Entities::remove(EntityHandle handle) {
+    int i = index(handle);
+    if (i >= 0) {
+        removeAt(i);
+    }
+}
+
+// Move the last entity into `i`'s place. Anything iterating while
+// removing should go from the back, so the moved entity has already
+// been seen.
+void Entities::removeAt(int i) {
+    int last = count - 1;
+    uint32_t slot = slot_of[i];
+    slots[slot].generation++;
+    free_slots.push_back(slot);
+
+    pos_x[i] = pos_x[last];
+    pos_y[i] = pos_y[last];
+    vel_x[i] = vel_x[last];
+    vel_y[i] = vel_y[last];
+    radius[i] = radius[last];
+    angle[i] = angle[last];
+    type[i] = type[last];
+    slot_of[i] = slot_of[last];
+    slots[slot_of[i]].index = i;
+
+    pos_x.pop_back();
+    pos_y.pop_back();
+    vel_x.pop_back();
+    vel_y.pop_back();
+    radius.pop_back();
+    angle.pop_back();
+    type.pop_back();
+    slot_of.pop_back();
+    count--;
+}
+
+// Where the entity is now, or -1 if it's gone
+int Entities::index(EntityHandle handle) {
+    if (handle.slot >= slots.size() || slots[handle.slot].generation != handle.generation) {
+        return -1;
+    }
+    return slots[handle.slot].index;
+}
+
+EntityHandle Entities::handle(int i) {
+    EntityHandle handle;
+    handle.slot = slot_of[i];
+    handle.generation = slots[handle.slot].generation;
+    return handle;
+}
+
+v2 Entities::position(int i) {
+    return v2(pos_x[i], pos_y[i]);
+}
+
+v2 Entities::velocity(int i) {
+    return v2(vel_x[i], vel_y[i]);
+}
+
+// Advance everyone by their velocity, stopping at walls. Projectiles
+// are spent on the first wall they touch. Most entities are nowhere
+// near a wall, and move in one vectorized pass; only the rest take
+// the exact sweep.
+void Entities::move(World& world, float delta) {
+    blocked.resize(count);
+    world.stepCircles(
+        delta, count, pos_x.data(), pos_y.data(),
+        vel_x.data(), vel_y.data(), radius.data(), blocked.data()
+    );
+    for (int i = count - 1; i >= 0; i--) {
+        if (!blocked[i]) {
+            continue;
+        }
+        v2 step = velocity(i) * delta;
+        v2 wanted = position(i) + step;
+        v2 got = world.sweepCircle(position(i), radius[i], step);
+        pos_x[i] = got.x;
+        pos_y[i] = got.y;
+        if (type[i] == ENTITY_PROJECTILE && (got.x != wanted.x || got.y != wanted.y)) {
+            removeAt(i);
+        }
+    }
+}
+
+// Settle overlaps between entities. Projectiles take out the first
+// enemy they touch, along with themselves; bodies push each other apart
+// evenly, stopping at walls.
+void Entities::collide(World& world, SpatialHash* hash) {
+    hash->build(*this);
+    hash->overlaps(*this, &contacts);
+
+    dead.clear();
+    for (auto [a, b] : contacts) {
+        bool projectile_a = type[a] == ENTITY_PROJECTILE, projectile_b = type[b] == ENTITY_PROJECTILE;
+        if (projectile_a || projectile_b) {
+            if (projectile_a != projectile_b && type[projectile_a ? b : a] == ENTITY_ENEMY) {
+                dead.push_back(handle(a));
+                dead.push_back(handle(b));
+            }
+            continue;
+        }
+
+        v2 offset = position(b) - position(a);
+        float distance = offset.size();
+        v2 normal = distance > 0 ? offset / distance : v2(1, 0);
+        v2 push = normal * ((radius[a] + radius[b] - distance) / 2);
+        v2 pa = world.sweepCircle(position(a), radius[a], push * -1);
+        v2 pb = world.sweepCircle(position(b), radius[b], push);
+        pos_x[a] = pa.x;
+        pos_y[a] = pa.y;
+        pos_x[b] = pb.x;
+        pos_y[b] = pb.y;
+    }
+    // Handles, since every removal shuffles indices. An entity hit
+    // twice is only removed once.
+    for (EntityHandle handle : dead) {
+        remove(handle);
+    }
+}
+
+//
+// SpatialHash
+//
+
+uint32_t SpatialHash::bucket(int x, int y) {
+    return ((uint32_t) x * 73856093u ^ (uint32_t) y * 19349663u) & mask;
+}
+
+void SpatialHash::build(Entities& entities, bool covering) {
+    uint32_t buckets = 1;
+    while (buckets < (uint32_t) entities.count * 2) {
+        buckets *= 2;
+    }
+    mask = buckets - 1;
+    starts.assign(buckets + 1, 0);
+
+    // Calls `visit` with each bucket entity i goes in
+    auto buckets_of = [&] (int i, auto visit) {
+        float x = entities.pos_x[i], y = entities.pos_y[i], r = entities.radius[i];
+        if (!covering) {
+            visit(bucket(floor(x), floor(y)));
+            return;
+        }
+        int x1 = floor(x - r), x2 = floor(x + r);
+        int y1 = floor(y - r), y2 = floor(y + r);
+        for (int cy = y1; cy <= y2; cy++) {
+            for (int cx = x1; cx <= x2; cx++) {
+                visit(bucket(cx, cy));
+            }
+        }
+    };
+
+    max_radius = 0;
+    for (int i = 0; i < entities.count; i++) {
+        buckets_of(i, [&] (uint32_t b) { starts[b + 1]++; });
+        max_radius = fmax(max_radius, entities.radius[i]);
+    }
+    for (uint32_t b = 0; b < buckets; b++) {
+        starts[b + 1] += starts[b];
+    }
+    uint32_t total = starts[buckets];
+    items.resize(total);
+    // Fill each bucket from its end, leaving starts[b] at its start
+    for (int i = entities.count - 1; i >= 0; i--) {
+        buckets_of(i, [&] (uint32_t b) { items[--starts[b + 1]] = i; });
+    }
+    for (uint32_t b = 0; b < buckets; b++) {
+        starts[b] = starts[b + 1];
+    }
+    starts[buckets] = total;
+}
+
+// Every overlapping pair, once each, lower index first. Only for
+// hashes built by center.
+void SpatialHash::overlaps(Entities& entities, std::vector<std::pair<int, int>>* pairs) {
+    pairs->clear();
+    for (int i = 0; i < entities.count; i++) {
+        float x = entities.pos_x[i], y = entities.pos_y[i], r = entities.radius[i];
+        float reach = r + max_radius;
+        int x1 = floor(x - reach), x2 = floor(x + reach);
+        int y1 = floor(y - reach), y2 = floor(y + reach);
+
+        for (int cy = y1; cy <= y2; cy++) {
+            for (int cx = x1; cx <= x2; cx++) {
+                uint32_t b = bucket(cx, cy);
+                for (uint32_t k = starts[b]; k < starts[b + 1]; k++) {
+                    // Other cells can share the bucket. Taking each
+                    // entity only from its own cell sees it once.
+                    int j = items[k];
+                    if (j <= i || (int) floor(entities.pos_x[j]) != cx || (int) floor(entities.pos_y[j]) != cy) {
+                        continue;
+                    }
+                    float dx = entities.pos_x[j] - x, dy = entities.pos_y[j] - y;
+                    float touching = r + entities.radius[j];
+                    if (dx * dx + dy * dy < touching * touching) {
+                        pairs->emplace_back(i, j);
+                    }
+                }
+            }
+        }
+    }
+}
+
+//
+// LineOfSight
+//
+
+// Queue a check, to be answered by the next resolve(). Returns the
+// ticket to look the answer up by.
+int LineOfSight::ask(v2 from, v2 to) {
+    Query query;
+    query.from = from;
+    query.to = to;
+    queries.push_back(query);
+    return queries.size() - 1;
+}
+
+// Bits of x and y interleaved, so cells near each other in 2D mostly
+// get keys near each other
+static uint32_t morton(uint16_t x, uint16_t y) {
+    auto spread = [] (uint32_t v) {
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+// Answer every queued check, then start a new batch. On maps too big
+// to stay in cache, queries are walked grouped by the 16x16 tile they
+// start in, tiles in Morton order, so neighbouring rays find their
+// cells already loaded. Smaller maps stay cached anyway, and sorting
+// would only cost time.
+void LineOfSight::resolve(World& world) {
+    const size_t cached_map_bytes = 2 << 20;
+    bool sort = (size_t) world.width * world.height * sizeof(Block) > cached_map_bytes;
+
+    int count = queries.size();
+    uint32_t all_bits = 0;
+    for (int i = 0; i < count; i++) {
+        v2 from = queries[i].from;
+        uint32_t x = std::min(std::max((int) from.x, 0), 0xffff);
+        uint32_t y = std::min(std::max((int) from.y, 0), 0xffff);
+        queries[i].tile = morton(x >> 4, y >> 4);
+        queries[i].ticket = i;
+        all_bits |= queries[i].tile;
+    }
+
+    // Radix sort the queries themselves, so the walk below reads them
+    // in order. A byte at a time, skipping bytes no key uses, which on
+    // small maps is most of them.
+    sorted.resize(count);
+    for (int shift = 0; shift < 32; shift += 8) {
+        if (!sort || ((all_bits >> shift) & 0xff) == 0) {
+            continue;
+        }
+        uint32_t starts[257] = {};
+        for (const Query& query : queries) {
+            starts[((query.tile >> shift) & 0xff) + 1]++;
+        }
+        for (int b = 0; b < 256; b++) {
+            starts[b + 1] += starts[b];
+        }
+        for (const Query& query : queries) {
+            sorted[starts[(query.tile >> shift) & 0xff]++] = query;
+        }
+        queries.swap(sorted);
+    }
+
+    visible.assign((count + 63) / 64, 0);
+    for (const Query& query : queries) {
+        if (world.clearLine(query.from, query.to)) {
+            visible[query.ticket / 64] |= (uint64_t) 1 << (query.ticket % 64);
+        }
+    }
+    answered = count;
+    queries.clear();
+}
+
+// The answer to ticket `ticket` from the last resolve()
+bool LineOfSight::result(int ticket) {
+    return ticket < answered && (visible[ticket / 64] >> (ticket % 64)) & 1;
+}
+
+//
+// Hitscan
+//
+
+// Queue a shot, to be resolved by the next resolve(). Returns the index
+// of its hit. `shooter` can't hit itself.
+int Hitscan::fire(v2 origin, v2 dir, float range, EntityHandle shooter) {
+    Shot shot;
+    shot.origin = origin;
+    shot.dir = dir / dir.size();
+    shot.range = range;
+    shot.shooter = shooter;
+    shots.push_back(shot);
+    return shots.size() - 1;
+}
+
+// Where a ray from `origin` along unit `dir` first meets the circle, if
+// it does at or after t = 0
+static bool ray_circle(v2 origin, v2 dir, v2 center, float radius, float* t) {
+    v2 f = origin - center;
+    float b = f.dot(dir), c = f.dot(f) - radius * radius;
+    float discriminant = b * b - c;
+    if (discriminant < 0) {
+        return false;
+    }
+    float root = sqrt(discriminant);
+    *t = -b - root;
+    if (*t < 0) {
+        // Starting inside the circle counts as hitting it straight away
+        if (-b + root < 0) {
+            return false;
+        }
+        *t = 0;
+    }
+    return true;
+}
+
+// Resolve every queued shot against walls and entities, then start a
+// new batch. Entities are registered in every cell they overlap, once
+// per batch; each shot walks the grid and only tests entities in the
+// cells it passes through, so no shot ever looks at every entity.
+//
+// Doors and thin walls stop shots on their plane, as cast_ray() does,
+// and the part of a door that's slid open lets them by. Grates stop
+// them at the cell edge like any other wall, which is where they're
+// drawn: the gaps are for seeing through, not shooting through.
+void Hitscan::resolve(World& world, Entities& entities) {
+    cells.build(entities, true);
+    hits.resize(shots.size());
+
+    for (size_t n = 0; n < shots.size(); n++) {
+        const Shot& shot = shots[n];
+        Hit& hit = hits[n];
+        int shooter = entities.index(shot.shooter);
+
+        v2 origin = shot.origin, dir = shot.dir;
+        int x = floor(origin.x), y = floor(origin.y);
+        int step_x = dir.x > 0 ? 1 : -1, step_y = dir.y > 0 ? 1 : -1;
+        float delta_x = dir.x == 0 ? 1e30f : fabs(1.0f / dir.x);
+        float delta_y = dir.y == 0 ? 1e30f : fabs(1.0f / dir.y);
+        float side_x = (dir.x > 0 ? (x + 1) - origin.x : origin.x - x) * delta_x;
+        float side_y = (dir.y > 0 ? (y + 1) - origin.y : origin.y - y) * delta_y;
+
+        // The nearest entity so far. Any cell the ray enters after it
+        // can't hold anything nearer.
+        float best = shot.range;
+        int target = -1;
+        float t = 0;
+        bool vertical = false;
+        Block wall = NO_WALL;
+        auto test_cell = [&] {
+            uint32_t b = cells.bucket(x, y);
+            for (uint32_t k = cells.starts[b]; k < cells.starts[b + 1]; k++) {
+                int i = cells.items[k];
+                float hit_t;
+                if (i != shooter &&
+                    ray_circle(origin, dir, entities.position(i), entities.radius[i], &hit_t) &&
+                    hit_t < best) {
+                    best = hit_t;
+                    target = i;
+                }
+            }
+        };
+        while (t <= best) {
+            test_cell();
+
+            vertical = side_x < side_y;
+            if (vertical) {
+                t = side_x;
+                x += step_x;
+                side_x += delta_x;
+            } else {
+                t = side_y;
+                y += step_y;
+                side_y += delta_y;
+            }
+            wall = world.get(x, y);
+            if (wall == DOOR_WALL || wall == THIN_WALL) {
+                // Stopped where it's drawn, on the plane through the
+                // middle of the cell, by whoever's in front of that
+                float plane_t;
+                bool along_x;
+                if (!door_plane(world.door(x, y), x, y, origin, dir, t, std::min(side_x, side_y), &plane_t, &along_x)) {
+                    wall = NO_WALL;
+                    continue;
+                }
+                t = plane_t;
+                vertical = !along_x;
+                test_cell();
+            }
+            if (wall != NO_WALL) {
+                break;
+            }
+        }
+
+        if (target >= 0 && best <= t) {
+            hit.kind = HIT_ENTITY;
+            hit.dist = best;
+            hit.point = origin + dir * best;
+            hit.normal = (hit.point - entities.position(target)) / entities.radius[target];
+            hit.entity = entities.handle(target);
+        } else if (wall != NO_WALL && t <= shot.range) {
+            hit.kind = HIT_WALL;
+            hit.dist = t;
+            hit.point = origin + dir * t;
+            hit.normal = vertical ? v2(-step_x, 0) : v2(0, -step_y);
+            hit.wall = wall;
+            hit.wall_dir = vertical ? VERTICAL : HORIZONTAL;
+        } else {
+            hit.kind = HIT_NOTHING;
+            hit.dist = shot.range;
+            hit.point = origin + dir * shot.range;
+        }
+    }
+    shots.clear();
+}
+
+//
+// FlowField
+//
+
+void FlowField::touch(int cell) {
+    dirty_first = std::min(dirty_first, cell);
+    dirty_last = std::max(dirty_last, cell);
+}
+
+// Breadth-first out from `seeds`, only ever lowering costs. The queue
+// is a pair of buckets, for the cost being expanded and the one after,
+// with seeds fed in as the wave reaches their cost. Cells come out in
+// the order the wave reaches them, which keeps the neighbours being
+// looked at close to the ones just written.
+void FlowField::flood() {
+    const int offsets[] = { 1, stride, -1, -stride };
+    std::sort(seeds.begin(), seeds.end());
+
+    size_t next_seed = 0;
+    uint32_t c = 0;
+    while (next_seed < seeds.size() || !buckets[c & 1].empty()) {
+        if (buckets[c & 1].empty()) {
+            c = seeds[next_seed].first;
+        }
+        std::vector<int>& bucket = buckets[c & 1];
+        std::vector<int>& next = buckets[~c & 1];
+        for (; next_seed < seeds.size() && seeds[next_seed].first == c; next_seed++) {
+            bucket.push_back(seeds[next_seed].second);
+        }
+
+        for (size_t i = 0; i < bucket.size(); i++) {
+            int p = bucket[i];
+            if (cost[p] != c) {
+                continue; // Reached more cheaply since it was queued
+            }
+            for (int offset : offsets) {
+                // Walls have cost 0, so they're never lowered
+                int q = p + offset;
+                if (c + 1 < cost[q]) {
+                    cost[q] = c + 1;
+                    next.push_back(q);
+                    touch(q);
+                }
+            }
+        }
+        bucket.clear();
+        c++;
+    }
+    seeds.clear();
+}
+
+// Read every cell of the world afresh
+void FlowField::load(World& world) {
+    width = world.width;
+    height = world.height;
+    stride = width + 2;
+    cost.assign(stride * (height + 2), 0);
+    steps.assign(stride * (height + 2), NO_STEP);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            cost[(x + 1) + (y + 1) * stride] = world.get(x, y) ? 0 : UINT32_MAX;
+        }
+    }
+}
+
+// Flood the whole field again from the target
+void FlowField::rebuild() {
+    for (uint32_t& c : cost) {
+        c = c ? UINT32_MAX : 0;
+    }
+    // The target counts as open even if it's in a wall
+    int target = (target_x + 1) + (target_y + 1) * stride;
+    cost[target] = 1;
+    seeds.assign(1, std::make_pair(1u, target));
+    flood();
+    orient(1, height);
+}
+
+// Patch the field up after the cells in `edits` changed. New walls
+// take away the cost of every cell that no longer has a shortest path
+// left, and the holes that leaves, along with the cells around new
+// openings, are flooded again from their edges. Open areas have so many
+// equally short paths that a new wall rarely costs more than the cells
+// right behind it.
+void FlowField::repair(World& world) {
+    const int offsets[] = { 1, stride, -1, -stride };
+    dirty_first = INT_MAX;
+    dirty_last = -1;
+
+    // New walls go in first, as seeds to spread the loss of cost from
+    size_t opened = 0;
+    for (int e : edits) {
+        int p = (e % width + 1) + (e / width + 1) * stride;
+        bool open = world.get(e % width, e / width) == NO_WALL;
+        if (!open && cost[p]) {
+            if (cost[p] != UINT32_MAX) {
+                seeds.push_back(std::make_pair(cost[p], p));
+            }
+            cost[p] = 0;
+            touch(p);
+        } else if (open && !cost[p]) {
+            cost[p] = UINT32_MAX;
+            edits[opened++] = p;
+            touch(p);
+        }
+    }
+    edits.resize(opened);
+
+    // A cell keeps its cost as long as one neighbour is a step nearer.
+    // Going out in order of the cost lost means every neighbour that
+    // might have lost it too already has.
+    auto supported = [&] (int cell) {
+        for (int offset : offsets) {
+            if (cost[cell + offset] == cost[cell] - 1) {
+                return true;
+            }
+        }
+        return false;
+    };
+    std::sort(seeds.begin(), seeds.end());
+    stale.clear();
+    size_t next_seed = 0;
+    uint32_t c = 0;
+    while (next_seed < seeds.size() || !buckets[c & 1].empty()) {
+        if (buckets[c & 1].empty()) {
+            c = seeds[next_seed].first;
+        }
+        std::vector<int>& bucket = buckets[c & 1];
+        for (; next_seed < seeds.size() && seeds[next_seed].first == c; next_seed++) {
+            bucket.push_back(seeds[next_seed].second);
+        }
+        for (int p : bucket) {
+            for (int offset : offsets) {
+                int q = p + offset;
+                if (cost[q] == c + 1 && !supported(q)) {
+                    cost[q] = UINT32_MAX;
+                    buckets[~c & 1].push_back(q);
+                    stale.push_back(q);
+                    touch(q);
+                }
+            }
+        }
+        bucket.clear();
+        c++;
+    }
+    seeds.clear();
+
+    for (int list = 0; list < 2; list++) {
+        for (int p : list ? edits : stale) {
+            for (int offset : offsets) {
+                int n = p + offset;
+                if (cost[n] && cost[n] != UINT32_MAX) {
+                    seeds.push_back(std::make_pair(cost[n], n));
+                }
+            }
+        }
+    }
+    flood();
+
+    // A cell's step looks at the neighbours around it
+    if (dirty_last >= 0) {
+        orient(std::max(dirty_first / stride - 1, 1), std::min(dirty_last / stride + 1, height));
+    }
+}
+
+// Work out the steps of padded rows y1 to y2
+void FlowField::orient(int y1, int y2) {
+    redone_first = std::min(redone_first, y1);
+    redone_last = std::max(redone_last, y2);
+    for (int y = y1; y <= y2; y++) {
+        int p = 1 + y * stride;
+        kernels.flowSteps(cost.data() + p, stride, width, steps.data() + p);
+    }
+}
+
+// Bring the field up to date with `target` and the world. A target
+// that moves to another cell changes the cost of nearly every cell, so
+// that rebuilds the field; wall edits only redo the part of the field
+// they affect. Otherwise this costs nothing.
+void FlowField::update(World& world, v2 target) {
+    int x = std::min(std::max((int) floor(target.x), 0), world.width - 1);
+    int y = std::min(std::max((int) floor(target.y), 0), world.height - 1);
+
+    bool known = world.width == width && world.height == height && world.editsSince(revision, &edits);
+    bool moved = x != target_x || y != target_y;
+    redone_first = INT_MAX;
+    redone_last = -1;
+    if (!known) {
+        target_x = x;
+        target_y = y;
+        load(world);
+        rebuild();
+    } else if (moved || edits.size() > (size_t) width * height / 64 ||
+               std::find(edits.begin(), edits.end(), x + y * width) != edits.end()) {
+        // The old target goes back to being whatever its cell really is
+        edits.push_back(target_x + target_y * width);
+        for (int e : edits) {
+            cost[(e % width + 1) + (e / width + 1) * stride] = world.get(e % width, e / width) ? 0 : UINT32_MAX;
+        }
+        target_x = x;
+        target_y = y;
+        rebuild();
+    } else if (!edits.empty()) {
+        repair(world);
+    } else {
+        return;
+    }
+    revision = world.revision();
+
+    // The copy being written was current two updates ago, so it only
+    // needs the rows this update and the last one redid, unless it's
+    // from another map
+    Published& back = current.load(std::memory_order_relaxed) == &published[0] ? published[1] : published[0];
+    if (back.steps.size() != steps.size() || back.stride != stride) {
+        back.steps = steps;
+    } else {
+        for (auto [first, last] : {std::make_pair(missed_first, missed_last), std::make_pair(redone_first, redone_last)}) {
+            if (first <= last) {
+                std::copy(steps.begin() + first * stride, steps.begin() + (last + 1) * stride, back.steps.begin() + first * stride);
+            }
+        }
+    }
+    back.width = width;
+    back.height = height;
+    back.stride = stride;
+    missed_first = redone_first;
+    missed_last = redone_last;
+    current.store(&back, std::memory_order_release);
+}
+
+// Which neighbour of cell (x, y) to step to next, or NO_STEP at the
+// target, in walls, and where the target can't be reached
+uint8_t FlowField::step(int x, int y) const {
+    const Published* field = current.load(std::memory_order_acquire);
+    if (!field || x < 0 || x >= field->width || y < 0 || y >= field->height) {
+        return NO_STEP;
+    }
+    return field->steps[(x + 1) + (y + 1) * field->stride];
+}
+
+// Unit vector from `pos` to the middle of the next cell on its way to
+// the target, or zero if there's no next cell
+v2 FlowField::direction(v2 pos) const {
+    int x = floor(pos.x), y = floor(pos.y);
+    uint8_t k = step(x, y);
+    if (k == NO_STEP) {
+        return v2(0, 0);
+    }
+    v2 to = v2(x + flow_dx[k] + 0.5f, y + flow_dy[k] + 0.5f) - pos;
+    float length = to.size();
+    return length > 0 ? to / length : v2(0, 0);
+}
+
+//
+// Pathfinder
+//
+
+static const uint32_t straight_cost = 5, diagonal_cost = 7;
+
+// Cost of the cheapest path dx by dy cells with nothing in the way
+static uint32_t octile(int dx, int dy) {
+    dx = abs(dx);
+    dy = abs(dy);
+    return straight_cost * std::max(dx, dy) + (diagonal_cost - straight_cost) * std::min(dx, dy);
+}
+
+// The cells of `span` x `span` clusters, padded with a ring of walls
+// so searches never leave them
+template <int span>
+struct ClusterGrid {
+    static constexpr int stride = span * Pathfinder::cluster_size + 2;
+    int x0, y0;
+    uint8_t open[stride * stride] = {};
+
+    ClusterGrid(World& world, int cx, int cy)
+        : x0(cx * Pathfinder::cluster_size), y0(cy * Pathfinder::cluster_size)
+    {
+        int w = std::min(span * Pathfinder::cluster_size, world.width - x0);
+        int h = std::min(span * Pathfinder::cluster_size, world.height - y0);
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                open[at(x0 + x, y0 + y)] = world.get(x0 + x, y0 + y) == NO_WALL;
+            }
+        }
+    }
+    int at(int x, int y) const {
+        return (x - x0 + 1) + (y - y0 + 1) * stride;
+    }
+    int cell(int index, int width) const {
+        return at(index % width, index / width);
+    }
+    v2 center(int p) const {
+        return v2(x0 + p % stride - 0.5f, y0 + p / stride - 0.5f);
+    }
+};
+
+// Cheapest cost from `start` to every cell of the grid, or 0xffff where
+// it can't be reached. Dijkstra, with a bucket of cells for each cost:
+// no step costs more than 7, so eight of them go round in a ring.
+template <typename Grid>
+static void cluster_costs(const Grid& grid, int start, uint16_t* costs) {
+    const int stride = Grid::stride;
+    const int ring = 8;
+    int offsets[8];
+    for (int k = 0; k < 8; k++) {
+        offsets[k] = flow_dx[k] + flow_dy[k] * stride;
+    }
+    std::fill(costs, costs + stride * stride, 0xffff);
+    // A bucket only holds one cost at a time, so a cell at most once
+    uint16_t buckets[ring][stride * stride];
+    int sizes[ring] = {}, queued = 1;
+    costs[start] = 0;
+    buckets[0][sizes[0]++] = start;
+    for (uint32_t c = 0; queued; c++) {
+        uint16_t* bucket = buckets[c % ring];
+        // Cells can be added to the bucket as it's gone through
+        for (int i = 0; i < sizes[c % ring]; i++) {
+            int p = bucket[i];
+            if (c != costs[p]) {
+                continue;
+            }
+            for (int k = 0; k < 8; k++) {
+                int q = p + offsets[k];
+                if (!grid.open[q] ||
+                    ((k & 1) && (!grid.open[p + offsets[k - 1]] || !grid.open[p + offsets[(k + 1) & 7]]))) {
+                    continue;
+                }
+                uint32_t through = c + (k & 1 ? diagonal_cost : straight_cost);
+                if (through < costs[q]) {
+                    costs[q] = through;
+                    buckets[through % ring][sizes[through % ring]++] = q;
+                    queued++;
+                }
+            }
+        }
+        queued -= sizes[c % ring];
+        sizes[c % ring] = 0;
+    }
+}
+
+// Step from `p` along (dx, dy) until reaching `goal`, or a cell the
+// path might have to turn at. -1 if a wall comes first. A diagonal move
+// looks along both of its straight parts at every step, and needs both
+// cells beside it open, so it never cuts a corner.
+template <typename Grid>
+static int jump(const Grid& grid, int p, int dx, int dy, int goal) {
+    const int stride = Grid::stride;
+    const uint8_t* open = grid.open;
+    for (;;) {
+        if (!open[p + dx + dy * stride] || (dx && dy && (!open[p + dx] || !open[p + dy * stride]))) {
+            return -1;
+        }
+        p += dx + dy * stride;
+        if (p == goal) {
+            return p;
+        }
+        if (dx && dy) {
+            if (jump(grid, p, dx, 0, goal) >= 0 || jump(grid, p, 0, dy, goal) >= 0) {
+                return p;
+            }
+        } else if (dx) {
+            // A wall behind us to the side just ended: we can turn here
+            if ((open[p - stride] && !open[p - dx - stride]) || (open[p + stride] && !open[p - dx + stride])) {
+                return p;
+            }
+        } else {
+            if ((open[p - 1] && !open[p - 1 - dy * stride]) || (open[p + 1] && !open[p + 1 - dy * stride])) {
+                return p;
+            }
+        }
+    }
+}
+
+// Jump point search from `start` to `goal` inside the grid. Appends the
+// turning points after `start`, ending with `goal`; the path runs
+// straight or diagonally between each. Returns its cost, or UINT32_MAX
+// if there's no path. Only the directions a path through each point
+// could carry on in are searched, so open ground is crossed in a few
+// long jumps rather than cell by cell.
+template <typename Grid>
+static uint32_t cluster_path(const Grid& grid, int start, int goal, std::vector<v2>* path) {
+    const int stride = Grid::stride;
+    uint16_t costs[stride * stride];
+    int16_t parents[stride * stride];
+    uint8_t closed[stride * stride] = {};
+    std::fill(costs, costs + stride * stride, 0xffff);
+    auto estimate = [&] (int p) {
+        return octile(p % stride - goal % stride, p / stride - goal / stride);
+    };
+
+    // Jump points are only ever pushed when they get cheaper, at most
+    // once per direction into them
+    uint32_t heap[8 * stride * stride];
+    int size = 0;
+    costs[start] = 0;
+    parents[start] = -1;
+    heap[size++] = estimate(start) << 16 | start;
+    while (size) {
+        std::pop_heap(heap, heap + size, std::greater<uint32_t>());
+        int p = heap[--size] & 0xffff;
+        if (closed[p]) {
+            continue;
+        }
+        closed[p] = 1;
+        if (p == goal) {
+            size_t end = path->size();
+            for (int q = goal; q != start; q = parents[q]) {
+                path->push_back(grid.center(q));
+            }
+            std::reverse(path->begin() + end, path->end());
+            return costs[goal];
+        }
+
+        // Which ways are worth jumping
+        int dirs[8][2], count = 0;
+        auto add = [&] (int dx, int dy) {
+            dirs[count][0] = dx;
+            dirs[count][1] = dy;
+            count++;
+        };
+        if (parents[p] < 0) {
+            for (int k = 0; k < 8; k++) {
+                add(flow_dx[k], flow_dy[k]);
+            }
+        } else {
+            int dx = (p % stride > parents[p] % stride) - (p % stride < parents[p] % stride);
+            int dy = (p / stride > parents[p] / stride) - (p / stride < parents[p] / stride);
+            if (dx && dy) {
+                add(dx, 0);
+                add(0, dy);
+                add(dx, dy);
+            } else if (dx) {
+                add(dx, 0);
+                add(dx, 1);
+                add(dx, -1);
+                add(0, 1);
+                add(0, -1);
+            } else {
+                add(0, dy);
+                add(1, dy);
+                add(-1, dy);
+                add(1, 0);
+                add(-1, 0);
+            }
+        }
+
+        for (int d = 0; d < count; d++) {
+            int q = jump(grid, p, dirs[d][0], dirs[d][1], goal);
+            if (q < 0 || closed[q]) {
+                continue;
+            }
+            uint32_t through = costs[p] + octile(q % stride - p % stride, q / stride - p / stride);
+            if (through < costs[q]) {
+                costs[q] = through;
+                parents[q] = p;
+                heap[size++] = (through + estimate(q)) << 16 | q;
+                std::push_heap(heap, heap + size, std::greater<uint32_t>());
+            }
+        }
+    }
+    return UINT32_MAX;
+}
+
+// Place the entrances on the border between cluster (cx, cy) and the
+// one to its EAST or SOUTH: one in the middle of every run of open
+// cells facing each other across it, or one at each end of a long run.
+void Pathfinder::buildBorder(World& world, int cx, int cy, Border border) {
+    const int long_run = 6;
+    bool east = border == EAST;
+    int c = cx + cy * clusters_x;
+    int x0 = cx * cluster_size, y0 = cy * cluster_size;
+    // Only the last cluster of a row or column can be short, and it
+    // has nothing to its east or south
+    int length = east ? std::min(cluster_size, height - y0) : std::min(cluster_size, width - x0);
+
+    Cluster& here = clusters[c];
+    uint8_t* offsets = here.offsets[border];
+    int count = 0, run = 0;
+    for (int i = 0; i <= length; i++) {
+        if (i < length) {
+            int x = east ? x0 + cluster_size - 1 : x0 + i;
+            int y = east ? y0 + i : y0 + cluster_size - 1;
+            if (world.get(x, y) == NO_WALL && world.get(x + east, y + !east) == NO_WALL) {
+                run++;
+                continue;
+            }
+        }
+        if (run >= long_run) {
+            offsets[count++] = i - run;
+            offsets[count++] = i - 1;
+        } else if (run > 0) {
+            offsets[count++] = i - run + (run - 1) / 2;
+        }
+        run = 0;
+    }
+    // The graph only splits or joins up if entrances come or go
+    relabel |= count != here.counts[border];
+    here.counts[border] = count;
+
+    int facing = east ? WEST : NORTH;
+    int across = east ? c + 1 : c + clusters_x;
+    Cluster& there = clusters[across];
+    there.counts[facing] = count;
+    memcpy(there.offsets[facing], offsets, count);
+    for (int k = 0; k < count; k++) {
+        int x = east ? x0 + cluster_size - 1 : x0 + offsets[k];
+        int y = east ? y0 + offsets[k] : y0 + cluster_size - 1;
+        slots[(c * 4 + border) * max_entrances + k].cell = x + y * width;
+        slots[(across * 4 + facing) * max_entrances + k].cell = x + east + (y + !east) * width;
+    }
+}
+
+// Work out the cost between every two entrances of a cluster
+void Pathfinder::buildCosts(World& world, int cluster) {
+    Cluster& c = clusters[cluster];
+    int cx = cluster % clusters_x, cy = cluster / clusters_x;
+    int cells[4 * max_entrances], n = 0;
+    for (int b = 0; b < 4; b++) {
+        for (int k = 0; k < c.counts[b]; k++) {
+            cells[n++] = slots[(cluster * 4 + b) * max_entrances + k].cell;
+        }
+    }
+    std::vector<uint16_t> before;
+    before.swap(c.costs);
+    c.costs.assign(n * n, 0xffff);
+
+    // A cluster without walls is crossed in a straight line
+    const OccupancyPyramid& occupancy = world.pyramid();
+    int level = cluster_shift - 1;
+    if (level < (int) occupancy.levels.size() && occupancy.count(level, cx, cy) == 0) {
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < n; j++) {
+                c.costs[i * n + j] = octile(cells[i] % width - cells[j] % width, cells[i] / width - cells[j] / width);
+            }
+        }
+    } else {
+        ClusterGrid<1> grid(world, cx, cy);
+        uint16_t reach[grid.stride * grid.stride];
+        for (int i = 0; i < n; i++) {
+            cluster_costs(grid, grid.cell(cells[i], width), reach);
+            for (int j = 0; j < n; j++) {
+                c.costs[i * n + j] = reach[grid.cell(cells[j], width)];
+            }
+        }
+    }
+
+    // Costs change all the time, but which entrances can reach each
+    // other rarely does
+    if (!relabel && before.size() == c.costs.size()) {
+        for (size_t i = 0; i < before.size(); i++) {
+            if ((before[i] == 0xffff) != (c.costs[i] == 0xffff)) {
+                relabel = true;
+                break;
+            }
+        }
+    }
+}
+
+// Bring the graph up to date with the world. An edit redoes the costs
+// of its cluster, and if it's on a border, that border's entrances and
+// the costs of the cluster across it.
+void Pathfinder::update(World& world) {
+    bool rebuilt = world.width != width || world.height != height || !world.editsSince(revision, &edits);
+    if (rebuilt) {
+        width = world.width;
+        height = world.height;
+        clusters_x = (width + cluster_size - 1) / cluster_size;
+        clusters_y = (height + cluster_size - 1) / cluster_size;
+        clusters.assign(clusters_x * clusters_y, Cluster());
+        slots.assign(clusters.size() * 4 * max_entrances, Slot());
+        search = 0;
+
+        dirty.clear();
+        for (int cy = 0; cy < clusters_y; cy++) {
+            for (int cx = 0; cx < clusters_x; cx++) {
+                if (cx + 1 < clusters_x) {
+                    buildBorder(world, cx, cy, EAST);
+                }
+                if (cy + 1 < clusters_y) {
+                    buildBorder(world, cx, cy, SOUTH);
+                }
+                dirty.push_back(cx + cy * clusters_x);
+            }
+        }
+    } else {
+        const int last = cluster_size - 1;
+        for (int e : edits) {
+            int x = e % width, y = e / width;
+            int cx = x >> cluster_shift, cy = y >> cluster_shift;
+            int c = cx + cy * clusters_x;
+            dirty.push_back(c);
+            if ((x & last) == 0 && cx > 0) {
+                buildBorder(world, cx - 1, cy, EAST);
+                dirty.push_back(c - 1);
+            }
+            if ((x & last) == last && cx + 1 < clusters_x) {
+                buildBorder(world, cx, cy, EAST);
+                dirty.push_back(c + 1);
+            }
+            if ((y & last) == 0 && cy > 0) {
+                buildBorder(world, cx, cy - 1, SOUTH);
+                dirty.push_back(c - clusters_x);
+            }
+            if ((y & last) == last && cy + 1 < clusters_y) {
+                buildBorder(world, cx, cy, SOUTH);
+                dirty.push_back(c + clusters_x);
+            }
+        }
+        std::sort(dirty.begin(), dirty.end());
+        dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+    }
+
+    for (int c : dirty) {
+        buildCosts(world, c);
+    }
+    dirty.clear();
+    revision = world.revision();
+    if (rebuilt) {
+        label();
+    }
+}
+
+// Flood the graph from each slot not yet in a region
+void Pathfinder::label() {
+    const int across[] = { -clusters_x, 1, clusters_x, -1 };
+    const uint32_t none = UINT32_MAX;
+    regions.assign(clusters.size() * 4 * max_entrances, none);
+    std::vector<uint32_t> stack;
+    uint32_t region = 0;
+    for (size_t c = 0; c < clusters.size(); c++) {
+        for (int b = 0; b < 4; b++) {
+            for (int k = 0; k < clusters[c].counts[b]; k++) {
+                uint32_t seed = (c * 4 + b) * max_entrances + k;
+                if (regions[seed] != none) {
+                    continue;
+                }
+                regions[seed] = region;
+                stack.push_back(seed);
+                while (!stack.empty()) {
+                    uint32_t slot = stack.back();
+                    stack.pop_back();
+                    int c = slot / (4 * max_entrances), b = slot / max_entrances % 4, k = slot % max_entrances;
+                    auto visit = [&] (uint32_t next) {
+                        if (regions[next] == none) {
+                            regions[next] = region;
+                            stack.push_back(next);
+                        }
+                    };
+                    visit(((c + across[b]) * 4 + (b + 2) % 4) * max_entrances + k);
+
+                    const Cluster& cluster = clusters[c];
+                    int n = 0, i = 0;
+                    for (int b2 = 0; b2 < 4; b2++) {
+                        if (b2 == b) {
+                            i = n + k;
+                        }
+                        n += cluster.counts[b2];
+                    }
+                    int j = 0;
+                    for (int b2 = 0; b2 < 4; b2++) {
+                        for (int k2 = 0; k2 < cluster.counts[b2]; k2++, j++) {
+                            if (cluster.costs[i * n + j] != 0xffff) {
+                                visit((c * 4 + b2) * max_entrances + k2);
+                            }
+                        }
+                    }
+                }
+                region++;
+            }
+        }
+    }
+    relabel = false;
+}
+
+// Find a shortest path from `from` to `to`, as the centers of the cells
+// it turns at, starting with the one `from` is in. False if there isn't
+// one.
+//
+// The start and goal are joined to the entrances of their clusters,
+// then A* finds the way between them over the entrance graph. Each leg
+// of that is then filled in within its cluster.
+bool Pathfinder::find(World& world, v2 from, v2 to, std::vector<v2>* path) {
+    update(world);
+    path->clear();
+    int sx = floor(from.x), sy = floor(from.y);
+    int tx = floor(to.x), ty = floor(to.y);
+    if (world.get(sx, sy) != NO_WALL || world.get(tx, ty) != NO_WALL) {
+        return false;
+    }
+
+    const uint32_t none = UINT32_MAX;
+    int scx = sx >> cluster_shift, scy = sy >> cluster_shift;
+    int tcx = tx >> cluster_shift, tcy = ty >> cluster_shift;
+    int start_cluster = scx + scy * clusters_x, goal_cluster = tcx + tcy * clusters_x;
+    ClusterGrid<1> start_grid(world, scx, scy);
+    ClusterGrid<1> goal_grid(world, tcx, tcy);
+    uint16_t from_start[start_grid.stride * start_grid.stride], to_goal[goal_grid.stride * goal_grid.stride];
+    cluster_costs(start_grid, start_grid.at(sx, sy), from_start);
+    cluster_costs(goal_grid, goal_grid.at(tx, ty), to_goal);
+
+    // Between neighbouring clusters, the entrances can be well out of
+    // the way, so look for a path that keeps to the two directly as
+    // well. The graph might still find a shorter one round the outside.
+    std::vector<v2> nearby;
+    uint32_t best = UINT32_MAX, last = none;
+    if (abs(scx - tcx) <= 1 && abs(scy - tcy) <= 1) {
+        ClusterGrid<2> grid(world, std::min(scx, tcx), std::min(scy, tcy));
+        best = cluster_path(grid, grid.at(sx, sy), grid.at(tx, ty), &nearby);
+    }
+
+    // Octile distance never overestimates, so no slot is estimated to
+    // cost less than the one it was reached from. The open slots go in
+    // a bucket for each estimate, counting from the least there can be.
+    search++;
+    uint32_t least = octile(tx - sx, ty - sy), queued = 0, used = 0;
+    auto slot_cell = [&] (uint32_t slot) {
+        return slots[slot].cell;
+    };
+    auto estimate = [&] (int cell) {
+        return octile(cell % width - tx, cell / width - ty);
+    };
+    auto reach = [&] (uint32_t slot, uint32_t g, uint32_t via) {
+        Slot& s = slots[slot];
+        if (s.search != search || g < s.cost) {
+            s.search = search;
+            s.cost = g;
+            s.came_from = via;
+            uint32_t index = g + estimate(s.cell) - least;
+            if (index >= open.size()) {
+                open.resize(index + 1);
+            }
+            open[index].push_back(slot);
+            used = std::max(used, index + 1);
+            queued++;
+        }
+    };
+
+    // Only leave by the entrances that lead somewhere the goal's
+    // cluster can be left from
+    if (relabel) {
+        label();
+    }
+    uint32_t goal_regions[4 * max_entrances];
+    int goal_count = 0;
+    for (int b = 0; b < 4; b++) {
+        for (int k = 0; k < clusters[goal_cluster].counts[b]; k++) {
+            uint32_t slot = (goal_cluster * 4 + b) * max_entrances + k;
+            if (to_goal[goal_grid.cell(slot_cell(slot), width)] != 0xffff) {
+                goal_regions[goal_count++] = regions[slot];
+            }
+        }
+    }
+    for (int b = 0; b < 4; b++) {
+        for (int k = 0; k < clusters[start_cluster].counts[b]; k++) {
+            uint32_t slot = (start_cluster * 4 + b) * max_entrances + k;
+            uint16_t g = from_start[start_grid.cell(slot_cell(slot), width)];
+            if (g != 0xffff && std::find(goal_regions, goal_regions + goal_count, regions[slot]) != goal_regions + goal_count) {
+                reach(slot, g, none);
+            }
+        }
+    }
+    const int across[] = { -clusters_x, 1, clusters_x, -1 };
+    for (uint32_t index = 0; queued && least + index < best; ) {
+        if (open[index].empty()) {
+            index++;
+            continue;
+        }
+        // Last in first out, which goes on from the furthest along
+        // of all the equally good slots
+        uint32_t estimated = least + index, slot = open[index].back();
+        open[index].pop_back();
+        queued--;
+        int cell = slot_cell(slot);
+        uint32_t g = slots[slot].cost;
+        if (estimated != g + estimate(cell)) {
+            continue; // Reached more cheaply since it was queued
+        }
+
+        int c = slot / (4 * max_entrances), b = slot / max_entrances % 4, k = slot % max_entrances;
+        if (c == goal_cluster && to_goal[goal_grid.cell(cell, width)] != 0xffff &&
+            g + to_goal[goal_grid.cell(cell, width)] < best) {
+            best = g + to_goal[goal_grid.cell(cell, width)];
+            last = slot;
+        }
+
+        // Over the border, to the entrance facing this one
+        reach(((c + across[b]) * 4 + (b + 2) % 4) * max_entrances + k, g + straight_cost, slot);
+
+        // To the cluster's other entrances
+        const Cluster& cluster = clusters[c];
+        int n = 0, i = 0;
+        for (int b2 = 0; b2 < 4; b2++) {
+            if (b2 == b) {
+                i = n + k;
+            }
+            n += cluster.counts[b2];
+        }
+        int j = 0;
+        for (int b2 = 0; b2 < 4; b2++) {
+            for (int k2 = 0; k2 < cluster.counts[b2]; k2++, j++) {
+                uint16_t step = cluster.costs[i * n + j];
+                if (j != i && step != 0xffff) {
+                    reach((c * 4 + b2) * max_entrances + k2, g + step, slot);
+                }
+            }
+        }
+    }
+    for (uint32_t index = 0; index < used; index++) {
+        open[index].clear();
+    }
+    if (best == UINT32_MAX) {
+        return false;
+    }
+
+    path->push_back(start_grid.center(start_grid.at(sx, sy)));
+    if (last == none) {
+        path->insert(path->end(), nearby.begin(), nearby.end());
+        return true;
+    }
+    std::vector<uint32_t> legs;
+    for (uint32_t slot = last; slot != none; slot = slots[slot].came_from) {
+        legs.push_back(slot);
+    }
+    std::reverse(legs.begin(), legs.end());
+
+    cluster_path(start_grid, start_grid.at(sx, sy), start_grid.cell(slot_cell(legs[0]), width), path);
+    for (size_t n = 1; n < legs.size(); n++) {
+        int c = legs[n] / (4 * max_entrances);
+        int cell = slot_cell(legs[n]);
+        if (legs[n - 1] / (4 * max_entrances) != (uint32_t) c) {
+            // Stepped over a border
+            path->push_back(v2(cell % width + 0.5f, cell / width + 0.5f));
+            continue;
+        }
+        ClusterGrid<1> grid(world, c % clusters_x, c / clusters_x);
+        cluster_path(grid, grid.cell(slot_cell(legs[n - 1]), width), grid.cell(cell, width), path);
+    }
+    cluster_path(goal_grid, goal_grid.cell(slot_cell(last), width), goal_grid.at(tx, ty), path);
+    return true;
+}
+
+//
+// Field of view
+//
+
+// a / b rounded down, for b > 0
+static int floor_div(int a, int b) {
+    return a >= 0 ? a / b : -((b - 1 - a) / b);
+}
+
+void FieldOfView::reveal(int x, int y) {
+    if (x < 0 || x >= width || y < 0 || y >= height) {
+        return;
+    }
+    int vx = x - eye_x + radius, vy = y - eye_y + radius;
+    view[vy * span_words + vx / 64] |= 1ull << (vx % 64);
+    uint64_t& word = explored[y * row_words + x / 64];
+    if (!(word & 1ull << (x % 64))) {
+        word |= 1ull << (x % 64);
+        revealed.push_back(x + y * width);
+    }
+}
+
+struct Slope {
+    int num, den;
+};
+
+// Rows of a quadrant from `depth` out, between two slopes: columns
+// over depth, going clockwise. Where a wall splits a row, the rows in
+// view on the near side of it are scanned recursively, with the slopes
+// that still reach them.
+template <typename Visit>
+static void shadowcast_rows(
+    World& world, int eye_x, int eye_y, int radius,
+    int quadrant, int depth, Slope start, Slope end, Visit& visit)
+{
+    // Per quadrant, the steps to the next column and to the next row
+    static const int steps[4][4] = {
+        // col x, col y, row x, row y
+        {  1,  0,  0, -1 },
+        {  0,  1,  1,  0 },
+        { -1,  0,  0,  1 },
+        {  0, -1, -1,  0 },
+    };
+    const int* step = steps[quadrant];
+    for (; depth <= radius; depth++) {
+        // From the first cell whose middle is at or past `start`, ties
+        // going up, to the last at or before `end`, ties going down
+        int first = floor_div(2 * depth * start.num + start.den, 2 * start.den);
+        int last = -floor_div(end.den - 2 * depth * end.num, 2 * end.den);
+        int prev = -1; // 1 for a wall, 0 for floor, -1 before the first cell
+        for (int col = first; col <= last; col++) {
+            int dx = col * step[0] + depth * step[2], dy = col * step[1] + depth * step[3];
+            int wall = world.get(eye_x + dx, eye_y + dy) != NO_WALL;
+            bool centered = col * start.den >= depth * start.num && col * end.den <= depth * end.num;
+            visit(dx, dy, (wall || centered) && col * col + depth * depth <= radius * (radius + 1));
+            Slope edge = {2 * col - 1, 2 * depth};
+            if (prev == 1 && !wall) {
+                start = edge;
+            }
+            if (prev == 0 && wall) {
+                shadowcast_rows(world, eye_x, eye_y, radius, quadrant, depth + 1, start, edge, visit);
+            }
+            prev = wall;
+        }
+        if (prev != 0) {
+            return;
+        }
+    }
+}
+
+// Symmetric shadowcasting from the cell (eye_x, eye_y) out to `radius`.
+// Calls visit(dx, dy, in_view) once for every cell it looks at, the eye
+// included, by its offset from the eye; cells on the diagonals between
+// quadrants can come up twice.
+template <typename Visit>
+static void shadowcast(World& world, int eye_x, int eye_y, int radius, Visit visit) {
+    visit(0, 0, true);
+    for (int quadrant = 0; quadrant < 4; quadrant++) {
+        shadowcast_rows(world, eye_x, eye_y, radius, quadrant, 1, Slope{-1, 1}, Slope{1, 1}, visit);
+    }
+}
+
+void FieldOfView::update(World& world, v2 eye) {
+    int x = floor(eye.x), y = floor(eye.y);
+    bool known = world.width == width && world.height == height && world.editsSince(revision, &edits);
+    revision = world.revision();
+    if (!known) {
+        // A new map, or no telling what changed: start exploring over
+        width = world.width;
+        height = world.height;
+        row_words = (width + 63) / 64;
+        explored.assign((size_t) row_words * height, 0);
+        revealed.clear();
+        forgot = true;
+    } else if (x == eye_x && y == eye_y &&
+               std::none_of(edits.begin(), edits.end(), [&] (int e) { return around(scanned, e % width, e / width); })) {
+        return;
+    }
+
+    eye_x = x;
+    eye_y = y;
+    memset(view, 0, sizeof(view));
+    memset(scanned, 0, sizeof(scanned));
+    shadowcast(world, x, y, radius, [&] (int dx, int dy, bool in_view) {
+        int vx = dx + radius, vy = dy + radius;
+        scanned[vy * span_words + vx / 64] |= 1ull << (vx % 64);
+        if (in_view) {
+            reveal(x + dx, y + dy);
+        }
+    });
+}
+
+// Whether a cell's bit is set in one of the bitsets around the eye
+bool FieldOfView::around(const uint64_t* bits, int x, int y) const {
+    int vx = x - eye_x + radius, vy = y - eye_y + radius;
+    if (vx < 0 || vx >= span || vy < 0 || vy >= span) {
+        return false;
+    }
+    return bits[vy * span_words + vx / 64] >> (vx % 64) & 1;
+}
+
+// In view of the eye right now
+bool FieldOfView::visible(int x, int y) const {
+    return around(view, x, y);
+}
+
+// Ever in view since the map was loaded
+bool FieldOfView::seen(int x, int y) const {
+    if (x < 0 || x >= width || y < 0 || y >= height) {
+        return false;
+    }
+    return explored[y * row_words + x / 64] >> (x % 64) & 1;
+}
+
+// Fill `cells` with the grid indices explored since the last call.
+// Returns false if exploring started over since then, in which case
+// anything might have been forgotten.
+bool FieldOfView::takeRevealed(std::vector<int>* cells) {
+    cells->swap(revealed);
+    revealed.clear();
+    bool kept = !forgot;
+    forgot = false;
+    return kept;
+}
+
+//
+// Lightmap
+//
+
+// Out of a cell, for each Lightmap::Side
+static const int side_normals[4][2] = { {0, -1}, {1, 0}, {0, 1}, {-1, 0} };
+
+void Lightmap::Snapshot::take(World& world, Area area) {
+    x = area.x1;
+    y = area.y1;
+    width = area.x2 - area.x1;
+    height = area.y2 - area.y1;
+    walls.resize((size_t) width * height);
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            walls[i + (size_t) j * width] = world.get(x + i, y + j);
+        }
+    }
+}
+
+// In world coordinates. Anywhere it doesn't cover is wall.
+Block Lightmap::Snapshot::get(int x, int y) const {
+    x -= this->x;
+    y -= this->y;
+    if (x < 0 || x >= width || y < 0 || y >= height) {
+        return OUTER_WALL;
+    }
+    return walls[x + (size_t) y * width];
+}
+
+// Work out every face of the walls in `area` into `out`, seeing the
+// world as `grid` does. The grid has to reach `max_radius` past the
+// area, or lights will look blocked.
+void Lightmap::light(const Snapshot& grid, Area area, uint8_t* out) const {
+    for (int y = area.y1; y < area.y2; y++) {
+        auto first = std::lower_bound(
+            lights.begin(), lights.end(), y + 0.5f - max_radius,
+            [] (const Light& light, float y) { return light.pos.y < y; }
+        );
+        for (int x = area.x1; x < area.x2; x++) {
+            uint8_t* levels = out + (x + (size_t) y * width) * 4;
+            if (!grid.get(x, y)) {
+                memset(levels, FULL, 4);
+                continue;
+            }
+            for (int side = NORTH; side <= WEST; side++) {
+                v2 normal(side_normals[side][0], side_normals[side][1]);
+                if (grid.get(x + side_normals[side][0], y + side_normals[side][1])) {
+                    levels[side] = FULL; // Buried
+                    continue;
+                }
+                // Just off the face, in the open cell it looks into
+                v2 point = v2(x + 0.5f, y + 0.5f) + normal * 0.51f;
+                float sum = ambient;
+                for (auto light = first; light != lights.end() && light->pos.y < point.y + max_radius; ++light) {
+                    v2 to = light->pos - point;
+                    float dist = to.size();
+                    float facing = to.dot(normal) / dist;
+                    if (dist >= light->radius || facing <= 0) {
+                        continue;
+                    }
+                    v2 hit(0, 0);
+                    Direction hit_dir;
+                    Block hit_type;
+                    cast_ray(
+                        grid.walls.data(), grid.width, grid.height, nullptr,
+                        point - v2(grid.x, grid.y), to, &hit, &hit_dir, &hit_type, 1
+                    );
+                    if (hit_type == NO_WALL) {
+                        float falloff = 1 - dist / light->radius;
+                        sum += light->intensity * facing * falloff * falloff;
+                    }
+                }
+                levels[side] = std::min(sum, 1.0f) * FULL;
+            }
+        }
+    }
+}
+
+// Runs on `worker`, with `snapshot` taken for it
+void Lightmap::relight(Area area) {
+    // Only relights publish, and only one runs at a time
+    const uint8_t* front = current.load(std::memory_order_relaxed);
+    int back = front == faces[0].data() ? 1 : 0;
+
+    // The copy being written missed the last relight. Catch it up, then
+    // do this one over the top.
+    for (int y = relit.y1; y < relit.y2; y++) {
+        size_t start = (relit.x1 + (size_t) y * width) * 4;
+        memcpy(&faces[back][start], front + start, (relit.x2 - relit.x1) * 4);
+    }
+    light(snapshot, area, faces[back].data());
+    relit = area;
+    current.store(faces[back].data(), std::memory_order_release);
+}
+
+// Runs on `worker`, one relight at a time as update() queues them
+void Lightmap::serve() {
+    std::unique_lock<std::mutex> held(lock);
+    for (;;) {
+        wake.wait(held, [&] { return quitting || queued; });
+        if (quitting) {
+            return;
+        }
+        queued = false;
+        Area area = next;
+        held.unlock();
+        relight(area);
+        held.lock();
+        working.store(false, std::memory_order_release);
+        idle.notify_all();
+    }
+}
+
+Lightmap::~Lightmap() {
+    finish();
+    if (worker.joinable()) {
+        {
+            std::lock_guard<std::mutex> held(lock);
+            quitting = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+}
+
+// Wait for the relight in flight, if there is one
+void Lightmap::finish() {
+    std::unique_lock<std::mutex> held(lock);
+    idle.wait(held, [&] { return !working.load(std::memory_order_relaxed); });
+}
+
+void Lightmap::update(WorkerPool& pool, World& world) {
+    bool known = world.width == width && world.height == height && world.editsSince(revision, &edits);
+    revision = world.revision();
+    if (!known) {
+        // A new map, or no telling what changed: bake the whole thing
+        finish();
+        width = world.width;
+        height = world.height;
+        lights = world.lights;
+        std::sort(lights.begin(), lights.end(), [] (const Light& a, const Light& b) { return a.pos.y < b.pos.y; });
+        max_radius = 0;
+        for (const Light& light : lights) {
+            max_radius = std::max(max_radius, light.radius);
+        }
+        ambient = world.ambient;
+        pending.clear();
+
+        Snapshot all;
+        all.take(world, Area{0, 0, width, height});
+        faces[0].resize((size_t) width * height * 4);
+        const int band = 16;
+        parallel_for(pool, (height + band - 1) / band, 1, [&] (int b) {
+            light(all, Area{0, b * band, width, std::min((b + 1) * band, height)}, faces[0].data());
+        });
+        faces[1] = faces[0];
+        relit = Area{0, 0, 0, 0};
+        current.store(faces[0].data(), std::memory_order_release);
+        return;
+    }
+
+    // Edits made while a relight is running wait for the next one
+    pending.insert(pending.end(), edits.begin(), edits.end());
+    if (pending.empty() || working.load(std::memory_order_acquire)) {
+        return;
+    }
+
+    // The faces an edit adds or buries, and all within reach of any
+    // light close enough to the edit to be blocked or let through by it
+    Area area = {width, height, 0, 0};
+    auto cover = [&] (float x1, float y1, float x2, float y2) {
+        area.x1 = std::max(std::min(area.x1, (int) floor(x1)), 0);
+        area.y1 = std::max(std::min(area.y1, (int) floor(y1)), 0);
+        area.x2 = std::min(std::max(area.x2, (int) ceil(x2)), width);
+        area.y2 = std::min(std::max(area.y2, (int) ceil(y2)), height);
+    };
+    for (int cell : pending) {
+        v2 center(cell % width + 0.5f, cell / width + 0.5f);
+        cover(center.x - 1.5f, center.y - 1.5f, center.x + 1.5f, center.y + 1.5f);
+        auto light = std::lower_bound(
+            lights.begin(), lights.end(), center.y - max_radius - 1,
+            [] (const Light& light, float y) { return light.pos.y < y; }
+        );
+        for (; light != lights.end() && light->pos.y < center.y + max_radius + 1; ++light) {
+            if ((light->pos - center).size() < light->radius + 1) {
+                cover(light->pos.x - light->radius - 1, light->pos.y - light->radius - 1,
+                      light->pos.x + light->radius + 1, light->pos.y + light->radius + 1);
+            }
+        }
+    }
+    pending.clear();
+
+    int reach = ceil(max_radius) + 1;
+    snapshot.take(world, Area{area.x1 - reach, area.y1 - reach, area.x2 + reach, area.y2 + reach});
+    working.store(true, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> held(lock);
+        next = area;
+        queued = true;
+    }
+    if (!worker.joinable()) {
+        worker = std::thread([this] { serve(); });
+    }
+    wake.notify_one();
+}
+
+// How lit a side of the wall at (x, y) is, from 0 to FULL
+uint8_t Lightmap::face(int x, int y, Side side) const {
+    const uint8_t* levels = current.load(std::memory_order_acquire);
+    if (!levels || x < 0 || x >= width || y < 0 || y >= height) {
+        return FULL;
+    }
+    return levels[(x + (size_t) y * width) * 4 + side];
+}
+
+//
+// View frame
+//
+
+// Which face of which wall a ray along `dir` hit: the one on the far
+// side of the grid line it stopped at, or for a door or thin wall, its
+// own cell's face on that side
+static void hit_face(const WallHit& hit, v2 dir, int* cell_x, int* cell_y, Lightmap::Side* side) {
+    bool on_plane = hit.type == DOOR_WALL || hit.type == THIN_WALL;
+    if (hit.dir == HORIZONTAL) {
+        *cell_x = floor(hit.point.x);
+        *cell_y = on_plane ? floor(hit.point.y) : round(hit.point.y) - (dir.y < 0);
+        *side = dir.y < 0 ? Lightmap::SOUTH : Lightmap::NORTH;
+    } else {
+        *cell_x = on_plane ? floor(hit.point.x) : round(hit.point.x) - (dir.x < 0);
+        *cell_y = floor(hit.point.y);
+        *side = dir.x < 0 ? Lightmap::EAST : Lightmap::WEST;
+    }
+}
+
+// Keep what a batch cast from `eye`, one ray per column across `fov`
+// about `angle`, ran into. The batch stops at the edge of grate and
+// door cells, so those columns are cast again to find where their
+// planes are and what's behind them.
+void ViewFrame::capture(World& world, v2 eye, float angle, float fov, const RayBatch& rays) {
+    this->eye = eye;
+    this->angle = angle;
+    this->fov = fov;
+    width = rays.count;
+    dir_x.assign(rays.dir_x.begin(), rays.dir_x.begin() + width);
+    dir_y.assign(rays.dir_y.begin(), rays.dir_y.begin() + width);
+    dist.resize(width);
+    depth.resize(width);
+    hit_x.resize(width);
+    hit_y.resize(width);
+    cell_x.resize(width);
+    cell_y.resize(width);
+    face.resize(width);
+    type.resize(width);
+    layers.resize(width);
+    walls.resize(width * max_layers);
+
+    float left = angle - fov / 2, per_column = fov / width;
+    for (int x = 0; x < width; x++) {
+        v2 dir(dir_x[x], dir_y[x]);
+        WallHit* hits = &walls[x * max_layers];
+        hits[0].point = v2(rays.hit_x[x], rays.hit_y[x]);
+        hits[0].t = rays.dist[x];
+        hits[0].dir = rays.hit_dir[x];
+        hits[0].type = rays.hit_type[x];
+        layers[x] = 1;
+        Block first = hits[0].type;
+        if (first == GRATE_WALL || first == DOOR_WALL || first == THIN_WALL) {
+            layers[x] = world.wallBoundary(eye, dir, hits, max_layers);
+        }
+
+        const WallHit& nearest = hits[0];
+        dist[x] = nearest.t;
+        depth[x] = nearest.t * cos(abs(angle - (left + x * per_column)));
+        hit_x[x] = nearest.point.x;
+        hit_y[x] = nearest.point.y;
+        type[x] = nearest.type;
+        hit_face(nearest, dir, &cell_x[x], &cell_y[x], &face[x]);
+    }
+}
+
+// The column `point` lies in, or -1 if it's outside the view
+int ViewFrame::column(v2 point) const {
+    v2 to = point - eye;
+    float theta = clamp_angle(atan2(to.y, to.x) - (angle - fov / 2));
+    int x = theta / (fov / width);
+    return x < width ? x : -1;
+}
+
+// Whether `point` is in view, nearer than the wall in its column. Grates
+// count as walls.
+bool ViewFrame::sees(v2 point) const {
+    int x = column(point);
+    return x >= 0 && (point - eye).size() < dist[x];
+}
+
+//
+// Dynamic lights
+//
+
+// Shadowcast this frame's lights from their cells, as many as the
+// budget allows. Dim lights and ones far from `eye` go last, so they're
+// the ones that miss out.
+void DynamicLights::cast(WorkerPool& pool, World& world, v2 eye) {
+    order = lights;
+    auto importance = [&] (const Light& light) {
+        return light.intensity / (1 + (light.pos - eye).size());
+    };
+    std::sort(order.begin(), order.end(), [&] (const Light& a, const Light& b) {
+        return importance(a) > importance(b);
+    });
+    done.assign(order.size(), 0);
+    seen.assign(order.size() * span, 0);
+
+    uint64_t start = SDL_GetPerformanceCounter();
+    parallel_for(pool, order.size(), 1, [&] (int i) {
+        if (seconds_since(start) > budget) {
+            return;
+        }
+        const Light& light = order[i];
+        uint64_t* rows = &seen[i * span];
+        int radius = std::min((int) ceil(light.radius), max_radius);
+        shadowcast(world, floor(light.pos.x), floor(light.pos.y), radius, [&] (int dx, int dy, bool in_view) {
+            if (in_view) {
+                rows[dy + max_radius] |= 1ull << (dx + max_radius);
+            }
+        });
+        done[i] = 1;
+    });
+
+    // The ones that made it go first, for shade()
+    lit = 0;
+    for (size_t i = 0; i < order.size(); i++) {
+        if (done[i]) {
+            order[lit] = order[i];
+            std::copy(&seen[i * span], &seen[(i + 1) * span], &seen[lit * span]);
+            lit++;
+        }
+    }
+}
+
+// Add what the lights that were cast shed on the nearest wall of each
+// column of `frame` to `levels`, as 0 to 1 each
+void DynamicLights::shade(WorkerPool& pool, const ViewFrame& frame, float* levels) const {
+    if (lit == 0) {
+        return;
+    }
+    parallel_for(pool, frame.width, 256, [&] (int i) {
+        int cell_x = frame.cell_x[i], cell_y = frame.cell_y[i];
+        Lightmap::Side side = frame.face[i];
+        v2 point(frame.hit_x[i], frame.hit_y[i]);
+        v2 normal(side_normals[side][0], side_normals[side][1]);
+        float sum = 0;
+        for (int n = 0; n < lit; n++) {
+            const Light& light = order[n];
+            v2 to = light.pos - point;
+            float toward = to.dot(normal);
+            if (toward <= 0 || to.dot(to) >= light.radius * light.radius) {
+                continue;
+            }
+            int vx = cell_x - (int) light.pos.x + max_radius, vy = cell_y - (int) light.pos.y + max_radius;
+            if (vx < 0 || vx >= span || vy < 0 || vy >= span || !(seen[n * span + vy] >> vx & 1)) {
+                continue;
+            }
+            float dist = to.size();
+            float falloff = 1 - dist / light.radius;
+            sum += light.intensity * toward / dist * falloff * falloff;
+        }
+        levels[i] += sum;
+    });
+}
+
+//
+// Sprites
+//
+
+// A ball lit from the upper left, in color r, g, b
+SpriteImage SpriteImage::ball(const Raster* raster, int size, uint8_t r, uint8_t g, uint8_t b) {
+    SpriteImage image;
+    image.size = size;
+    image.texels.assign(size * size, 0);
+    image.top.assign(size, 0);
+    image.bottom.assign(size, 0);
+    const float lx = -0.4, ly = -0.5, lz = 0.77;
+    for (int column = 0; column < size; column++) {
+        float dx = (column + 0.5f) / size * 2 - 1;
+        float half = sqrt(std::max(1 - dx * dx, 0.0f)) * size / 2;
+        image.top[column] = std::max((int) round(size / 2.0f - half), 0);
+        image.bottom[column] = std::min((int) round(size / 2.0f + half), size);
+        for (int row = image.top[column]; row < image.bottom[column]; row++) {
+            float dy = (row + 0.5f) / size * 2 - 1;
+            float dz = sqrt(std::max(1 - dx * dx - dy * dy, 0.0f));
+            float shade = 0.35f + 0.65f * std::max(dx * lx + dy * ly + dz * lz, 0.0f);
+            image.texels[column * size + row] = raster->rgb(r * shade, g * shade, b * shade);
+        }
+    }
+    return image;
+}
+
+// Start a frame seen from `eye` facing `angle`
+void Billboards::begin(v2 eye, float angle, float fov, int width, int height) {
+    this->eye = eye;
+    forward = v2(cos(angle), sin(angle));
+    half_fov = fov / 2;
+    rads_per_pixel = fov / width;
+    this->width = width;
+    this->height = height;
+    sprites.clear();
+}
+
+// A sprite `size` cells across with its bottom `lift` above the floor,
+// dropped if it's outside the view cone
+void Billboards::add(const SpriteImage* image, v2 pos, float size, float lift) {
+    v2 to = pos - eye;
+    float z = to.dot(forward);
+    if (z < near) {
+        return;
+    }
+    // Sideways, positive towards the right of the view
+    float side = to.x * -forward.y + to.y * forward.x;
+    float half = size / 2;
+    float slope = tan(std::min(half_fov, (float) M_PI / 2 - 0.01f));
+    if (side - half > z * slope || side + half < -z * slope) {
+        return;
+    }
+
+    Sprite sprite;
+    sprite.image = image;
+    sprite.depth = z;
+    sprite.left = (atan((side - half) / z) + half_fov) / rads_per_pixel;
+    sprite.right = (atan((side + half) / z) + half_fov) / rads_per_pixel;
+    sprite.x1 = std::max((int) ceil(sprite.left - 0.5f), 0);
+    sprite.x2 = std::min((int) ceil(sprite.right - 0.5f), width);
+    if (sprite.x1 >= sprite.x2) {
+        return;
+    }
+    // Same scale as the walls, which are a cell tall with the eye halfway up
+    float rows_per_cell = height * plane_distance / z;
+    sprite.height = size * rows_per_cell;
+    sprite.top = height / 2.0f - (lift + size - 0.5f) * rows_per_cell;
+    sprites.push_back(sprite);
+}
+
+// The first row in [y, end) whose bit is `set`, or `end`
+static int next_row(const uint64_t* bits, int y, int end, bool set) {
+    while (y < end) {
+        uint64_t word = (set ? bits[y / 64] : ~bits[y / 64]) >> (y % 64);
+        if (word) {
+            return std::min(y + __builtin_ctzll(word), end);
+        }
+        y = (y | 63) + 1;
+    }
+    return end;
+}
+
+// Draw what was added near to far, each column only where it's nearer
+// than the wall `depth` ahead there and not already covered by a nearer
+// sprite
+void Billboards::draw(WorkerPool& pool, uint32_t* pixels, int pitch, const float* depth) {
+    int blocks = (width + block - 1) / block;
+    farthest.assign(blocks, 0);
+    for (int x = 0; x < width; x++) {
+        farthest[x / block] = std::max(farthest[x / block], depth[x]);
+    }
+
+    // Drop the ones behind every wall they span before anything else
+    size_t kept = 0;
+    for (const Sprite& sprite : sprites) {
+        float wall = 0;
+        for (int b = sprite.x1 / block; b <= (sprite.x2 - 1) / block; b++) {
+            wall = std::max(wall, farthest[b]);
+        }
+        if (sprite.depth < wall) {
+            sprites[kept++] = sprite;
+        }
+    }
+    hidden = sprites.size() - kept;
+    sprites.resize(kept);
+    drawn = kept;
+    std::sort(sprites.begin(), sprites.end(), [] (const Sprite& a, const Sprite& b) {
+        return a.depth < b.depth;
+    });
+
+    cover_words = (height + 63) / 64;
+    covered.assign(width * cover_words, 0);
+    cover_top.assign(width, 0);
+    cover_bottom.assign(width, 0);
+
+    // Strips of columns to each core, every sprite clipped to the strip
+    const int strip = 64;
+    parallel_for(pool, (width + strip - 1) / strip, 1, [&] (int s) {
+        int strip_x1 = s * strip, strip_x2 = std::min(strip_x1 + strip, width);
+        for (const Sprite& sprite : sprites) {
+            int x1 = std::max(sprite.x1, strip_x1), x2 = std::min(sprite.x2, strip_x2);
+            if (x1 >= x2) {
+                continue;
+            }
+            const SpriteImage& image = *sprite.image;
+            float texels_per_column = image.size / (sprite.right - sprite.left);
+            float rows_per_texel = sprite.height / image.size;
+            uint32_t step = (uint32_t) (image.size / sprite.height * 65536);
+            for (int x = x1; x < x2; x++) {
+                if (sprite.depth >= depth[x]) {
+                    continue;
+                }
+                int u = std::min((int) ((x + 0.5f - sprite.left) * texels_per_column), image.size - 1);
+                int t1 = image.top[u], t2 = image.bottom[u];
+                // Rows whose centers land in the opaque run
+                int y1 = std::max((int) ceil(sprite.top + t1 * rows_per_texel - 0.5f), 0);
+                int y2 = std::min((int) ceil(sprite.top + t2 * rows_per_texel - 0.5f), height);
+                int covered1 = cover_top[x], covered2 = cover_bottom[x];
+                if (y1 >= y2 || (y1 >= covered1 && y2 <= covered2)) {
+                    continue;
+                }
+
+                const uint32_t* texels = &image.texels[u * image.size];
+                // Stepped from the top of the run, so a run resumed below
+                // a nearer sprite picks up the same texels
+                uint32_t start = std::max((uint32_t) ((y1 + 0.5f - sprite.top) / rows_per_texel * 65536), (uint32_t) t1 << 16);
+                auto fill = [&] (int from, int to) {
+                    uint32_t pos = start + (from - y1) * step;
+                    uint32_t* dest = pixels + from * pitch + x;
+                    for (int y = from; y < to; y++) {
+                        *dest = texels[std::min((int) (pos >> 16), t2 - 1)];
+                        dest += pitch;
+                        pos += step;
+                    }
+                };
+                // Fill each run of rows no nearer sprite has, then mark
+                // all of them covered
+                uint64_t* bits = &covered[x * cover_words];
+                for (int y = y1; y < y2; ) {
+                    int from = next_row(bits, y, y2, false);
+                    y = next_row(bits, from, y2, true);
+                    fill(from, y);
+                }
+                for (int y = y1; y < y2; y = (y | 63) + 1) {
+                    int end = std::min((y | 63) + 1, y2);
+                    bits[y / 64] |= (~0ull >> (64 - (end - y))) << (y % 64);
+                }
+                // Runs that meet make one; otherwise the taller is kept
+                if (y2 >= covered1 && y1 <= covered2 && covered1 < covered2) {
+                    cover_top[x] = std::min(y1, covered1);
+                    cover_bottom[x] = std::max(y2, covered2);
+                } else if (y2 - y1 > covered2 - covered1) {
+                    cover_top[x] = y1;
+                    cover_bottom[x] = y2;
+                }
+            }
+        }
+    });
+}
+
+//
+// Task graph
+//
+
+// Returns the task's index, for later tasks to wait on
+int TaskGraph::add(const char* name, std::function<void()> work, std::vector<int> after) {
+    for (int task : after) {
+        if (task < 0 || task >= (int) tasks.size()) {
+            fatal("Task '%s' waits on one that hasn't been added", name);
+        }
+    }
+    Task task;
+    task.name = name;
+    task.work = std::move(work);
+    task.after = std::move(after);
+    tasks.push_back(std::move(task));
+    return tasks.size() - 1;
+}
+
+// A thread that finishes a task takes on whatever that made ready, and
+// forks out for idle workers when that's more than one. Threads with
+// nothing ready go back to the pool rather than wait, so they're free
+// for the tasks' own forks. Once every thread has run out, so have the
+// tasks.
+void TaskGraph::run(WorkerPool& pool) {
+    std::vector<int> waiting(tasks.size());         // On how many tasks, still
+    std::vector<std::vector<int>> then(tasks.size()); // Tasks waiting on each
+    std::deque<int> ready;
+    for (size_t i = 0; i < tasks.size(); i++) {
+        waiting[i] = tasks[i].after.size();
+        for (int task : tasks[i].after) {
+            then[task].push_back(i);
+        }
+        if (waiting[i] == 0) {
+            ready.push_back(i);
+        }
+    }
+
+    std::mutex lock;
+    std::function<void()> work = [&] {
+        std::unique_lock<std::mutex> held(lock);
+        while (!ready.empty()) {
+            int i = ready.front();
+            ready.pop_front();
+            held.unlock();
+
+            uint64_t start = SDL_GetPerformanceCounter();
+            tasks[i].work();
+            tasks[i].seconds = seconds_since(start);
+
+            held.lock();
+            int freed = 0;
+            for (int task : then[i]) {
+                if (--waiting[task] == 0) {
+                    ready.push_back(task);
+                    freed++;
+                }
+            }
+            if (freed > 1) {
+                held.unlock();
+                pool.fork(freed - 1, work);
+                held.lock();
+            }
+        }
+    };
+    pool.fork(ready.size() - 1, work);
+}
+
+//
+// Game
+//
+
+Game::Game(Engine* engine)
+    : engine(engine), world(15, 15), shown(0, 0)
+{
+    player = entities.spawn(ENTITY_PLAYER, v2(4.778035, 0.495602), v2(0, 0), 0.25, -0.667112);
+
+    world.set(6, 6, INNER_WALL);
+    world.set(6, 7, INNER_WALL);
+    world.set(7, 6, INNER_WALL);
+    world.set(8, 6, INNER_WALL);
+    world.set(8, 7, INNER_WALL);
+
+    dark_wall  = loadSurface("res/dark-wall.bmp", engine->canvas->format->format);
+    light_wall = loadSurface("res/light-wall.bmp", engine->canvas->format->format);
+    sky        = loadSurface("res/cloud.bmp", engine->canvas->format->format);
+    grate = MaskedTexture::grate(
+        (const uint32_t*) light_wall->pixels, light_wall->pitch / sizeof(uint32_t), light_wall->w, 4
+    );
+    enemy_sprite      = SpriteImage::ball(engine->raster, 64, 0xc0, 0x30, 0x30);
+    projectile_sprite = SpriteImage::ball(engine->raster, 16, 0xff, 0xe0, 0x60);
+
+    fitMinimap(engine->height);
+}
+
+Game::~Game() {
+    SDL_FreeSurface(view_surface);
+    SDL_FreeSurface(map_surface);
+    SDL_FreeSurface(minimap);
+    SDL_FreeSurface(dark_wall);
+    SDL_FreeSurface(light_wall);
+    SDL_FreeSurface(sky);
+}
+
+// Seconds a volley's tracers and flashes last
+static const float volley_time = 0.15;
+
+void Game::update() {
+    int me = entities.index(player);
+    { // Move player
+        v2 inp = v2(0, 0);
+        inp.x += engine->input->keyDown(SDL_SCANCODE_A) ? -1.0 : 0.0;
+        inp.x += engine->input->keyDown(SDL_SCANCODE_D) ? +1.0 : 0.0;
+        inp.y += engine->input->keyDown(SDL_SCANCODE_W) ? -1.0 : 0.0;
+        inp.y += engine->input->keyDown(SDL_SCANCODE_S) ? +1.0 : 0.0;
+
+        // Rotate vector
+        // view angle: 0.0 is -->
+        float rotation = entities.angle[me] + M_PI / 2.0; // rotation: 0.0 is ^
+        v2 dir = inp.rotate(rotation);
+        
+        const float speed = 5.0;
+        entities.vel_x[me] = dir.x * speed;
+        entities.vel_y[me] = dir.y * speed;
+    }
+    { // Rotate player
+        float dir = 0.0;
+        dir += engine->input->keyDown(SDL_SCANCODE_RIGHT) ? +1.0 : 0.0;
+        dir += engine->input->keyDown(SDL_SCANCODE_LEFT)  ? -1.0 : 0.0;
+
+        if (mouse_control) {
+            float amt = engine->input->motion.x;
+            const float sensitivity = 0.2;
+            dir += amt * sensitivity;
+        }
+        
+        const float speed = 2.0;
+        entities.angle[me] = clamp_angle(entities.angle[me] + dir * speed * engine->delta);
+    }
+    { // Enemies chase the player
+        chase.update(world, entities.position(me));
+        const float speed = 2.5;
+        for (int i = 0; i < entities.count; i++) {
+            if (entities.type[i] == ENTITY_ENEMY) {
+                v2 dir = chase.direction(entities.position(i));
+                entities.vel_x[i] = dir.x * speed;
+                entities.vel_y[i] = dir.y * speed;
+                if (dir.x != 0 || dir.y != 0) {
+                    entities.angle[i] = atan2(dir.y, dir.x);
+                }
+            }
+        }
+    }
+    entities.move(world, engine->delta);
+    entities.collide(world, &entity_hash);
+    { // Doors
+        if (engine->input->keyPressed(SDL_SCANCODE_O)) {
+            // The nearest door within reach ahead, unless it would shut on us
+            v2 pos = entities.position(me);
+            v2 facing(cos(entities.angle[me]), sin(entities.angle[me]));
+            for (float reach = 0.5; reach <= 1.5; reach += 0.5) {
+                v2 cell = (pos + facing * reach).floor();
+                if (world.toggleDoor(cell.x, cell.y)) {
+                    break;
+                }
+            }
+        }
+        world.moveDoors(engine->delta, entities);
+    }
+    { // Shoot
+        if (mouse_control && engine->input->btnPressed(SDL_BUTTON_LEFT)) {
+            // A shotgun: pellets fanned out across a few degrees
+            const int pellets = 8;
+            const float spread = 8 * M_PI / 180;
+            const float range = 64;
+            for (int i = 0; i < pellets; i++) {
+                float theta = entities.angle[me] + spread * ((i + 0.5f) / pellets - 0.5f);
+                hitscan.fire(entities.position(me), v2(cos(theta), sin(theta)), range, player);
+            }
+        }
+        tracer_time -= engine->delta;
+        if (!hitscan.shots.empty()) {
+            tracers.clear();
+            for (const Hitscan::Shot& shot : hitscan.shots) {
+                tracers.push_back(shot.origin);
+            }
+            hitscan.resolve(world, entities);
+            tracer_time = volley_time;
+
+            for (const Hit& hit : hitscan.hits) {
+                int i = entities.index(hit.entity);
+                if (hit.kind == HIT_ENTITY && i >= 0 && entities.type[i] == ENTITY_ENEMY) {
+                    entities.removeAt(i);
+                }
+            }
+            me = entities.index(player);
+        }
+        if (engine->input->keyPressed(SDL_SCANCODE_E)) {
+            // Something to shoot at, a few cells ahead
+            v2 ahead = entities.position(me) + v2(cos(entities.angle[me]), sin(entities.angle[me])) * 3;
+            if (world.clearLine(entities.position(me), ahead)) {
+                entities.spawn(ENTITY_ENEMY, ahead, v2(0, 0), 0.3, 0);
+            }
+        }
+    }
+    { // Hotkeys
+        if (engine->input->keyPressed(SDL_SCANCODE_DOWN)) {
+            fov_degrees -= 5.0;
+        }
+        if (engine->input->keyPressed(SDL_SCANCODE_UP)) {
+            fov_degrees += 5.0;
+        }
+        fov = fov_degrees * (M_PI / 180.0);
+        half_fov = fov / 2.0;
+
+        if (engine->input->keyPressed(SDL_SCANCODE_G)) {
+            nextLevel();
+        }
+        if (engine->input->keyPressed(SDL_SCANCODE_M)) {
+            fog = !fog;
+        }
+        if (engine->input->keyPressed(SDL_SCANCODE_T)) {
+            timings = !timings;
+        }
+        if (engine->input->keyPressed(SDL_SCANCODE_SPACE)) {
+            if (mouse_control) {
+                SDL_SetRelativeMouseMode(SDL_FALSE);
+                mouse_control = false;
+            } else {
+                SDL_SetRelativeMouseMode(SDL_TRUE);
+                mouse_control = true;
+            }
+        }
+    }
+    { // Minimap pan/zoom, and adding/removing tiles
+        int size = engine->height;
+        int x_start = engine->width - size;
+        v2 mpos = engine->input->mousePos() - v2(x_start, 0);
+        bool over_minimap = !mouse_control && mpos.x >= 0;
+
+        if (over_minimap && engine->input->wheel != 0) {
+            // Zoom about the cursor, so the cell under it stays put
+            v2 anchor = minimap_view.toWorld(mpos);
+            float zoom = minimap_view.zoom * pow(1.25, engine->input->wheel);
+            float min_zoom = (float) size / (std::max(world.width, world.height) * 4);
+            minimap_view.zoom = std::min(std::max(zoom, min_zoom), 64.0f);
+            minimap_view.center += anchor - minimap_view.toWorld(mpos);
+        }
+        if (over_minimap && engine->input->btnDown(SDL_BUTTON_RIGHT)) {
+            minimap_view.center -= engine->input->motion / minimap_view.zoom;
+        }
+        if (engine->input->keyPressed(SDL_SCANCODE_F)) {
+            fitMinimap(size);
+        }
+        if (over_minimap && engine->input->btnPressed(SDL_BUTTON_LEFT)) {
+            v2 cell = minimap_view.toWorld(mpos).floor();
+            int x = cell.x, y = cell.y;
+            if (x >= 0 && x < world.width && y >= 0 && y < world.height) {
+                // Shift puts down a grate instead, control a door and alt
+                // a thin wall, running between whatever's either side
+                bool door = engine->input->keyDown(SDL_SCANCODE_LCTRL);
+                bool thin = engine->input->keyDown(SDL_SCANCODE_LALT);
+                Block wall = engine->input->keyDown(SDL_SCANCODE_LSHIFT) ? GRATE_WALL : INNER_WALL;
+                if (world.get(x, y)) {
+                    world.set(x, y, NO_WALL);
+                } else if (door || thin) {
+                    bool across_x = world.get(x - 1, y) && world.get(x + 1, y);
+                    bool across_y = world.get(x, y - 1) && world.get(x, y + 1);
+                    world.placeDoor(x, y, across_y && !across_x ? VERTICAL : HORIZONTAL, door);
+                } else {
+                    world.set(x, y, wall);
+                }
+            }
+        }
+        if (over_minimap && engine->input->btnPressed(SDL_BUTTON_MIDDLE)) {
+            // Plot a route there, or stop showing it
+            v2 cell = minimap_view.toWorld(mpos).floor();
+            routing = !(routing && cell.x == route_target.x && cell.y == route_target.y);
+            route_target = cell;
+        }
+    }
+    route.clear();
+    if (routing) {
+        paths.find(world, entities.position(entities.index(player)), route_target + v2(0.5, 0.5), &route);
+    }
+    { // Lights that move: the last volley's flashes, and projectiles
+        lights.clear();
+        if (tracer_time > 0) {
+            float fade = tracer_time / volley_time;
+            lights.push_back({tracers[0], 8, fade});
+            for (const Hit& hit : hitscan.hits) {
+                if (hit.kind != HIT_NOTHING) {
+                    lights.push_back({hit.point + hit.normal * 0.1f, 3, 0.5f * fade});
+                }
+            }
+        }
+        for (int i = 0; i < entities.count; i++) {
+            if (entities.type[i] == ENTITY_PROJECTILE) {
+                lights.push_back({entities.position(i), 5, 0.6});
+            }
+        }
+    }
+}
+
+// Copy out what render() needs of this tick
+void Game::snapshot(Scene* scene) {
+    world.changes(&scene_revision, &scene->world);
+    scene->entities = entities;
+    scene->player = player;
+    scene->lights = lights;
+    scene->tracer_time = tracer_time;
+    if (tracer_time > 0) {
+        scene->tracers = tracers;
+        scene->hits = hitscan.hits;
+    }
+    scene->route = route;
+    scene->minimap_view = minimap_view;
+    scene->fog = fog;
+    scene->timings = timings;
+    scene->mouse_control = mouse_control;
+    scene->fov_degrees = fov_degrees;
+    scene->motion = engine->input->motion.x;
+}
+
+// Generate a new level, cycling through the styles, and put the player
+// in the open cell nearest its middle. Nobody else comes along.
+void Game::nextLevel() {
+    const int size = 256;
+    world.generate(workers, size, size, (LevelStyle) (levels_generated % 3), levels_generated + 1);
+    levels_generated++;
+
+    for (int i = entities.count - 1; i >= 0; i--) {
+        if (entities.type[i] != ENTITY_PLAYER) {
+            entities.removeAt(i);
+        }
+    }
+    int me = entities.index(player);
+    v2 middle = v2(size, size) / 2, spawn = middle;
+    float nearest = INFINITY;
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            v2 center(x + 0.5f, y + 0.5f);
+            if (world.get(x, y) == NO_WALL && (center - middle).size() < nearest) {
+                nearest = (center - middle).size();
+                spawn = center;
+            }
+        }
+    }
+    entities.pos_x[me] = spawn.x;
+    entities.pos_y[me] = spawn.y;
+    entities.vel_x[me] = entities.vel_y[me] = 0;
+
+    routing = false;
+    tracer_time = 0;
+    fitMinimap(engine->height);
+}
+
+// Cast a ray for each of the 3D view's `width` columns into `frame`
+void Game::castView(Scene& scene, int width) {
+    int me = scene.entities.index(scene.player);
+    v2 player_pos = scene.entities.position(me);
+    float view_angle = scene.entities.angle[me];
+    float fov = scene.fov_degrees * (M_PI / 180.0);
+    float half_fov = fov / 2.0;
+
+    float left_view = view_angle - half_fov;
+    float rads_per_pixel = fov / width;
+
+    rays.resize(width);
+    for (int x = 0; x < width; x++) {
+        float angle = left_view + x * rads_per_pixel;
+        rays.dir_x[x] = cos(angle);
+        rays.dir_y[x] = sin(angle);
+    }
+    shown.castRays(player_pos, &rays);
+    frame.capture(shown, player_pos, view_angle, fov, rays);
+}
+
+// Draw the 3D view of what castView() saw
+void Game::render3D(Scene& scene, SDL_Surface* surface, int width, int height) {
+    int me = scene.entities.index(scene.player);
+    v2 player_pos = scene.entities.position(me);
+    float view_angle = scene.entities.angle[me];
+    float fov = scene.fov_degrees * (M_PI / 180.0);
+    float half_fov = fov / 2.0;
+
+    { // Floor
+        SDL_Rect floor_rect;
+        floor_rect.x = 0;
+        floor_rect.y = height / 2;
+        floor_rect.w = width;
+        floor_rect.h = height / 2;
+        engine->raster->fill(
+            surface, &floor_rect,
+            engine->raster->rgb(0x20, 0x20, 0x20)
+        );
+    }
+    { // Sky
+        float percent_sky_visible = fov / (2 * M_PI);
+
+        if (view_angle - half_fov >= 0 && view_angle + half_fov < 2 * M_PI) {
+            // No tiling necessary
+            SDL_Rect src;
+            src.x = (view_angle - half_fov) / (2 * M_PI) * sky->w;
+            src.y = 0;
             src.w = sky->w * percent_sky_visible;
             src.h = sky->h;
             
@@ -562,370 +4501,2151 @@ void Game::render3D(SDL_Surface* surface, int width, int height) {
             dest.w = width;
             dest.h = height / 2;
             
-            SDL_BlitScaled(
-                sky, &src,
-                surface, &dest
-            );    
-        } else {
-            // The crease in the sky is visible, so we tile
-            float left_angle = (2 * M_PI) - clamp_angle(view_angle - half_fov);
-            float right_angle = clamp_angle(view_angle + half_fov);
-            {
-                // Left sky
-                SDL_Rect src;
-                src.x = sky->w - sky->w * percent_sky_visible * (left_angle / fov);
-                src.y = 0;
-                src.w = sky->w * percent_sky_visible * (left_angle / fov);
-                src.h = sky->h;
+            engine->raster->blitScaled(
+                sky, &src,
+                surface, &dest
+            );
+        } else {
+            // The crease in the sky is visible, so we tile
+            float left_angle = (2 * M_PI) - clamp_angle(view_angle - half_fov);
+            float right_angle = clamp_angle(view_angle + half_fov);
+            {
+                // Left sky
+                SDL_Rect src;
+                src.x = sky->w - sky->w * percent_sky_visible * (left_angle / fov);
+                src.y = 0;
+                src.w = sky->w * percent_sky_visible * (left_angle / fov);
+                src.h = sky->h;
+
+                SDL_Rect dest;
+                dest.x = 0;
+                dest.y = 0;
+                dest.w = width * (left_angle / fov);
+                dest.h = height / 2;
+
+                engine->raster->blitScaled(
+                    sky, &src,
+                    surface, &dest
+                );
+            }
+            {
+                // Right sky
+                SDL_Rect src;
+                src.x = 0;
+                src.y = 0;
+                src.w = sky->w * percent_sky_visible * (right_angle / fov);
+                src.h = sky->h;
+
+                SDL_Rect dest;
+                dest.x = width - (width * (right_angle / fov));
+                dest.y = 0;
+                dest.w = width * (right_angle / fov);
+                dest.h = height / 2;
+
+                engine->raster->blitScaled(
+                    sky, &src,
+                    surface, &dest
+                );
+            }
+
+        }
+    }
+    
+    float left_view = view_angle - half_fov;
+    float rads_per_pixel = fov / width;
+
+    // How lit each column's nearest wall is, baked and moving lights together
+    column_light.resize(width);
+    for (int x = 0; x < width; x++) {
+        column_light[x] = lighting.face(frame.cell_x[x], frame.cell_y[x], frame.face[x]) / (float) Lightmap::FULL;
+    }
+    moving_lights.shade(workers, frame, column_light.data());
+    billboards.begin(player_pos, view_angle, fov, width, height);
+
+    lock(surface);
+    uint32_t* pixels = (uint32_t*) surface->pixels;
+    int pitch = surface->pitch / sizeof(uint32_t);
+    
+    for (int x = 0; x < width; x++) {
+        float angle = left_view + x * rads_per_pixel;
+        float perpendicular = cos(abs(view_angle - angle));
+        v2 dir(frame.dir_x[x], frame.dir_y[x]);
+        const WallHit* hits = &frame.walls[x * ViewFrame::max_layers];
+
+        // Back to front, so each grate lands on what's behind it
+        for (int i = frame.layers[x] - 1; i >= 0; i--) {
+            const WallHit& hit = hits[i];
+            float dist = hit.t * perpendicular;
+            float r = (height / (dist * 2)) * plane_distance;
+
+            int top = (height / 2) - r;
+            int column_height = r * 2;
+
+            // Moving lights only reach the nearest wall
+            float light = column_light[x];
+            if (i > 0) {
+                int cell_x, cell_y;
+                Lightmap::Side side;
+                hit_face(hit, dir, &cell_x, &cell_y, &side);
+                light = lighting.face(cell_x, cell_y, side) / (float) Lightmap::FULL;
+            }
+            uint8_t level = std::min(light, 1.0f) * Lightmap::FULL + 0.5f;
+
+            // Texture mapping
+            float texture_x =
+                hit.dir == HORIZONTAL
+                ? hit.point.x - floor(hit.point.x)
+                : hit.point.y - floor(hit.point.y);
+            SDL_Surface* texture = nullptr;
+            switch (hit.type) {
+            case NO_WALL:
+                fatal("Unreachable");
+            case OUTER_WALL:
+                texture = light_wall;
+                break;
+            case INNER_WALL:
+                texture = dark_wall;
+                break;
+            case GRATE_WALL:
+                draw_masked_column(
+                    pixels + x, pitch, height, top, column_height,
+                    grate, texture_x * grate.size, level, surface->format->Amask
+                );
+                continue;
+            case DOOR_WALL: {
+                // The texture slides along with the door
+                const Doors::Door* door = shown.door(floor(hit.point.x), floor(hit.point.y));
+                if (door != nullptr) {
+                    texture_x = std::max(texture_x - door->open, 0.0f);
+                }
+                texture = light_wall;
+                break;
+            }
+            case THIN_WALL:
+                texture = dark_wall;
+                break;
+            }
+
+            int texel_pitch = texture->pitch / sizeof(uint32_t);
+            const uint32_t* texels =
+                (const uint32_t*) texture->pixels + (int) (texture_x * (float) texture->w);
+            draw_wall_column(
+                pixels + x, pitch, height, top, column_height,
+                texels, texel_pitch, texture->h
+            );
+            if (level < Lightmap::FULL) {
+                shade_wall_column(pixels + x, pitch, height, top, column_height, level, surface->format->Amask);
+            }
+        }
+    }
+
+    // Enemies stand on the floor, projectiles fly at eye level
+    for (int i = 0; i < scene.entities.count; i++) {
+        v2 pos = scene.entities.position(i);
+        float size = scene.entities.radius[i] * 2;
+        switch (scene.entities.type[i]) {
+        case ENTITY_PLAYER:
+            break;
+        case ENTITY_ENEMY:
+            billboards.add(&enemy_sprite, pos, size, 0);
+            break;
+        case ENTITY_PROJECTILE:
+            billboards.add(&projectile_sprite, pos, size * 2, 0.5f - size);
+            break;
+        }
+    }
+    billboards.draw(workers, pixels, pitch, frame.depth.data());
+
+    SDL_UnlockSurface(surface);
+}
+
+// Show the whole world in the top-down view
+void Game::fitMinimap(int size) {
+    // Whole pixels per cell when there's room, so the grid stays even
+    int cells = std::max(world.width, world.height);
+    minimap_view.size = size;
+    minimap_view.zoom = size >= cells ? size / cells : (float) size / cells;
+    minimap_view.center = v2(world.width, world.height) / 2;
+}
+
+// Below this many pixels per cell, tiles are flat colors with no grid
+static const float textured_zoom = 4;
+
+// What cells the player hasn't seen look like under the fog, apart from
+// the black of open floor
+static const uint8_t fog_rgb[] = { 0x18, 0x1c, 0x24 };
+
+// Grates are drawn flat at any zoom, too fine to make out scaled down
+static const uint8_t grate_rgb[] = { 0x7c, 0x64, 0x48 };
+
+void Game::drawMinimapCell(int x, int y) {
+    Viewport& view = minimap_drawn;
+    v2 top_left = view.toScreen(v2(x, y)).floor();
+    v2 bottom_right = view.toScreen(v2(x + 1, y + 1)).floor();
+    SDL_Rect rect;
+    rect.x = top_left.x;
+    rect.y = top_left.y;
+    rect.w = bottom_right.x - top_left.x;
+    rect.h = bottom_right.y - top_left.y;
+    if (rect.w <= 0 || rect.h <= 0) {
+        return;
+    }
+
+    Block block = shown.get(x, y);
+    if (minimap_fog && !sight.seen(x, y)) {
+        engine->raster->fill(minimap, &rect, engine->raster->rgb(fog_rgb[0], fog_rgb[1], fog_rgb[2]));
+        return;
+    }
+    if (view.zoom < textured_zoom) {
+        uint32_t color =
+            block == NO_WALL    ? engine->raster->rgb(0, 0, 0) :
+            block == OUTER_WALL ? engine->raster->rgb(0xa0, 0xa0, 0xa0) :
+            block == DOOR_WALL  ? engine->raster->rgb(0xa0, 0xa0, 0xa0) :
+            block == GRATE_WALL ? engine->raster->rgb(grate_rgb[0], grate_rgb[1], grate_rgb[2]) :
+                                  engine->raster->rgb(0x50, 0x50, 0x50);
+        engine->raster->fill(minimap, &rect, color);
+        return;
+    }
+
+    if (!block) {
+        engine->raster->fill(
+            minimap, &rect,
+            engine->raster->rgb(0, 0, 0)
+        );
+    } else if (block == GRATE_WALL) {
+        engine->raster->fill(
+            minimap, &rect,
+            engine->raster->rgb(grate_rgb[0], grate_rgb[1], grate_rgb[2])
+        );
+    } else if (block == DOOR_WALL || block == THIN_WALL) {
+        // A bar across the middle of the floor, the way it runs
+        engine->raster->fill(
+            minimap, &rect,
+            engine->raster->rgb(0, 0, 0)
+        );
+        const Doors::Door* door = shown.door(x, y);
+        SDL_Rect bar = rect;
+        if (door == nullptr || door->along == HORIZONTAL) {
+            bar.h = std::max(rect.h / 4, 1);
+            bar.y += (rect.h - bar.h) / 2;
+        } else {
+            bar.w = std::max(rect.w / 4, 1);
+            bar.x += (rect.w - bar.w) / 2;
+        }
+        engine->raster->blitScaled(
+            block == DOOR_WALL ? light_wall : dark_wall, nullptr,
+            minimap, &bar
+        );
+    } else {
+        SDL_Surface* wall = nullptr;
+        switch (block) {
+        case NO_WALL:
+        case GRATE_WALL:
+        case DOOR_WALL:
+        case THIN_WALL:
+            fatal("Unreachable");
+        case OUTER_WALL:
+            wall = light_wall;
+            break;
+        case INNER_WALL:
+            wall = dark_wall;
+            break;
+        }
+        engine->raster->blitScaled(
+            wall, nullptr,
+            minimap, &rect
+        );
+    }
+
+    // The grid lines along this cell's top and left edges
+    auto line_color = engine->raster->rgb(0x90, 0x90, 0x90);
+    rect.h = 1;
+    engine->raster->fill(minimap, &rect, line_color);
+    rect.w = 1;
+    rect.h = bottom_right.y - top_left.y;
+    engine->raster->fill(minimap, &rect, line_color);
+}
+
+// Zoomed out past one pixel per cell: shade each pixel of the screen
+// rect [x1, x2) x [y1, y2) by how full its pyramid block is.
+void Game::drawMinimapDensity(int level, int x1, int y1, int x2, int y2) {
+    Viewport& view = minimap_drawn;
+    x1 = std::max(x1, 0);
+    y1 = std::max(y1, 0);
+    x2 = std::min(x2, view.size);
+    y2 = std::min(y2, view.size);
+
+    int block_size = 2 << level;
+    // Any wall at all shows up, full blocks match the flat wall color
+    uint32_t palette[256];
+    palette[0] = engine->raster->rgb(0, 0, 0);
+    for (int i = 1; i < 256; i++) {
+        uint8_t shade = 0x30 + i * (0xa0 - 0x30) / 255;
+        palette[i] = engine->raster->rgb(shade, shade, shade);
+    }
+    uint32_t fog_color = engine->raster->rgb(fog_rgb[0], fog_rgb[1], fog_rgb[2]);
+
+    const OccupancyPyramid& occupancy = shown.pyramid();
+    const OccupancyPyramid::Level& l = occupancy.levels[level];
+    lock(minimap);
+    uint32_t* pixels = (uint32_t*) minimap->pixels;
+    int pitch = minimap->pitch / sizeof(uint32_t);
+    for (int py = y1; py < y2; py++) {
+        for (int px = x1; px < x2; px++) {
+            v2 cell = view.toWorld(v2(px + 0.5f, py + 0.5f)) / block_size;
+            int bx = floor(cell.x), by = floor(cell.y);
+            uint32_t color = palette[0];
+            if (bx >= 0 && bx < l.width && by >= 0 && by < l.height) {
+                uint32_t count = occupancy.count(level, bx, by);
+                color = palette[std::min(count * 255 / (block_size * block_size), 255u)];
+                // Explored or not goes by the cell in the pixel's middle
+                if (minimap_fog && !sight.seen(floor(cell.x * block_size), floor(cell.y * block_size))) {
+                    color = fog_color;
+                }
+            }
+            pixels[px + py * pitch] = color;
+        }
+    }
+    SDL_UnlockSurface(minimap);
+}
+
+// Bring the cached tiles and grid up to date with the world and the
+// scene's viewport. Edits only redraw what they touched; a new viewport
+// redraws every pixel, but never looks at cells that aren't on screen.
+void Game::updateMinimap(const Scene& scene, int size) {
+    if (minimap == nullptr || minimap->w != size) {
+        SDL_FreeSurface(minimap);
+        minimap = SDL_CreateRGBSurfaceWithFormat(
+            0, size, size, sizeof(uint32_t) * 8, engine->canvas->format->format
+        );
+        minimap_drawn = Viewport();
+    }
+    Viewport view = scene.minimap_view;
+    view.size = size;
+
+    // The level whose blocks are at least a pixel wide, if cells aren't
+    int level = -1;
+    for (float cells_per_pixel = 1 / view.zoom; cells_per_pixel > 1; cells_per_pixel /= 2) {
+        level++;
+    }
+
+    if (!shown.editsSince(minimap_revision, &minimap_edits)) {
+        minimap_drawn = Viewport();
+    }
+    if (minimap_fog != scene.fog) {
+        minimap_fog = scene.fog;
+        minimap_drawn = Viewport();
+    }
+    if (!sight.takeRevealed(&minimap_revealed)) {
+        minimap_drawn = Viewport();
+    }
+    level = std::min(level, (int) shown.pyramid().levels.size() - 1);
+    minimap_revision = shown.revision();
+
+    if (minimap_drawn == view) {
+        auto redraw = [&] (int cell) {
+            int x = cell % shown.width, y = cell / shown.width;
+            if (level < 0) {
+                drawMinimapCell(x, y);
+            } else {
+                int block_size = 2 << level;
+                v2 block = v2(x / block_size, y / block_size) * block_size;
+                v2 top_left = view.toScreen(block).floor();
+                v2 bottom_right = view.toScreen(block + v2(block_size, block_size)).floor();
+                drawMinimapDensity(level, top_left.x, top_left.y, bottom_right.x + 1, bottom_right.y + 1);
+            }
+        };
+        for (int cell : minimap_edits) {
+            redraw(cell);
+        }
+        if (minimap_fog) {
+            for (int cell : minimap_revealed) {
+                redraw(cell);
+            }
+        }
+        return;
+    }
+
+    minimap_drawn = view;
+    engine->raster->fill(minimap, nullptr, engine->raster->rgb(0, 0, 0));
+    if (level >= 0) {
+        drawMinimapDensity(level, 0, 0, size, size);
+        return;
+    }
+
+    v2 top_left = view.toWorld(v2(0, 0)).floor();
+    v2 bottom_right = view.toWorld(v2(size, size)).floor();
+    int x1 = std::max((int) top_left.x, 0), y1 = std::max((int) top_left.y, 0);
+    int x2 = std::min((int) bottom_right.x + 1, shown.width);
+    int y2 = std::min((int) bottom_right.y + 1, shown.height);
+    for (int y = y1; y < y2; y++) {
+        for (int x = x1; x < x2; x++) {
+            drawMinimapCell(x, y);
+        }
+    }
+}
+
+void Game::renderTopDown(Scene& scene, SDL_Surface* surface, int size) {
+    updateMinimap(scene, size);
+    engine->raster->blitScaled(minimap, nullptr, surface, nullptr);
+    Viewport view = scene.minimap_view;
+    view.size = size;
+    int me = scene.entities.index(scene.player);
+    v2 player_pos = scene.entities.position(me);
+
+    if (scene.tracer_time > 0) { // Last volley
+        std::vector<Line> lines;
+        for (size_t n = 0; n < scene.tracers.size(); n++) {
+            v2 start = view.toScreen(scene.tracers[n]);
+            v2 end = view.toScreen(scene.hits[n].point);
+            Line line;
+            line.x1 = start.x;
+            line.y1 = start.y;
+            line.x2 = end.x;
+            line.y2 = end.y;
+            line.color = engine->raster->rgb(0xff, 0xa0, 0x20);
+            lines.push_back(line);
+        }
+        engine->raster->lines(surface, lines.data(), lines.size());
+    }
+    if (scene.route.size() > 1) { // Route to wherever was middle-clicked
+        std::vector<Line> lines;
+        for (size_t n = 1; n < scene.route.size(); n++) {
+            v2 start = view.toScreen(scene.route[n - 1]);
+            v2 end = view.toScreen(scene.route[n]);
+            Line line;
+            line.x1 = start.x;
+            line.y1 = start.y;
+            line.x2 = end.x;
+            line.y2 = end.y;
+            line.color = engine->raster->rgb(0x40, 0xc0, 0xff);
+            lines.push_back(line);
+        }
+        engine->raster->lines(surface, lines.data(), lines.size());
+    }
+    { // Everyone else
+        for (int i = 0; i < scene.entities.count; i++) {
+            if (i == me || (scene.fog && !sight.visible(floor(scene.entities.pos_x[i]), floor(scene.entities.pos_y[i])))) {
+                continue;
+            }
+            v2 center = view.toScreen(scene.entities.position(i));
+            const int radius = std::max(view.zoom * scene.entities.radius[i], 1.0f);
+            if (center.x + radius < 0 || center.y + radius < 0 ||
+                center.x - radius >= size || center.y - radius >= size) {
+                continue;
+            }
+            SDL_Rect rect;
+            rect.x = center.x - radius;
+            rect.y = center.y - radius;
+            rect.w = radius * 2 + 1;
+            rect.h = radius * 2 + 1;
+            uint32_t color = scene.entities.type[i] == ENTITY_PROJECTILE
+                ? engine->raster->rgb(0xff, 0xe0, 0x40)
+                : engine->raster->rgb(0xe0, 0x30, 0x30);
+            engine->raster->fill(surface, &rect, color);
+        }
+    }
+
+    if (frame.width > 0) { // Sight: the outline of what the 3D view's rays hit
+        std::vector<Line> lines;
+        auto add_line = [&] (v2 from, v2 to, uint32_t color) {
+            v2 start = view.toScreen(from);
+            v2 end = view.toScreen(to);
+            Line line;
+            line.x1 = start.x;
+            line.y1 = start.y;
+            line.x2 = end.x;
+            line.y2 = end.y;
+            line.color = color;
+            lines.push_back(line);
+        };
+        auto hit = [&] (int x) {
+            return v2(frame.hit_x[x], frame.hit_y[x]);
+        };
+        uint32_t edge = engine->raster->rgb(0, 0xff, 0);
+        for (int x = 1; x < frame.width; x++) {
+            add_line(hit(x - 1), hit(x), engine->raster->rgb(0, 0x90, 0));
+        }
+        add_line(frame.eye, hit(0), edge);
+        add_line(frame.eye, hit(frame.width / 2), engine->raster->rgb(0xff, 0xff, 0xff));
+        add_line(frame.eye, hit(frame.width - 1), edge);
+        engine->raster->lines(surface, lines.data(), lines.size());
+    }
+
+    { // Player
+        const int radius = std::max(view.zoom * scene.entities.radius[me], 1.0f);
+        v2 center = view.toScreen(player_pos);
+        SDL_Rect rect;
+        rect.x = center.x - radius;
+        rect.y = center.y - radius;
+        rect.w = radius * 2 + 1;
+        rect.h = radius * 2 + 1;
+        engine->raster->fill(surface, &rect, engine->raster->rgb(0, 0xc3, 0xff));
+    }
+}
+
+// Draw `scene`, after bringing what's worked out from the world up to
+// date with it. Each part of the frame is a task, run as soon as what
+// it needs is done, alongside whatever else is ready.
+void Game::render(Scene& scene) {
+    int size = engine->height;
+    auto resize = [&] (SDL_Surface** surface) {
+        if (*surface == nullptr || (*surface)->w != size) {
+            SDL_FreeSurface(*surface);
+            *surface = SDL_CreateRGBSurfaceWithFormat(
+                0, size, size, sizeof(uint32_t) * 8, engine->canvas->format->format
+            );
+        }
+    };
+    resize(&view_surface);
+    resize(&map_surface);
+    v2 eye = scene.entities.position(scene.entities.index(scene.player));
+    std::vector<Caption> captions;
+
+    TaskGraph tasks;
+    int world_task = tasks.add("WORLD", [&] {
+        shown.apply(scene.world);
+    });
+    int sight_task = tasks.add("SIGHT", [&] {
+        sight.update(shown, eye);
+    }, {world_task});
+    int light_task = tasks.add("LIGHTS", [&] {
+        lighting.update(workers, shown);
+        moving_lights.lights = scene.lights;
+        moving_lights.cast(workers, shown, eye);
+    }, {world_task});
+    int ray_task = tasks.add("RAYS", [&] {
+        castView(scene, size);
+    }, {world_task});
+    int view_task = tasks.add("3D VIEW", [&] {
+        render3D(scene, view_surface, size, size);
+    }, {ray_task, light_task});
+    int map_task = tasks.add("TOP-DOWN", [&] {
+        renderTopDown(scene, map_surface, size);
+    }, {ray_task, sight_task});
+    int hud_task = tasks.add("HUD", [&] {
+        char buf[512];
+        sprintf(buf, "FOV: %.2f", scene.fov_degrees);
+        captions.push_back(engine->renderText(buf, 0, 0));
+
+        sprintf(buf, "ANGLE: %.2f", scene.entities.angle[scene.entities.index(scene.player)] * (180.0 / M_PI));
+        captions.push_back(engine->renderText(buf, 0, 30));
+
+        sprintf(buf, "MOUSE CONTROL: %s", scene.mouse_control ? "ON" : "OFF");
+        captions.push_back(engine->renderText(buf, 0, 60));
+
+        sprintf(buf, "MOTION: %3.0f", scene.motion);
+        captions.push_back(engine->renderText(buf, 0, 90));
+
+        if (scene.timings) {
+            // The frame before this one's
+            for (size_t n = 0; n < task_times.size(); n++) {
+                sprintf(buf, "%s: %.2f MS", task_times[n].first, task_times[n].second * 1e3);
+                captions.push_back(engine->renderText(buf, 0, 150 + 30 * n));
+            }
+        }
+    });
+    tasks.add("COMPOSITE", [&] {
+        SDL_Rect dest;
+        dest.x = 0;
+        dest.y = 0;
+        dest.w = size;
+        dest.h = size;
+        engine->raster->blitScaled(view_surface, nullptr, scene.canvas, &dest);
+
+        dest.x = engine->width - size;
+        engine->raster->blitScaled(map_surface, nullptr, scene.canvas, &dest);
+
+        for (Caption& caption : captions) {
+            engine->drawText(scene.canvas, caption);
+        }
+    }, {view_task, map_task, hud_task});
+    tasks.run(workers);
+
+    task_times.clear();
+    for (const TaskGraph::Task& task : tasks.tasks) {
+        task_times.push_back({task.name, task.seconds});
+    }
+}
+
+//
+// Engine
+//
+
+Engine::Engine(const char* title, int width, int height, int pipeline_depth) {
+    this->width = width;
+    this->height = height;
+    this->pipeline_depth = pipeline_depth;
+
+    int err = 0;
+    err = SDL_Init(SDL_INIT_EVERYTHING);
+    if (err != 0) {
+        fatal(SDL_GetError());
+    }
+
+    err = TTF_Init();
+    if (err != 0) {
+        fatal(TTF_GetError());
+    }
+
+    font = TTF_OpenFont("res/VGA8.ttf", 26);
+    if (font == nullptr) {
+        fatal(TTF_GetError());
+    }
+    
+    window = SDL_CreateWindow(
+        title, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+        width, height, SDL_WINDOW_SHOWN
+    );
+    if (window == nullptr) {
+        fatal(SDL_GetError());
+    }
+    
+    // Render straight into the window surface if we have a rasterizer
+    // for its format, otherwise draw into an ARGB8888 canvas and let SDL
+    // convert it once per frame.
+    window_surface = SDL_GetWindowSurface(window);
+    raster = Raster::forFormat(window_surface->format->format);
+    if (raster != nullptr) {
+        canvas = window_surface;
+    } else {
+        canvas = SDL_CreateRGBSurfaceWithFormat(
+            0, width, height, sizeof(uint32_t) * 8, SDL_PIXELFORMAT_ARGB8888
+        );
+        raster = Raster::forFormat(SDL_PIXELFORMAT_ARGB8888);
+    }
+            
+    last_tick = SDL_GetPerformanceCounter();
+    delta = 1.0 / 60.0;
 
-                SDL_Rect dest;
-                dest.x = 0;
-                dest.y = 0;
-                dest.w = width * (left_angle / fov);
-                dest.h = height / 2;
+    // There is ZERO reason these should be heap-allocated, but C++
+    // refuses to let me perform the above initialization BEFORE their
+    // constructors are called, no matter what I do. This has me
+    // royally pissed.
+    game = new Game(this);
+    input = new Input();
 
-                SDL_BlitScaled(
-                    sky, &src,
-                    surface, &dest
-                );
+    // Drawn in line, a scene goes straight onto the canvas. Otherwise
+    // each has its own, so one can be shown while the next is drawn.
+    scenes.resize(pipeline_depth + 1);
+    for (Scene& scene : scenes) {
+        scene.canvas = pipeline_depth == 0 ? canvas : SDL_CreateRGBSurfaceWithFormat(
+            0, width, height, sizeof(uint32_t) * 8, canvas->format->format
+        );
+        free_scenes.push_back(&scene);
+    }
+    if (pipeline_depth > 0) {
+        renderer = std::thread([this] { drawQueued(); });
+    }
+}
+
+Engine::~Engine() {
+    if (renderer.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(scenes_lock);
+            quitting = true;
+        }
+        scenes_changed.notify_all();
+        renderer.join();
+    }
+    for (Scene& scene : scenes) {
+        if (scene.canvas != canvas) {
+            SDL_FreeSurface(scene.canvas);
+        }
+    }
+    delete game;
+    delete input;
+    if (canvas != window_surface) {
+        SDL_FreeSurface(canvas);
+    }
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+}
+
+// Safe on any thread, as long as it's the only one rendering text
+Caption Engine::renderText(const char* msg, int x, int y) {
+    Caption caption;
+    caption.shadow = TTF_RenderText_Solid(font, msg, {0, 0, 0});
+    caption.text   = TTF_RenderText_Solid(font, msg, {0xff, 0xff, 0xff});
+    caption.x = x;
+    caption.y = y;
+    return caption;
+}
+
+// Draw a caption onto `surface`, and free it
+void Engine::drawText(SDL_Surface* surface, Caption caption) {
+    auto blit_text =
+        [&](SDL_Surface* surf, int x_offset, int y_offset) {
+            SDL_Rect rect;
+            rect.x = caption.x + x_offset;
+            rect.y = caption.y + y_offset;
+            rect.w = surf->w;
+            rect.h = surf->h;
+            SDL_BlitSurface(surf, nullptr, surface, &rect);
+        };
+    
+    blit_text(caption.shadow, -2, 2);
+    blit_text(caption.text, 0, 0);
+    
+    SDL_FreeSurface(caption.shadow);
+    SDL_FreeSurface(caption.text);
+}
+
+bool Engine::frame() {
+    input->resetCache();
+    
+    // Consume events
+    SDL_Event event;
+    while (SDL_PollEvent(&event) != 0) {
+        if (event.type == SDL_QUIT) {
+            return false;
+        } else if (event.type == SDL_MOUSEMOTION) {
+            input->motion += v2(event.motion.xrel, event.motion.yrel);
+        } else if (event.type == SDL_MOUSEWHEEL) {
+            input->wheel += event.wheel.y;
+        }
+    }
+    
+    if (input->keyPressed(SDL_SCANCODE_ESCAPE)) {
+        return false;
+    }
+    
+    // Update
+    game->update();
+
+    // Hand the tick over to be drawn, once a scene is free to hold it.
+    // Scenes come free once they've been shown, and only this thread
+    // talks to the window.
+    Scene* scene;
+    {
+        std::unique_lock<std::mutex> lock(scenes_lock);
+        for (;;) {
+            while (!drawn.empty()) {
+                Scene* shown = drawn.front();
+                drawn.pop_front();
+                lock.unlock();
+                present(*shown);
+                lock.lock();
+                free_scenes.push_back(shown);
             }
-            {
-                // Right sky
-                SDL_Rect src;
-                src.x = 0;
-                src.y = 0;
-                src.w = sky->w * percent_sky_visible * (right_angle / fov);
-                src.h = sky->h;
+            if (!free_scenes.empty()) {
+                break;
+            }
+            scenes_changed.wait(lock);
+        }
+        scene = free_scenes.back();
+        free_scenes.pop_back();
+    }
+    game->snapshot(scene);
+    if (pipeline_depth == 0) {
+        draw(*scene);
+        present(*scene);
+        free_scenes.push_back(scene);
+    } else {
+        {
+            std::lock_guard<std::mutex> lock(scenes_lock);
+            queued.push_back(scene);
+        }
+        scenes_changed.notify_all();
+    }
+            
+    { // Update delta
+        uint64_t tick = SDL_GetPerformanceCounter();
+        delta = (float) (tick - last_tick) / SDL_GetPerformanceFrequency();
+        last_tick = tick;
+    }
 
-                SDL_Rect dest;
-                dest.x = width - (width * (right_angle / fov));
-                dest.y = 0;
-                dest.w = width * (right_angle / fov);
-                dest.h = height / 2;
+    // Constrain FPS
+    const float max_fps = 60.0;
+    if (delta < 1.0 / max_fps) {
+        float remaining_time = (1.0 / max_fps) - delta;
+
+        const uint64_t one_billion = 1000000000;
+        uint64_t nanoseconds = (uint64_t) (delta * ((float) one_billion));
+        struct timespec t;
+        t.tv_sec  = nanoseconds / one_billion;
+        t.tv_nsec = nanoseconds % one_billion;
+        nanosleep(&t, nullptr);
+    }
+
+    return true;
+}
+
+// Safe on any thread, as long as it's the only one drawing
+void Engine::draw(Scene& scene) {
+    raster->fill(scene.canvas, nullptr, raster->rgb(0xff, 0xff, 0xff));
+    game->render(scene);
+}
+
+// Show a scene that's been drawn. SDL only takes window calls from the
+// thread that set up video, so this is only ever called from frame().
+void Engine::present(Scene& scene) {
+    if (scene.canvas != window_surface) {
+        SDL_BlitSurface(scene.canvas, nullptr, window_surface, nullptr);
+    }
+    SDL_UpdateWindowSurface(window);
+}
+
+// Runs on `renderer`: draw scenes as they're queued, until told to quit
+// with none left
+void Engine::drawQueued() {
+    for (;;) {
+        Scene* scene;
+        {
+            std::unique_lock<std::mutex> lock(scenes_lock);
+            scenes_changed.wait(lock, [&] { return !queued.empty() || quitting; });
+            if (queued.empty()) {
+                return;
+            }
+            scene = queued.front();
+        }
+        draw(*scene);
+        {
+            std::lock_guard<std::mutex> lock(scenes_lock);
+            queued.pop_front();
+            drawn.push_back(scene);
+        }
+        scenes_changed.notify_all();
+    }
+}
+
+//
+// Benchmarks
+//
+
+static void benchColumnScalers() {
+    const int surface_height = 600;
+    const int iterations = 20000;
+    std::vector<uint32_t> texture(wall_texture_size * wall_texture_size);
+    for (size_t i = 0; i < texture.size(); i++) {
+        texture[i] = (uint32_t) (i * 2654435761u);
+    }
+    std::vector<uint32_t> column(surface_height);
+
+    double unrolled_time = 0, generic_time = 0;
+    long pixels = 0;
+    for (int h = 1; h <= max_unrolled_height; h++) {
+        int top = (surface_height - h) / 2;
+        uint64_t start = SDL_GetPerformanceCounter();
+        for (int i = 0; i < iterations; i++) {
+            draw_wall_column(
+                column.data(), 1, surface_height, top, h,
+                texture.data() + (i & (wall_texture_size - 1)), wall_texture_size, wall_texture_size
+            );
+        }
+        unrolled_time += seconds_since(start);
+
+        start = SDL_GetPerformanceCounter();
+        for (int i = 0; i < iterations; i++) {
+            scale_column_generic(
+                column.data(), 1, surface_height, top, h,
+                texture.data() + (i & (wall_texture_size - 1)), wall_texture_size, wall_texture_size
+            );
+        }
+        generic_time += seconds_since(start);
+        pixels += (long) h * iterations;
+    }
+    printf("column scalers (heights 1..%d):\n", max_unrolled_height);
+    printf("  unrolled: %.3f ns/pixel\n", unrolled_time * 1e9 / pixels);
+    printf("  generic:  %.3f ns/pixel\n", generic_time * 1e9 / pixels);
+}
+
+// Grate columns drawn run by run against a texel by texel mask test,
+// and rays that see through grates against rays that stop at them
+static void benchGrates() {
+    const int surface_height = 1080;
+    const int iterations = 2000;
+    std::vector<uint32_t> texture(wall_texture_size * wall_texture_size);
+    for (size_t i = 0; i < texture.size(); i++) {
+        texture[i] = (uint32_t) (i * 2654435761u) | 1;
+    }
+    MaskedTexture grate = MaskedTexture::grate(texture.data(), wall_texture_size, wall_texture_size, 4);
+    // The same grate with its gaps keyed out as 0
+    std::vector<uint32_t> keyed(grate.texels.size(), 0);
+    for (int u = 0; u < grate.size; u++) {
+        for (uint32_t r = grate.starts[u]; r < grate.starts[u + 1]; r++) {
+            for (int v = grate.runs[r].start; v < grate.runs[r].end; v++) {
+                keyed[u * grate.size + v] = grate.texels[u * grate.size + v];
+            }
+        }
+    }
+    std::vector<uint32_t> column(surface_height);
+
+    double run_time = 0, keyed_time = 0;
+    for (int h = 64; h <= surface_height; h += 64) {
+        int top = (surface_height - h) / 2;
+        uint64_t start = SDL_GetPerformanceCounter();
+        for (int i = 0; i < iterations; i++) {
+            draw_masked_column(column.data(), 1, surface_height, top, h, grate, i & (grate.size - 1), 255, 0);
+        }
+        run_time += seconds_since(start);
+
+        start = SDL_GetPerformanceCounter();
+        uint32_t step = ((uint32_t) grate.size << 16) / h;
+        for (int i = 0; i < iterations; i++) {
+            const uint32_t* texels = &keyed[(i & (grate.size - 1)) * grate.size];
+            uint32_t pos = 0;
+            for (int y = top; y < top + h; y++) {
+                uint32_t texel = texels[pos >> 16];
+                if (texel != 0) {
+                    column[y] = texel;
+                }
+                pos += step;
+            }
+        }
+        keyed_time += seconds_since(start);
+    }
+    int columns = iterations * (surface_height / 64);
+    printf("grates:\n");
+    printf("  columns, runs:  %.1f ns per column\n", run_time * 1e9 / columns);
+    printf("  columns, keyed: %.1f ns per column\n", keyed_time * 1e9 / columns);
+
+    const int size = 512;
+    const int rays = 100000;
+    World world(size, size);
+    srand(1);
+    for (int i = 0; i < size * size / 40; i++) {
+        world.set(rand() % size, rand() % size, INNER_WALL);
+        world.set(rand() % size, rand() % size, GRATE_WALL);
+    }
+    v2 origin(size / 2 + 0.5f, size / 2 + 0.5f);
+    world.set(origin.x, origin.y, NO_WALL);
+    for (int max_hits : {1, 2, 4}) {
+        WallHit hits[4];
+        long layers = 0;
+        uint64_t start = SDL_GetPerformanceCounter();
+        for (int i = 0; i < rays; i++) {
+            float angle = i * (M_PI * 2 / rays);
+            layers += world.wallBoundary(origin, v2(cos(angle), sin(angle)), hits, max_hits);
+        }
+        double time = seconds_since(start);
+        printf("  rays, up to %d hits: %.1f ns per ray, %.2f hits each\n", max_hits, time * 1e9 / rays, (double) layers / rays);
+    }
+}
+
+// Rays through a field of doors and thin walls against the same field
+// with plain walls in their place, and a tick of a thousand doors sliding
+static void benchDoors() {
+    const int size = 512;
+    const int rays = 100000;
+    const int count = 1000;
+    World plain(size, size), doors(size, size);
+    srand(1);
+    for (int i = 0; i < size * size / 40; i++) {
+        int x = rand() % size, y = rand() % size;
+        plain.set(x, y, INNER_WALL);
+        doors.set(x, y, INNER_WALL);
+    }
+    std::vector<v2> cells;
+    while ((int) cells.size() < count) {
+        int x = rand() % size, y = rand() % size;
+        if (!doors.get(x, y)) {
+            plain.set(x, y, INNER_WALL);
+            doors.placeDoor(x, y, rand() % 2 ? HORIZONTAL : VERTICAL, cells.size() % 2 == 0);
+            cells.push_back(v2(x, y));
+        }
+    }
+    v2 origin(size / 2 + 0.5f, size / 2 + 0.5f);
+    plain.set(origin.x, origin.y, NO_WALL);
+    doors.set(origin.x, origin.y, NO_WALL);
+
+    printf("doors (%d doors and thin walls):\n", count);
+    for (World* world : {&plain, &doors}) {
+        float total = 0;
+        uint64_t start = SDL_GetPerformanceCounter();
+        for (int i = 0; i < rays; i++) {
+            float angle = i * (M_PI * 2 / rays);
+            v2 dir(cos(angle), sin(angle));
+            total += (world->wallBoundary(origin, dir) - origin).size();
+        }
+        double time = seconds_since(start);
+        printf("  rays, %s: %.1f ns per ray, %.2f cells each\n",
+            world == &plain ? "plain walls" : "doors      ", time * 1e9 / rays, total / rays);
+    }
+
+    const int ticks = 120;
+    Entities nobody;
+    for (v2 cell : cells) {
+        doors.toggleDoor(cell.x, cell.y);
+    }
+    uint64_t revision = doors.revision();
+    uint64_t start = SDL_GetPerformanceCounter();
+    for (int tick = 0; tick < ticks; tick++) {
+        doors.moveDoors(1.0 / 60.0, nobody);
+    }
+    double time = seconds_since(start);
+    printf("  sliding %d doors: %.2f us per tick, %d grid edits in %d ticks\n",
+        count / 2, time * 1e6 / ticks, (int) (doors.revision() - revision), ticks);
+}
+
+static void benchKernels(CpuTier tier) {
+    Kernels::select(tier, true);
+    const int size = 600;
+    const int frames = 200;
+    std::vector<uint32_t> canvas(size * size);
+    std::vector<uint32_t> texture(wall_texture_size * wall_texture_size, 0x123456);
+
+    uint64_t start = SDL_GetPerformanceCounter();
+    for (int f = 0; f < frames; f++) {
+        for (int y = 0; y < size; y++) {
+            kernels.fillSpan(canvas.data() + y * size, size, f);
+        }
+    }
+    double fill_time = seconds_since(start);
+
+    start = SDL_GetPerformanceCounter();
+    uint32_t step = ((uint32_t) wall_texture_size << 16) / size;
+    for (int f = 0; f < frames; f++) {
+        for (int y = 0; y < size; y++) {
+            kernels.scaleSpan(canvas.data() + y * size, texture.data(), size, f, step);
+        }
+    }
+    double span_time = seconds_since(start);
+
+    start = SDL_GetPerformanceCounter();
+    for (int f = 0; f < frames; f++) {
+        for (int x = 0; x < size; x++) {
+            int h = 300 + (x + f) % 900;
+            kernels.scaleColumn(
+                canvas.data() + x, size, size, (size - h) / 2, h,
+                texture.data() + (x & (wall_texture_size - 1)), wall_texture_size, wall_texture_size
+            );
+        }
+    }
+    double column_time = seconds_since(start);
+
+    World world(512, 512);
+    srand(1);
+    for (int i = 0; i < 512 * 512 / 20; i++) {
+        world.set(rand() % 512, rand() % 512, INNER_WALL);
+    }
+    RayBatch rays;
+    rays.resize(size);
+    start = SDL_GetPerformanceCounter();
+    for (int f = 0; f < frames; f++) {
+        float view = f * 0.05;
+        for (int x = 0; x < size; x++) {
+            float angle = view + x * (1.0 / size);
+            rays.dir_x[x] = cos(angle);
+            rays.dir_y[x] = sin(angle);
+        }
+        world.castRays(v2(256.5, 256.5), &rays);
+    }
+    double ray_time = seconds_since(start);
+
+    const int movers = 10000;
+    std::vector<float> pos_x(movers), pos_y(movers), vel_x(movers), vel_y(movers), radius(movers, 0.3);
+    std::vector<uint8_t> blocked(movers);
+    for (int i = 0; i < movers; i++) {
+        pos_x[i] = rand() % 512 + 0.5f;
+        pos_y[i] = rand() % 512 + 0.5f;
+        vel_x[i] = cos(i);
+        vel_y[i] = sin(i);
+    }
+    start = SDL_GetPerformanceCounter();
+    for (int f = 0; f < frames; f++) {
+        world.stepCircles(
+            1.0 / 60.0, movers, pos_x.data(), pos_y.data(),
+            vel_x.data(), vel_y.data(), radius.data(), blocked.data()
+        );
+    }
+    double move_time = seconds_since(start);
+
+    // Flow field costs around a target in the middle of the same map
+    const int stride = 512 + 2;
+    std::vector<uint32_t> cost(stride * stride, 0);
+    std::vector<uint8_t> steps(stride * stride);
+    for (int y = 0; y < 512; y++) {
+        for (int x = 0; x < 512; x++) {
+            cost[(x + 1) + (y + 1) * stride] = world.get(x, y) ? 0 : 1 + abs(x - 256) + abs(y - 256);
+        }
+    }
+    start = SDL_GetPerformanceCounter();
+    for (int f = 0; f < frames; f++) {
+        for (int y = 1; y <= 512; y++) {
+            kernels.flowSteps(cost.data() + 1 + y * stride, stride, 512, steps.data() + 1 + y * stride);
+        }
+    }
+    double flow_time = seconds_since(start);
+
+    printf(
+        "  %-6s fill %.3f ms, span %.3f ms, column %.3f ms, rays %.3f ms (per %dx%d frame), move %.3f ms (per %d), flow %.3f ms (per 512x512)\n",
+        tier_names[tier],
+        fill_time * 1e3 / frames, span_time * 1e3 / frames,
+        column_time * 1e3 / frames, ray_time * 1e3 / frames,
+        size, size, move_time * 1e3 / frames, movers, flow_time * 1e3 / frames
+    );
+}
+
+static void benchLines() {
+    const int size = 600;
+    const int count = 10000;
+    const int frames = 20;
+    SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormat(
+        0, size, size, sizeof(uint32_t) * 8, SDL_PIXELFORMAT_ARGB8888
+    );
+    const Raster* raster = Raster::forFormat(SDL_PIXELFORMAT_ARGB8888);
+
+    // Mostly off-screen, like rays running past the edge of the minimap
+    std::vector<Line> lines(count);
+    srand(1);
+    for (Line& line : lines) {
+        line.x1 = rand() % (size * 5) - size * 2;
+        line.y1 = rand() % (size * 5) - size * 2;
+        line.x2 = rand() % (size * 5) - size * 2;
+        line.y2 = rand() % (size * 5) - size * 2;
+        line.color = rand();
+    }
+    uint64_t start = SDL_GetPerformanceCounter();
+    for (int f = 0; f < frames; f++) {
+        raster->lines(surface, lines.data(), count);
+    }
+    printf("lines: %.3f ms per %d lines\n", seconds_since(start) * 1e3 / frames, count);
+    SDL_FreeSurface(surface);
+}
+
+// A big map that's mostly open, with a few dense districts
+static void benchOccupancy() {
+    const int size = 2048;
+    const int count = 600;
+    const int frames = 50;
+    World world(size, size);
+    srand(1);
+    for (int district = 0; district < 12; district++) {
+        int cx = rand() % size, cy = rand() % size;
+        for (int i = 0; i < 20000; i++) {
+            world.set(cx + rand() % 200, cy + rand() % 200, INNER_WALL);
+        }
+    }
+    for (int i = 0; i < size; i++) {
+        world.set(i, 0, OUTER_WALL);
+        world.set(i, size - 1, OUTER_WALL);
+        world.set(0, i, OUTER_WALL);
+        world.set(size - 1, i, OUTER_WALL);
+    }
+    std::vector<Block> walls(size * size);
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            walls[x + y * size] = world.get(x, y);
+        }
+    }
+
+    RayBatch rays;
+    rays.resize(count);
+    auto cast = [&] (const OccupancyPyramid* occupancy) {
+        uint64_t start = SDL_GetPerformanceCounter();
+        for (int f = 0; f < frames; f++) {
+            v2 origin(size / 2 + f * 7.31f, size / 2 - f * 5.17f);
+            for (int n = 0; n < count; n++) {
+                float angle = f * 0.1 + n * (M_PI * 2 / count);
+                rays.dir_x[n] = cos(angle);
+                rays.dir_y[n] = sin(angle);
+            }
+            cast_rays_scalar(walls.data(), size, size, occupancy, origin, &rays);
+        }
+        return seconds_since(start);
+    };
+    double flat_time = cast(nullptr);
+    double pyramid_time = cast(&world.pyramid());
+
+    const int queries = 100000;
+    int hits = 0;
+    uint64_t start = SDL_GetPerformanceCounter();
+    for (int i = 0; i < queries; i++) {
+        int x = rand() % size, y = rand() % size;
+        hits += world.anySolid(x, y, x + 31, y + 31);
+    }
+    double query_time = seconds_since(start);
+
+    printf("occupancy pyramid (%dx%d, mostly open):\n", size, size);
+    printf("  rays, flat DDA: %.3f ms per %d rays\n", flat_time * 1e3 / frames, count);
+    printf("  rays, pyramid:  %.3f ms per %d rays\n", pyramid_time * 1e3 / frames, count);
+    printf("  anySolid 32x32: %.1f ns per query (%d of %d hit)\n", query_time * 1e9 / queries, hits, queries);
+}
+
+static void benchCollision() {
+    const int size = 64;
+    const int moves = 200000;
+    World world(size, size);
+    srand(1);
+    for (int i = 0; i < size * size / 5; i++) {
+        world.set(rand() % size, rand() % size, INNER_WALL);
+    }
+
+    for (float length : {0.1f, 10.0f}) {
+        v2 pos(size / 2 + 0.5f, size / 2 + 0.5f);
+        world.set(pos.x, pos.y, NO_WALL);
+        uint64_t start = SDL_GetPerformanceCounter();
+        for (int i = 0; i < moves; i++) {
+            float angle = i * 2.39996f;
+            pos = world.sweepCircle(pos, 0.25, v2(cos(angle), sin(angle)) * length);
+        }
+        printf(
+            "collision: %.1f ns per %.1f cell move\n",
+            seconds_since(start) * 1e9 / moves, length
+        );
+    }
+}
+
+// Perception-style checks: random pairs within 24 cells of each other
+static void benchLineOfSight(int size) {
+    const int count = 1000000;
+    World world(size, size);
+    srand(1);
+    for (int i = 0; i < size * size / 10; i++) {
+        world.set(rand() % size, rand() % size, INNER_WALL);
+    }
+    std::vector<v2> from, to;
+    for (int i = 0; i < count; i++) {
+        v2 a(rand() % (size * 16) / 16.0f, rand() % (size * 16) / 16.0f);
+        from.push_back(a);
+        to.push_back(a + v2(rand() % 48 - 24, rand() % 48 - 24));
+    }
+
+    uint64_t start = SDL_GetPerformanceCounter();
+    int naive_visible = 0;
+    for (int i = 0; i < count; i++) {
+        v2 dir = to[i] - from[i];
+        float length = dir.size();
+        naive_visible += length == 0 || (world.wallBoundary(from[i], dir / length) - from[i]).size() >= length;
+    }
+    double naive_time = seconds_since(start);
+
+    LineOfSight los;
+    start = SDL_GetPerformanceCounter();
+    for (int i = 0; i < count; i++) {
+        los.ask(from[i], to[i]);
+    }
+    los.resolve(world);
+    double batch_time = seconds_since(start);
+    int visible = 0;
+    for (int i = 0; i < count; i++) {
+        visible += los.result(i);
+    }
+
+    printf("line of sight (%dx%d, %d checks):\n", size, size, count);
+    printf("  wallBoundary each: %.2f M/s (%d visible)\n", count / naive_time / 1e6, naive_visible);
+    printf("  batched:           %.2f M/s (%d visible)\n", count / batch_time / 1e6, visible);
+}
+
+// Shotgun volleys into a crowd: 10k enemies, 1250 volleys of 8 pellets
+static void benchHitscan() {
+    const int size = 512;
+    const int enemies = 10000;
+    const int volleys = 1250;
+    const int pellets = 8;
+    World world(size, size);
+    srand(1);
+    for (int i = 0; i < size * size / 20; i++) {
+        world.set(rand() % size, rand() % size, INNER_WALL);
+    }
+    Entities entities;
+    for (int i = 0; i < enemies; i++) {
+        entities.spawn(ENTITY_ENEMY, v2(rand() % (size * 16) / 16.0f, rand() % (size * 16) / 16.0f), v2(0, 0), 0.3, 0);
+    }
+
+    Hitscan hitscan;
+    uint64_t start = SDL_GetPerformanceCounter();
+    for (int v = 0; v < volleys; v++) {
+        v2 origin(rand() % (size * 16) / 16.0f, rand() % (size * 16) / 16.0f);
+        float angle = rand() / (float) RAND_MAX * 2 * M_PI;
+        for (int p = 0; p < pellets; p++) {
+            float theta = angle + 0.14f * ((p + 0.5f) / pellets - 0.5f);
+            hitscan.fire(origin, v2(cos(theta), sin(theta)), 64, EntityHandle());
+        }
+    }
+    hitscan.resolve(world, entities);
+    double time = seconds_since(start);
+
+    int entity_hits = 0, wall_hits = 0;
+    for (const Hit& hit : hitscan.hits) {
+        entity_hits += hit.kind == HIT_ENTITY;
+        wall_hits += hit.kind == HIT_WALL;
+    }
+    printf(
+        "hitscan: %.1f ns per shot, %d shots at %d enemies (%d hit enemies, %d hit walls)\n",
+        time * 1e9 / (volleys * pellets), volleys * pellets, enemies, entity_hits, wall_hits
+    );
+}
+
+// A 1024x1024 map a fifth walls: the target walking across it, and
+// single walls toggled near it, then a crowd reading the field
+static void benchFlowField() {
+    const int size = 1024;
+    const int moves = 20;
+    const int edits = 200;
+    const int agents = 100000;
+    World world(size, size);
+    srand(1);
+    for (int i = 0; i < size * size / 5; i++) {
+        world.set(rand() % size, rand() % size, INNER_WALL);
+    }
+    FlowField field;
+    v2 target(size / 2 + 0.5f, size / 2 + 0.5f);
+
+    uint64_t start = SDL_GetPerformanceCounter();
+    for (int i = 0; i < moves; i++) {
+        target.x += 1;
+        world.set(target.x, target.y, NO_WALL);
+        field.update(world, target);
+    }
+    double rebuild_time = seconds_since(start) / moves;
+
+    start = SDL_GetPerformanceCounter();
+    for (int i = 0; i < edits; i++) {
+        int x = target.x + rand() % 33 - 16, y = target.y + rand() % 33 - 16;
+        if (x != (int) target.x || y != (int) target.y) {
+            world.set(x, y, world.get(x, y) ? NO_WALL : INNER_WALL);
+        }
+        field.update(world, target);
+    }
+    double repair_time = seconds_since(start) / edits;
+
+    float sum = 0;
+    start = SDL_GetPerformanceCounter();
+    for (int i = 0; i < agents; i++) {
+        sum += field.direction(v2(rand() % (size * 16) / 16.0f, rand() % (size * 16) / 16.0f)).x;
+    }
+    double read_time = seconds_since(start);
 
-                SDL_BlitScaled(
-                    sky, &src,
-                    surface, &dest
-                );
-            }
+    printf(
+        "  %.2f ms per rebuild, %.1f us per wall edit, %.1f ns per agent read (%.0f)\n",
+        rebuild_time * 1e3, repair_time * 1e6, read_time * 1e9 / agents, sum
+    );
+}
 
+// A 4096x4096 map of open ground, cluttered districts and long walls:
+// building the graph, patrol-length and map-crossing routes, and
+// toggling single tiles
+static void benchPathfinder() {
+    const int size = 4096;
+    const int patrols = 2000;
+    const int crossings = 50;
+    const int edits = 1000;
+    World world(size, size);
+    srand(1);
+    for (int district = 0; district < 40; district++) {
+        int cx = rand() % size, cy = rand() % size;
+        for (int i = 0; i < 8000; i++) {
+            world.set(cx + rand() % 200, cy + rand() % 200, INNER_WALL);
+        }
+    }
+    for (int i = 0; i < 20000; i++) {
+        int x = rand() % size, y = rand() % size, length = 8 + rand() % 56;
+        bool across = rand() % 2;
+        for (int j = 0; j < length; j++) {
+            world.set(x + across * j, y + !across * j, INNER_WALL);
         }
     }
-    
-    float left_view = view_angle - half_fov;
-    float rads_per_pixel = fov / width;
-    
-    for (int x = 0; x < width; x++) {
-        float angle = left_view + x * rads_per_pixel;
-        v2 dir(cos(angle), sin(angle));
-        WallInfo wall_info(HORIZONTAL, OUTER_WALL);
-        v2 boundary = world.wallBoundary(player, dir, &wall_info);
-        float dist = (boundary - player).size() * cos(abs(view_angle - angle));
-        float r = (height / (dist * 2)) * plane_distance;
 
-        SDL_Rect dest;
-        dest.x = x;
-        dest.y = (height / 2) - r;
-        dest.w = 1;
-        dest.h = r * 2;
-
-        // Texture mapping
-        float texture_x =
-            wall_info.dir == HORIZONTAL
-            ? boundary.x - floor(boundary.x)
-            : boundary.y - floor(boundary.y);
-        SDL_Surface* texture;
-        switch (wall_info.type) {
-        case NO_WALL:
-            fatal("Unreachable");
-        case OUTER_WALL:
-            texture = light_wall;
-            break;
-        case INNER_WALL:
-            texture = dark_wall;
-            break;
+    Pathfinder paths;
+    uint64_t start = SDL_GetPerformanceCounter();
+    paths.update(world);
+    double build_time = seconds_since(start);
+
+    std::vector<v2> path;
+    auto route = [&] (int count, int reach, double* time, double* points) {
+        int found = 0;
+        *time = 0;
+        *points = 0;
+        while (found < count) {
+            v2 from(rand() % size + 0.5f, rand() % size + 0.5f);
+            v2 to = from + v2(rand() % (2 * reach + 1) - reach, rand() % (2 * reach + 1) - reach);
+            if (world.get(from.x, from.y) || world.get(to.x, to.y)) {
+                continue;
+            }
+            uint64_t query = SDL_GetPerformanceCounter();
+            bool ok = paths.find(world, from, to, &path);
+            *time += seconds_since(query);
+            found += ok;
+            *points += path.size();
         }
+        *time /= count;
+        *points /= count;
+    };
+    double patrol_time, patrol_points, crossing_time, crossing_points;
+    route(patrols, 64, &patrol_time, &patrol_points);
+    route(crossings, size, &crossing_time, &crossing_points);
 
-        SDL_Rect src;
-        src.x = (int) (texture_x * (float) texture->w);
-        src.y = 0;
-        src.w = 1;
-        src.h = texture->h;
-        
-        SDL_BlitScaled(
-            texture, &src, surface, &dest
-        );
+    start = SDL_GetPerformanceCounter();
+    for (int i = 0; i < edits; i++) {
+        int x = rand() % size, y = rand() % size;
+        world.set(x, y, world.get(x, y) ? NO_WALL : INNER_WALL);
+        paths.update(world);
     }
+    double edit_time = seconds_since(start) / edits;
+
+    printf("pathfinder: %.0f ms to build %dx%d clusters, %.1f us per wall edit\n",
+        build_time * 1e3, paths.clusters_x, paths.clusters_y, edit_time * 1e6);
+    printf("  %.1f us per route within 64 cells (%.1f turns), %.1f us across the map (%.1f turns)\n",
+        patrol_time * 1e6, patrol_points, crossing_time * 1e6, crossing_points);
 }
 
-void Game::renderTopDown(SDL_Surface* surface, int size) {
-    int box_size = size / world.height;
-    
-    // Boxes
-    for (int y = 0; y < world.height; y++) {
-        for (int x = 0; x < world.width; x++) {
-            SDL_Rect rect;
-            rect.x = x * box_size;
-            rect.y = y * box_size;
-            rect.w = box_size;
-            rect.h = box_size;
-            
-            if (!world.get(x, y)) {
-                SDL_FillRect(
-                    surface, &rect,
-                    SDL_MapRGB(surface->format, 0, 0, 0)
-                );
-            } else {
-                SDL_Surface* wall;
-                switch (world.get(x, y)) {
-                case NO_WALL:
-                    fatal("Unreachable");
-                case OUTER_WALL:
-                    wall = light_wall;
-                    break;
-                case INNER_WALL:
-                    wall = dark_wall;
-                    break;
+// Each style of level at a size where the map alone is 256 MB. The
+// storage is already there, as it would be between levels.
+static void benchLevels() {
+    const int size = 8192;
+    const char* names[] = { "rooms", "caves", "maze" };
+    World world(size, size);
+    WorkerPool pool;
+    printf("levels (%u threads), %dx%d:", std::max(std::thread::hardware_concurrency(), 1u), size, size);
+    for (int style = LEVEL_ROOMS; style <= LEVEL_MAZE; style++) {
+        uint64_t start = SDL_GetPerformanceCounter();
+        world.generate(pool, size, size, (LevelStyle) style, 1);
+        printf(" %s %.0f ms%s", names[style], seconds_since(start) * 1e3, style < LEVEL_MAZE ? "," : "\n");
+    }
+}
+
+// Radius-64 views along a random walk, a cell a step, through each
+// style of level and through open ground with a wall in every tenth cell
+static void benchFieldOfView() {
+    const int size = 1024;
+    const int views = 2000;
+    const char* names[] = { "rooms", "caves", "maze", "scattered" };
+    World world(size, size);
+    WorkerPool pool;
+    printf("field of view, radius %d:", FieldOfView::radius);
+    for (int style = LEVEL_ROOMS; style <= LEVEL_MAZE + 1; style++) {
+        if (style <= LEVEL_MAZE) {
+            world.generate(pool, size, size, (LevelStyle) style, 1);
+        } else {
+            world.generate(pool, size, size, LEVEL_ROOMS, 1);
+            srand(1);
+            for (int y = 0; y < size; y++) {
+                for (int x = 0; x < size; x++) {
+                    world.set(x, y, rand() % 10 ? NO_WALL : INNER_WALL);
                 }
-                SDL_BlitScaled(
-                    wall, nullptr,
-                    surface, &rect
-                );
             }
         }
-    }
-    
-    // Grid
-    auto line_color = SDL_MapRGB(surface->format, 0x90, 0x90, 0x90);
-    for (int i = 0; i < world.height; i++) {
-        { // Horizontal
-            SDL_Rect rect;
-            rect.x = 0;
-            rect.y = i * box_size;
-            rect.w = size;
-            rect.h = 1;
-            SDL_FillRect(
-                surface, &rect, line_color
-            );
+        FieldOfView sight;
+        std::vector<v2> eyes;
+        int x = size / 2, y = size / 2;
+        while (world.get(x, y)) {
+            x++;
         }
-        {
-            // Vertical
-            SDL_Rect rect;
-            rect.x = i * box_size;
-            rect.y = 0;
-            rect.w = 1;
-            rect.h = size;
-            SDL_FillRect(
-                surface, &rect, line_color
-            );
+        srand(2);
+        while (eyes.size() < views) {
+            int next_x = x + rand() % 3 - 1, next_y = y + rand() % 3 - 1;
+            if ((next_x != x || next_y != y) && !world.get(next_x, next_y)) {
+                x = next_x;
+                y = next_y;
+                eyes.push_back(v2(x + 0.5f, y + 0.5f));
+            }
+        }
+        sight.update(world, eyes.back());
+        uint64_t start = SDL_GetPerformanceCounter();
+        for (v2 eye : eyes) {
+            sight.update(world, eye);
         }
+        printf(" %s %.1f us%s", names[style], seconds_since(start) * 1e6 / views, style <= LEVEL_MAZE ? "," : "\n");
     }
+}
 
-    // Sight
-    auto line_at_angle =
-        [&] (uint32_t color, float theta) {
-            auto dir = v2(cos(theta), sin(theta));
-            v2 start = player;
-            v2 end = world.wallBoundary(start, dir);
-            
-            int x1 = (start.x / world.width)  * size,
-                y1 = (start.y / world.height) * size,
-                x2 = (end.x   / world.width)  * size,
-                y2 = (end.y   / world.height) * size;
-            draw_line(
-                surface, color,
-                x1, y1, x2, y2
-            );
-        };
-    line_at_angle(SDL_MapRGB(surface->format, 0, 0xff, 0), view_angle - half_fov);
-    line_at_angle(SDL_MapRGB(surface->format, 0xff, 0xff, 0xff), view_angle);
-    line_at_angle(SDL_MapRGB(surface->format, 0, 0xff, 0), view_angle + half_fov);
+// Baking a 1024x1024 level of rooms, then relighting after single
+// tiles are toggled: how long update() holds up the caller, and how long
+// until the relight is published
+static void benchLightmap() {
+    const int size = 1024;
+    const int edits = 200;
+    World world(size, size);
+    WorkerPool pool;
+    world.generate(pool, size, size, LEVEL_ROOMS, 1);
+    Lightmap lighting;
+    uint64_t start = SDL_GetPerformanceCounter();
+    lighting.update(pool, world);
+    double bake_time = seconds_since(start);
 
-    { // Player
-        const int radius = box_size * 0.25;
-        SDL_Rect rect;
-        rect.x = (player.x / world.width)  * size - radius;
-        rect.y = (player.y / world.height) * size - radius;
-        rect.w = radius * 2 + 1;
-        rect.h = radius * 2 + 1;
-        SDL_FillRect(surface, &rect, SDL_MapRGB(surface->format, 0, 0xc3, 0xff));
+    srand(1);
+    double caller_time = 0, relight_time = 0;
+    for (int i = 0; i < edits; i++) {
+        const Light& light = world.lights[rand() % world.lights.size()];
+        int x = light.pos.x + rand() % 9 - 4, y = light.pos.y + rand() % 9 - 4;
+        world.set(x, y, world.get(x, y) ? NO_WALL : INNER_WALL);
+        start = SDL_GetPerformanceCounter();
+        lighting.update(pool, world);
+        caller_time += seconds_since(start);
+        lighting.finish();
+        relight_time += seconds_since(start);
     }
+    printf("lightmap (%u threads): %.0f ms to bake %dx%d with %zu lights\n",
+        std::max(std::thread::hardware_concurrency(), 1u), bake_time * 1e3, size, size, world.lights.size());
+    printf("  %.1f us on the caller per wall edit, %.2f ms until relit\n",
+        caller_time * 1e6 / edits, relight_time * 1e3 / edits);
 }
 
-void Game::render() {
-    // 3D view
-    {
-        int size = engine->height;
-        SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormat(
-            0, size, size, sizeof(uint32_t) * 8, engine->canvas->format->format
-        );
+// 32 moving lights around the eye, shed on a 1920 column view, with the
+// default budget and with one too tight for them all
+static void benchDynamicLights() {
+    const int size = 1024;
+    const int frames = 100;
+    const int columns = 1920;
+    World world(size, size);
+    WorkerPool pool;
+    world.generate(pool, size, size, LEVEL_ROOMS, 1);
+    v2 eye = world.lights[world.lights.size() / 2].pos;
+    RayBatch rays;
+    rays.resize(columns);
+    for (int x = 0; x < columns; x++) {
+        float angle = (x - columns / 2) * (float) (M_PI / 3) / columns;
+        rays.dir_x[x] = cos(angle);
+        rays.dir_y[x] = sin(angle);
+    }
+    world.castRays(eye, &rays);
+    ViewFrame view;
+    view.capture(world, eye, 0, M_PI / 3, rays);
+
+    DynamicLights moving;
+    srand(1);
+    while (moving.lights.size() < 32) {
+        v2 pos = eye + v2(rand() % 33 - 16, rand() % 33 - 16);
+        if (!world.get(pos.x, pos.y)) {
+            moving.lights.push_back({pos, 8, 0.2f + rand() % 80 / 100.0f});
+        }
+    }
+    std::vector<float> levels(columns);
+    for (float budget : {moving.budget, 0.00002f}) {
+        moving.budget = budget;
+        double cast_time = 0, shade_time = 0;
+        for (int frame = 0; frame < frames; frame++) {
+            uint64_t start = SDL_GetPerformanceCounter();
+            moving.cast(pool, world, eye);
+            cast_time += seconds_since(start);
+            start = SDL_GetPerformanceCounter();
+            moving.shade(pool, view, levels.data());
+            shade_time += seconds_since(start);
+        }
+        printf("  %d of %d lit with a %.2f ms budget: %.3f ms casting, %.3f ms shading %d columns\n",
+            moving.lit, (int) moving.lights.size(), budget * 1e3, cast_time * 1e3 / frames, shade_time * 1e3 / frames, columns);
+    }
+}
 
-        render3D(surface, size, size);
+// 2,000 enemies ahead of the eye on a 1080p view, in an open field and
+// among pillars that hide some of them
+static void benchSprites() {
+    const int size = 64;
+    const int frames = 30;
+    const int width = 1920, height = 1080;
+    const int count = 2000;
+    const Raster* raster = Raster::forFormat(SDL_PIXELFORMAT_ARGB8888);
+    SpriteImage image = SpriteImage::ball(raster, 64, 0xc0, 0x30, 0x30);
+    std::vector<uint32_t> pixels(width * height);
+    v2 eye(2.5, size / 2.0f);
+    float fov = M_PI / 3;
+    WorkerPool pool;
 
-        SDL_Rect dest;
-        dest.x = 0;
-        dest.y = 0;
-        dest.w = size;
-        dest.h = size;
-        SDL_BlitSurface(surface, nullptr, engine->canvas, &dest);
-        SDL_FreeSurface(surface);
+    for (int pillars : {0, size * size / 20}) {
+        World world(size, size);
+        srand(1);
+        for (int i = 0; i < pillars; i++) {
+            world.set(rand() % (size - 8) + 8, rand() % size, INNER_WALL);
+        }
+        RayBatch rays;
+        rays.resize(width);
+        for (int x = 0; x < width; x++) {
+            float angle = -fov / 2 + x * fov / width;
+            rays.dir_x[x] = cos(angle);
+            rays.dir_y[x] = sin(angle);
+        }
+        world.castRays(eye, &rays);
+        ViewFrame view;
+        view.capture(world, eye, 0, fov, rays);
+
+        std::vector<v2> spots;
+        while ((int) spots.size() < count) {
+            float angle = (rand() / (float) RAND_MAX - 0.5f) * fov * 0.9f;
+            float dist = 2 + rand() / (float) RAND_MAX * 40;
+            v2 pos = eye + v2(cos(angle), sin(angle)) * dist;
+            if (!world.get(pos.x, pos.y)) {
+                spots.push_back(pos);
+            }
+        }
+
+        Billboards billboards;
+        double time = 0;
+        for (int frame = 0; frame < frames; frame++) {
+            uint64_t start = SDL_GetPerformanceCounter();
+            billboards.begin(eye, 0, fov, width, height);
+            for (v2 pos : spots) {
+                billboards.add(&image, pos, 0.6, 0);
+            }
+            billboards.draw(pool, pixels.data(), width, view.depth.data());
+            time += seconds_since(start);
+        }
+        printf("  %s: %d drawn, %d hidden, %.3f ms a frame\n",
+            pillars ? "pillars" : "open", billboards.drawn, billboards.hidden, time * 1e3 / frames);
     }
-    // Top-down view
-    {
-        int size = engine->height;
-        SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormat(
-            0, size, size, sizeof(uint32_t) * 8, engine->canvas->format->format
-        );
-        
-        renderTopDown(surface, size);
-        
-        SDL_Rect dest;
-        dest.x = engine->width - size;
-        dest.y = 0;
-        dest.w = size;
-        dest.h = size;
-        SDL_BlitSurface(surface, nullptr, engine->canvas, &dest);
-        SDL_FreeSurface(surface);
+}
+
+// A full entity tick: half wandering enemies, half projectiles, topped
+// back up as projectiles are spent on walls and enemies
+static void benchEntities(int actors) {
+    const int size = 1024;
+    const int ticks = 60;
+    World world(size, size);
+    srand(1);
+    for (int i = 0; i < size * size / 10; i++) {
+        world.set(rand() % size, rand() % size, INNER_WALL);
     }
-    // Info text
-    {
-        char buf[512];
-        sprintf(buf, "FOV: %.2f", fov_degrees);
-        engine->renderText(buf, 0, 0);
 
-        sprintf(buf, "ANGLE: %.2f", view_angle * (180.0 / M_PI));
-        engine->renderText(buf, 0, 30);
+    Entities entities;
+    SpatialHash hash;
+    auto spawn = [&] (EntityType type) {
+        v2 pos(0, 0);
+        do {
+            pos = v2(rand() % size + 0.5f, rand() % size + 0.5f);
+        } while (world.get(pos.x, pos.y));
+        float angle = rand() / (float) RAND_MAX * 2 * M_PI;
+        float speed = type == ENTITY_PROJECTILE ? 20 : 2;
+        float radius = type == ENTITY_PROJECTILE ? 0.05 : 0.3;
+        entities.spawn(type, pos, v2(cos(angle), sin(angle)) * speed, radius, angle);
+    };
+    for (int i = 0; i < actors; i++) {
+        spawn(i % 2 ? ENTITY_PROJECTILE : ENTITY_ENEMY);
+    }
+
+    double move_time = 0, collide_time = 0;
+    for (int tick = 0; tick < ticks; tick++) {
+        uint64_t start = SDL_GetPerformanceCounter();
+        entities.move(world, 1.0 / 60.0);
+        move_time += seconds_since(start);
+
+        start = SDL_GetPerformanceCounter();
+        entities.collide(world, &hash);
+        collide_time += seconds_since(start);
+
+        while (entities.count < actors) {
+            spawn(entities.count % 2 ? ENTITY_PROJECTILE : ENTITY_ENEMY);
+        }
+    }
+    printf(
+        "  %6d actors: move %.3f ms, hash and collide %.3f ms per tick\n",
+        actors, move_time * 1e3 / ticks, collide_time * 1e3 / ticks
+    );
+}
 
-        sprintf(buf, "MOUSE CONTROL: %s", mouse_control ? "ON" : "OFF");
-        engine->renderText(buf, 0, 60);
+static int runBenchmarks() {
+    benchColumnScalers();
+    benchGrates();
+    benchDoors();
+    benchLines();
+    benchOccupancy();
+    benchCollision();
+    for (int size : {512, 4096}) {
+        benchLineOfSight(size);
+    }
+    benchHitscan();
+    printf("flow field (%s flow kernel):\n", tier_names[kernels.flow_tier]);
+    benchFlowField();
+    benchPathfinder();
+    benchLevels();
+    benchFieldOfView();
+    benchLightmap();
+    printf("dynamic lights (%u threads):\n", std::max(std::thread::hardware_concurrency(), 1u));
+    benchDynamicLights();
+    printf("sprites (%dx%d):\n", 1920, 1080);
+    benchSprites();
+    printf("entities (%s move kernel):\n", tier_names[kernels.move_tier]);
+    for (int actors : {1000, 10000, 100000}) {
+        benchEntities(actors);
+    }
 
-        sprintf(buf, "MOTION: %3.0f", engine->input->motion.x);
-        engine->renderText(buf, 0, 90);
+    CpuTier best = Kernels::detect();
+    printf("kernels:\n");
+    for (int tier = TIER_SCALAR; tier <= best; tier++) {
+        benchKernels((CpuTier) tier);
     }
+    return 0;
 }
 
 //
-// Engine
+// Checks
 //
 
-Engine::Engine(const char* title, int width, int height) {
-    this->width = width;
-    this->height = height;
+// Each check pits a fast or incremental path against the plain way of
+// getting the same answer, prints how often they disagreed, and returns
+// that count
 
-    int err = 0;
-    err = SDL_Init(SDL_INIT_EVERYTHING);
-    if (err != 0) {
-        fatal(SDL_GetError());
+// A field repaired after each small batch of wall edits around the
+// target, with the target moved now and then, against one built afresh
+static int checkFlowField() {
+    const int size = 96;
+    const int batches = 1000;
+    World world(size, size);
+    srand(1);
+    for (int i = 0; i < size * size / 5; i++) {
+        world.set(rand() % size, rand() % size, INNER_WALL);
     }
+    v2 target(size / 2 + 0.5f, size / 2 + 0.5f);
+    world.set(target.x, target.y, NO_WALL);
+    FlowField repaired;
+    repaired.update(world, target);
 
-    err = TTF_Init();
-    if (err != 0) {
-        fatal(TTF_GetError());
+    int mismatches = 0;
+    for (int batch = 0; batch < batches; batch++) {
+        if (batch % 100 == 99) {
+            target = v2(rand() % size + 0.5f, rand() % size + 0.5f);
+            world.set(target.x, target.y, NO_WALL);
+        }
+        for (int edits = 1 + rand() % 4; edits > 0; edits--) {
+            int x = target.x + rand() % 17 - 8, y = target.y + rand() % 17 - 8;
+            if (x != (int) target.x || y != (int) target.y) {
+                world.set(x, y, world.get(x, y) ? NO_WALL : INNER_WALL);
+            }
+        }
+        repaired.update(world, target);
+        FlowField rebuilt;
+        rebuilt.update(world, target);
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                if (repaired.step(x, y) != rebuilt.step(x, y)) {
+                    mismatches++;
+                }
+            }
+        }
     }
+    printf("  flow field: %d of %d cells differ from a rebuild\n", mismatches, batches * size * size);
+    return mismatches;
+}
 
-    font = TTF_OpenFont("res/VGA8.ttf", 26);
-    if (font == nullptr) {
-        fatal(TTF_GetError());
+// Routes from a pathfinder updated after each batch of wall edits,
+// against one built afresh, and whether either found a route against
+// a flood fill of what's connected. Stepping diagonally never cuts a
+// corner, so that's the same as what's connected across cell sides.
+static int checkPathfinder() {
+    const int size = 128;
+    const int batches = 200;
+    const int queries = 50;
+    World world(size, size);
+    srand(1);
+    for (int i = 0; i < size * size * 2 / 5; i++) {
+        world.set(rand() % size, rand() % size, INNER_WALL);
     }
-    
-    window = SDL_CreateWindow(
-        title, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-        width, height, SDL_WINDOW_SHOWN
-    );
-    if (window == nullptr) {
-        fatal(SDL_GetError());
+    Pathfinder updated;
+    updated.update(world);
+
+    std::vector<int> regions(size * size), stack;
+    std::vector<v2> path, rebuilt_path;
+    int routes = 0, mismatches = 0;
+    for (int batch = 0; batch < batches; batch++) {
+        for (int edits = 1 + rand() % 8; edits > 0; edits--) {
+            int x = rand() % size, y = rand() % size;
+            world.set(x, y, world.get(x, y) ? NO_WALL : INNER_WALL);
+        }
+        Pathfinder rebuilt;
+        rebuilt.update(world);
+
+        std::fill(regions.begin(), regions.end(), -1);
+        for (int cell = 0; cell < size * size; cell++) {
+            if (regions[cell] >= 0 || world.get(cell % size, cell / size)) {
+                continue;
+            }
+            regions[cell] = cell;
+            stack.push_back(cell);
+            while (!stack.empty()) {
+                int at = stack.back();
+                stack.pop_back();
+                int x = at % size, y = at / size;
+                for (int k = 0; k < 4; k++) {
+                    int nx = x + (k == 1) - (k == 3), ny = y + (k == 2) - (k == 0);
+                    int next = nx + ny * size;
+                    if (nx >= 0 && ny >= 0 && nx < size && ny < size && regions[next] < 0 && !world.get(nx, ny)) {
+                        regions[next] = cell;
+                        stack.push_back(next);
+                    }
+                }
+            }
+        }
+
+        for (int i = 0; i < queries; i++) {
+            int fx = rand() % size, fy = rand() % size, tx = rand() % size, ty = rand() % size;
+            if (world.get(fx, fy) || world.get(tx, ty)) {
+                continue;
+            }
+            v2 from(fx + 0.5f, fy + 0.5f), to(tx + 0.5f, ty + 0.5f);
+            routes++;
+            bool found = updated.find(world, from, to, &path);
+            bool rebuilt_found = rebuilt.find(world, from, to, &rebuilt_path);
+            bool connected = regions[fx + fy * size] == regions[tx + ty * size];
+            bool same = path.size() == rebuilt_path.size();
+            for (size_t j = 0; same && j < path.size(); j++) {
+                same = path[j].x == rebuilt_path[j].x && path[j].y == rebuilt_path[j].y;
+            }
+            if (found != connected || rebuilt_found != connected || !same) {
+                mismatches++;
+            }
+        }
     }
-    
-    canvas = SDL_GetWindowSurface(window);
-            
-    last_tick = SDL_GetPerformanceCounter();
-    delta = 1.0 / 60.0;
+    printf("  pathfinder: %d of %d routes differ from a rebuild or a flood fill\n", mismatches, routes);
+    return mismatches;
+}
 
-    // There is ZERO reason these should be heap-allocated, but C++
-    // refuses to let me perform the above initialization BEFORE their
-    // constructors are called, no matter what I do. This has me
-    // royally pissed.
-    game = new Game(this);
-    input = new Input();
+// Random moves of every length and radius through a cluttered map,
+// against the walls themselves: no circle may end up overlapping one,
+// and one that wasn't stopped must have been clear the whole way
+static int checkSweepCircle() {
+    const int size = 64;
+    const int moves = 100000;
+    World world(size, size);
+    srand(1);
+    for (int i = 0; i < size * size / 5; i++) {
+        world.set(rand() % size, rand() % size, INNER_WALL);
+    }
+    auto overlaps = [&] (v2 p, float radius) {
+        // Slack for rounding; the sweep keeps 1e-4 clear of what it hits
+        const float slack = 1e-3;
+        for (int y = floor(p.y - radius); y <= floor(p.y + radius); y++) {
+            for (int x = floor(p.x - radius); x <= floor(p.x + radius); x++) {
+                v2 d = p - v2(std::clamp(p.x, (float) x, x + 1.0f), std::clamp(p.y, (float) y, y + 1.0f));
+                if (world.get(x, y) && d.dot(d) < (radius - slack) * (radius - slack)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    };
+
+    v2 pos(size / 2 + 0.5f, size / 2 + 0.5f);
+    world.set(pos.x, pos.y, NO_WALL);
+    int swept = 0, mismatches = 0;
+    for (int i = 0; i < moves; i++) {
+        float radius = 0.05f + rand() % 40 / 100.0f;
+        float angle = rand() % 3600 / 1800.0f * M_PI;
+        float length = i % 10 ? rand() % 100 / 100.0f : rand() % 2000 / 100.0f;
+        v2 move = v2(cos(angle), sin(angle)) * length;
+        if (overlaps(pos, radius)) {
+            // Grown into a wall since the last move; start over clear of
+            // them all
+            pos = v2(rand() % size + 0.5f, rand() % size + 0.5f);
+            world.set(pos.x, pos.y, NO_WALL);
+            continue;
+        }
+        v2 got = world.sweepCircle(pos, radius, move);
+        swept++;
+        bool bad = overlaps(got, radius);
+        if (got.x == pos.x + move.x && got.y == pos.y + move.y) {
+            int samples = ceil(length * 64);
+            for (int j = 1; j < samples && !bad; j++) {
+                bad = overlaps(pos + move * (j / (float) samples), radius);
+            }
+        }
+        mismatches += bad;
+        pos = got;
+    }
+    printf("  collision: %d of %d moves overlap a wall\n", mismatches, swept);
+    return mismatches;
 }
 
-Engine::~Engine() {
-    delete game;
-    delete input;
-    SDL_DestroyWindow(window);
-    SDL_Quit();
+// Random spawns and removals, by handle, by index and with handles
+// already gone, against a plain list of what should be alive. Every
+// live handle must lead to its own entity, and every stale one nowhere.
+static int checkEntities() {
+    const int operations = 100000;
+    Entities entities;
+    std::vector<std::pair<EntityHandle, int>> live; // Handle, id
+    std::vector<EntityHandle> gone;
+    srand(1);
+    int next_id = 0, checks = 0, mismatches = 0;
+    for (int i = 0; i < operations; i++) {
+        int choice = rand() % 8;
+        if (live.empty() || choice < 4) {
+            float id = next_id++;
+            EntityHandle handle = entities.spawn(ENTITY_ENEMY, v2(id, 0), v2(0, id), 0.25, id);
+            live.push_back({handle, id});
+        } else if (choice < 6) {
+            int j = rand() % live.size();
+            entities.remove(live[j].first);
+            gone.push_back(live[j].first);
+            live[j] = live.back();
+            live.pop_back();
+        } else if (choice < 7) {
+            int index = rand() % entities.count;
+            auto it = std::find_if(live.begin(), live.end(), [&] (const std::pair<EntityHandle, int>& entity) {
+                return entity.second == entities.angle[index];
+            });
+            if (it == live.end()) {
+                mismatches++;
+                continue;
+            }
+            entities.removeAt(index);
+            gone.push_back(it->first);
+            *it = live.back();
+            live.pop_back();
+        } else if (!gone.empty()) {
+            entities.remove(gone[rand() % gone.size()]);
+        }
+
+        if (i % 100 != 0) {
+            continue;
+        }
+        checks++;
+        bool bad = entities.count != (int) live.size();
+        for (auto& [handle, id] : live) {
+            int index = entities.index(handle);
+            EntityHandle back = index >= 0 ? entities.handle(index) : EntityHandle();
+            bad |= index < 0 || index >= entities.count ||
+                entities.angle[index] != id || entities.pos_x[index] != id || entities.vel_y[index] != id ||
+                back.slot != handle.slot || back.generation != handle.generation;
+        }
+        for (EntityHandle handle : gone) {
+            bad |= entities.index(handle) != -1;
+        }
+        mismatches += bad;
+    }
+    printf("  entities: %d of %d checks after %d changes differ from a list\n", mismatches, checks, operations);
+    return mismatches;
 }
 
-void Engine::renderText(const char* msg, int x, int y) {
-    auto blit_text =
-        [&](SDL_Surface* surf, int x_offset, int y_offset) {
-            SDL_Rect rect;
-            rect.x = x + x_offset;
-            rect.y = y + y_offset;
-            rect.w = surf->w;
-            rect.h = surf->h;
-            SDL_BlitSurface(surf, nullptr, canvas, &rect);
-        };
-    
-    SDL_Surface* shadow = TTF_RenderText_Solid(font, msg, {0, 0, 0});
-    SDL_Surface* text   = TTF_RenderText_Solid(font, msg, {0xff, 0xff, 0xff});
+// Overlapping pairs from the hash, against testing every pair, for
+// crowds of all densities with the odd entity much bigger than the rest
+static int checkSpatialHash() {
+    const int size = 64;
+    const int rounds = 50;
+    std::vector<std::pair<int, int>> pairs, expected;
+    SpatialHash hash;
+    srand(1);
+    int total = 0, mismatches = 0;
+    for (int round = 0; round < rounds; round++) {
+        Entities entities;
+        int count = 10 + rand() % 4000;
+        for (int i = 0; i < count; i++) {
+            v2 pos(rand() % (size * 100) / 100.0f, rand() % (size * 100) / 100.0f);
+            float radius = rand() % 50 ? 0.1f + rand() % 50 / 100.0f : 1 + rand() % 300 / 100.0f;
+            entities.spawn(ENTITY_ENEMY, pos, v2(0, 0), radius, 0);
+        }
+        hash.build(entities);
+        hash.overlaps(entities, &pairs);
 
-    blit_text(shadow, -2, 2);
-    blit_text(text, 0, 0);
-    
-    SDL_FreeSurface(shadow);
-    SDL_FreeSurface(text);
+        expected.clear();
+        for (int i = 0; i < count; i++) {
+            for (int j = i + 1; j < count; j++) {
+                float dx = entities.pos_x[j] - entities.pos_x[i], dy = entities.pos_y[j] - entities.pos_y[i];
+                float touching = entities.radius[i] + entities.radius[j];
+                if (dx * dx + dy * dy < touching * touching) {
+                    expected.emplace_back(i, j);
+                }
+            }
+        }
+        // Sorting leaves any pair found twice next to itself, where it
+        // won't match the brute force list
+        std::sort(pairs.begin(), pairs.end());
+        total += expected.size();
+        if (pairs != expected) {
+            mismatches++;
+        }
+    }
+    printf("  spatial hash: %d of %d crowds differ from testing every pair (%d pairs)\n", mismatches, rounds, total);
+    return mismatches;
 }
 
-bool Engine::frame() {
-    input->resetCache();
-    
-    // Consume events
-    SDL_Event event;
-    while (SDL_PollEvent(&event) != 0) {
-        if (event.type == SDL_QUIT) {
-            return false;
-        } else if (event.type == SDL_MOUSEMOTION) {
-            input->motion = v2(event.motion.xrel, event.motion.yrel);
+// Shots from anywhere clear of walls, some fired by an entity, against
+// intersecting the ray with every entity and every wall cell
+static int checkHitscan() {
+    const int size = 64;
+    const int enemies = 2000;
+    const int shots = 20000;
+    // Distances are worked out differently on each side
+    const float slack = 1e-3;
+    World world(size, size);
+    srand(1);
+    for (int i = 0; i < size * size / 10; i++) {
+        world.set(rand() % size, rand() % size, INNER_WALL);
+    }
+    // Doors stopped at every stage of opening, and thin walls
+    for (int i = 0; i < size * size / 40; i++) {
+        int x = rand() % size, y = rand() % size;
+        world.placeDoor(x, y, rand() % 2 ? HORIZONTAL : VERTICAL, rand() % 4 != 0);
+        if (rand() % 2) {
+            world.toggleDoor(x, y);
         }
     }
-    
-    if (input->keyPressed(SDL_SCANCODE_ESCAPE)) {
-        return false;
+    world.moveDoors(Doors::seconds_to_open / 2, Entities());
+    Entities entities;
+    for (int i = 0; i < enemies; i++) {
+        v2 pos(rand() / (float) RAND_MAX * size, rand() / (float) RAND_MAX * size);
+        entities.spawn(ENTITY_ENEMY, pos, v2(0, 0), 0.1f + rand() % 50 / 100.0f, 0);
     }
-    
-    // Update
-    game->update();
 
-    // Render
-    SDL_FillRect(canvas, nullptr, SDL_MapRGB(canvas->format, 0xff, 0xff, 0xff));
-    game->render();
-    SDL_UpdateWindowSurface(window);
-            
-    { // Update delta
-        uint64_t tick = SDL_GetPerformanceCounter();
-        delta = (float) (tick - last_tick) / SDL_GetPerformanceFrequency();
-        last_tick = tick;
+    Hitscan hitscan;
+    for (int i = 0; i < shots; i++) {
+        v2 origin(0, 0);
+        do {
+            origin = v2(rand() / (float) RAND_MAX * size, rand() / (float) RAND_MAX * size);
+        } while (world.get(origin.x, origin.y));
+        float angle = rand() / (float) RAND_MAX * 2 * M_PI;
+        EntityHandle shooter = rand() % 4 ? EntityHandle() : entities.handle(rand() % enemies);
+        hitscan.fire(origin, v2(cos(angle), sin(angle)), 1 + rand() % 64, shooter);
     }
+    std::vector<Hitscan::Shot> fired = hitscan.shots;
+    hitscan.resolve(world, entities);
 
-    // Constrain FPS
-    const float max_fps = 60.0;
-    if (delta < 1.0 / max_fps) {
-        float remaining_time = (1.0 / max_fps) - delta;
+    int mismatches = 0;
+    for (int n = 0; n < shots; n++) {
+        const Hitscan::Shot& shot = fired[n];
+        const Hit& hit = hitscan.hits[n];
+        float entity_t = INFINITY, wall_t = INFINITY;
+        int shooter = entities.index(shot.shooter);
+        for (int i = 0; i < entities.count; i++) {
+            float t;
+            if (i != shooter && ray_circle(shot.origin, shot.dir, entities.position(i), entities.radius[i], &t)) {
+                entity_t = std::min(entity_t, t);
+            }
+        }
+        // Entering a wall cell, the ring outside the map included,
+        // ignoring any the ray only grazes, or crossing the closed part
+        // of a door's plane
+        for (int y = -1; y <= size; y++) {
+            for (int x = -1; x <= size; x++) {
+                Block block = world.get(x, y);
+                if (block == DOOR_WALL || block == THIN_WALL) {
+                    const Doors::Door* door = world.door(x, y);
+                    bool along_x = door->along == HORIZONTAL;
+                    float o = along_x ? shot.origin.y : shot.origin.x, d = along_x ? shot.dir.y : shot.dir.x;
+                    float t = ((along_x ? y : x) + 0.5f - o) / d;
+                    v2 p = shot.origin + shot.dir * t;
+                    float across = along_x ? p.x - x : p.y - y;
+                    if (t >= 0 && across >= door->open && across < 1) {
+                        wall_t = std::min(wall_t, t);
+                    }
+                    continue;
+                }
+                if (!block) {
+                    continue;
+                }
+                float enter = 0, leave = INFINITY;
+                for (int axis = 0; axis < 2; axis++) {
+                    float o = axis ? shot.origin.y : shot.origin.x, d = axis ? shot.dir.y : shot.dir.x;
+                    float lo = axis ? y : x;
+                    if (d == 0) {
+                        if (o <= lo || o >= lo + 1) {
+                            leave = -1;
+                        }
+                        continue;
+                    }
+                    float t1 = (lo - o) / d, t2 = (lo + 1 - o) / d;
+                    enter = std::max(enter, std::min(t1, t2));
+                    leave = std::min(leave, std::max(t1, t2));
+                }
+                if (enter < leave) {
+                    wall_t = std::min(wall_t, enter);
+                }
+            }
+        }
 
-        const uint64_t one_billion = 1000000000;
-        uint64_t nanoseconds = (uint64_t) (delta * ((float) one_billion));
-        struct timespec t;
-        t.tv_sec  = nanoseconds / one_billion;
-        t.tv_nsec = nanoseconds % one_billion;
-        nanosleep(&t, nullptr);
+        // Whichever is nearest, within the slack of a tie
+        float nearest = std::min(entity_t, wall_t);
+        bool bad = hit.dist > shot.range + slack;
+        if (hit.kind == HIT_ENTITY) {
+            int i = entities.index(hit.entity);
+            float t;
+            bad |= i < 0 || i == shooter || fabs(hit.dist - nearest) > slack ||
+                !ray_circle(shot.origin, shot.dir, entities.position(i), entities.radius[i], &t) ||
+                fabs(hit.dist - t) > slack;
+        } else if (hit.kind == HIT_WALL) {
+            bad |= fabs(hit.dist - wall_t) > slack || entity_t < std::min(wall_t, shot.range) - slack;
+        } else {
+            bad |= nearest < shot.range - slack;
+        }
+        mismatches += bad;
     }
+    printf("  hitscan: %d of %d shots differ from testing everything\n", mismatches, shots);
+    return mismatches;
+}
 
-    return true;
+// Doors shut while entities stand in and around their cells: none may
+// be left overlapping a closed cell, and once they're gone every door
+// must close
+static int checkDoors() {
+    const int size = 64;
+    const int count = 200;
+    World world(size, size);
+    srand(1);
+    std::vector<v2> cells;
+    while ((int) cells.size() < count) {
+        v2 cell(rand() % size, rand() % size);
+        if (world.door(cell.x, cell.y)) {
+            continue;
+        }
+        world.placeDoor(cell.x, cell.y, rand() % 2 ? HORIZONTAL : VERTICAL, true);
+        world.toggleDoor(cell.x, cell.y);
+        cells.push_back(cell);
+    }
+    Entities entities;
+    world.moveDoors(Doors::seconds_to_open, entities);
+    for (v2 cell : cells) {
+        v2 pos = cell + v2(rand() % 100 / 50.0f - 0.5f, rand() % 100 / 50.0f - 0.5f);
+        entities.spawn(ENTITY_ENEMY, pos, v2(0, 0), 0.1f + rand() % 30 / 100.0f, 0);
+        world.toggleDoor(cell.x, cell.y);
+    }
+    world.moveDoors(Doors::seconds_to_open, entities);
+
+    int mismatches = 0;
+    for (int i = 0; i < entities.count; i++) {
+        float x = entities.pos_x[i], y = entities.pos_y[i], r = entities.radius[i];
+        for (int cy = floor(y - r); cy <= floor(y + r); cy++) {
+            for (int cx = floor(x - r); cx <= floor(x + r); cx++) {
+                float dx = x - std::clamp(x, (float) cx, cx + 1.0f), dy = y - std::clamp(y, (float) cy, cy + 1.0f);
+                if (world.get(cx, cy) == DOOR_WALL && dx * dx + dy * dy < r * r) {
+                    mismatches++;
+                }
+            }
+        }
+    }
+    world.moveDoors(Doors::seconds_to_open, Entities());
+    for (v2 cell : cells) {
+        mismatches += world.door(cell.x, cell.y)->open != 0;
+    }
+    printf("  doors: %d of %d doors shut on an entity or stayed open\n", mismatches, count);
+    return mismatches;
+}
+
+static int runChecks() {
+    printf("checks:\n");
+    int mismatches = 0;
+    mismatches += checkFlowField();
+    mismatches += checkPathfinder();
+    mismatches += checkSweepCircle();
+    mismatches += checkEntities();
+    mismatches += checkSpatialHash();
+    mismatches += checkHitscan();
+    mismatches += checkDoors();
+    return mismatches ? 1 : 0;
 }
 
-int main() {
-    Engine engine("Raycast", 1200, 600);
+int main(int argc, char** argv) {
+    bool bench = false;
+    bool check = false;
+    CpuTier tier_limit = TIER_AVX512;
+    bool force_tier = false;
+    int pipeline_depth = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bench") == 0) {
+            bench = true;
+        } else if (strcmp(argv[i], "--check") == 0) {
+            check = true;
+        } else if (strncmp(argv[i], "--cpu=", 6) == 0) {
+            tier_limit = parse_tier(argv[i] + 6);
+            force_tier = true;
+        } else if (strncmp(argv[i], "--pipeline=", 11) == 0) {
+            char* end;
+            long depth = strtol(argv[i] + 11, &end, 10);
+            if (end == argv[i] + 11 || *end != '\0' || depth < 0 || depth > 16) {
+                fatal("Pipeline depth should be a number from 0 to 16, not '%s'", argv[i] + 11);
+            }
+            pipeline_depth = depth;
+        } else {
+            fatal("Unknown argument '%s'", argv[i]);
+        }
+    }
+    Kernels::select(tier_limit, force_tier);
+
+    if (bench) {
+        return runBenchmarks();
+    }
+    if (check) {
+        return runChecks();
+    }
+    
+    Engine engine("Raycast", 1200, 600, pipeline_depth);
     while (engine.frame());
     
     return 0;
@@ -1,18 +1,153 @@
 struct v2 {
     float x, y;
-    v2(float x, float y);
-    float size();
+    constexpr v2(float x, float y) : x(x), y(y) {}
+
+    float size() const {
+        return sqrt(x * x + y * y);
+    }
+    constexpr float dot(v2 v) const {
+        return x * v.x + y * v.y;
+    }
+    // Rotate by an angle given as its cosine and sine
+    constexpr v2 rotate(float c, float s) const {
+        return v2(x * c - y * s, x * s + y * c);
+    }
+    v2 rotate(float theta) const {
+        return rotate(cos(theta), sin(theta));
+    }
+    v2 floor() const {
+        return v2(::floor(x), ::floor(y));
+    }
     
-    v2 operator +(v2);
-    void operator +=(v2);
-    v2 operator -(v2);
-    void operator -=(v2);
-    v2 operator *(float);
-    void operator *=(float);
-    v2 operator /(float);
-    void operator /=(float);
+    constexpr v2 operator +(v2 v) const {
+        return v2(x + v.x, y + v.y);
+    }
+    constexpr void operator +=(v2 v) {
+        *this = *this + v;
+    }
+    constexpr v2 operator -(v2 v) const {
+        return v2(x - v.x, y - v.y);
+    }
+    constexpr void operator -=(v2 v) {
+        *this = *this - v;
+    }
+    constexpr v2 operator *(float f) const {
+        return v2(x * f, y * f);
+    }
+    constexpr void operator *=(float f) {
+        *this = *this * f;
+    }
+    constexpr v2 operator /(float f) const {
+        return v2(x / f, y / f);
+    }
+    constexpr void operator /=(float f) {
+        *this = *this / f;
+    }
+};
+
+// N v2s at once, kept as separate x and y lanes so loops over them
+// vectorize. Every operation is the v2 one applied lane by lane, so the
+// two can't drift apart.
+template <int N>
+struct v2xN {
+    float x[N], y[N];
+
+    constexpr v2xN() : x(), y() {}
+    constexpr explicit v2xN(v2 v) : x(), y() {
+        for (int i = 0; i < N; i++) {
+            set(i, v);
+        }
+    }
+
+    constexpr v2 get(int i) const {
+        return v2(x[i], y[i]);
+    }
+    constexpr void set(int i, v2 v) {
+        x[i] = v.x;
+        y[i] = v.y;
+    }
+    static v2xN load(const float* xs, const float* ys) {
+        v2xN v;
+        memcpy(v.x, xs, sizeof(v.x));
+        memcpy(v.y, ys, sizeof(v.y));
+        return v;
+    }
+    void store(float* xs, float* ys) const {
+        memcpy(xs, x, sizeof(x));
+        memcpy(ys, y, sizeof(y));
+    }
+
+    std::array<float, N> size() const {
+        std::array<float, N> sizes {};
+        for (int i = 0; i < N; i++) {
+            sizes[i] = get(i).size();
+        }
+        return sizes;
+    }
+    constexpr std::array<float, N> dot(v2xN v) const {
+        std::array<float, N> dots {};
+        for (int i = 0; i < N; i++) {
+            dots[i] = get(i).dot(v.get(i));
+        }
+        return dots;
+    }
+    constexpr v2xN rotate(float c, float s) const {
+        return map([=](v2 a) { return a.rotate(c, s); });
+    }
+    v2xN rotate(float theta) const {
+        return rotate(cos(theta), sin(theta));
+    }
+    v2xN floor() const {
+        return map([](v2 a) { return a.floor(); });
+    }
+
+    constexpr v2xN operator +(v2xN v) const {
+        return zip(v, [](v2 a, v2 b) { return a + b; });
+    }
+    constexpr void operator +=(v2xN v) {
+        *this = *this + v;
+    }
+    constexpr v2xN operator -(v2xN v) const {
+        return zip(v, [](v2 a, v2 b) { return a - b; });
+    }
+    constexpr void operator -=(v2xN v) {
+        *this = *this - v;
+    }
+    constexpr v2xN operator *(float f) const {
+        return map([=](v2 a) { return a * f; });
+    }
+    constexpr void operator *=(float f) {
+        *this = *this * f;
+    }
+    constexpr v2xN operator /(float f) const {
+        return map([=](v2 a) { return a / f; });
+    }
+    constexpr void operator /=(float f) {
+        *this = *this / f;
+    }
+
+private:
+    template <typename F>
+    constexpr v2xN map(F f) const {
+        v2xN out;
+        for (int i = 0; i < N; i++) {
+            out.set(i, f(get(i)));
+        }
+        return out;
+    }
+    template <typename F>
+    constexpr v2xN zip(v2xN v, F f) const {
+        v2xN out;
+        for (int i = 0; i < N; i++) {
+            out.set(i, f(get(i), v.get(i)));
+        }
+        return out;
+    }
 };
 
+typedef v2xN<4> v2x4;
+typedef v2xN<8> v2x8;
+
 struct Box {
     v2 pos;
     v2 bounds;
@@ -35,6 +170,9 @@ enum Block {
     NO_WALL = 0,
     OUTER_WALL,
     INNER_WALL,
+    GRATE_WALL, // Solid, but rays see through the gaps in its texture
+    DOOR_WALL,  // A door across the middle of the cell, in World's doors
+    THIN_WALL,  // A wall across the middle of the cell, likewise
 };
 
 struct WallInfo {
@@ -43,11 +181,136 @@ struct WallInfo {
     WallInfo(Direction dir, Block type);
 };
 
+// Where a ray entered a wall
+struct WallHit {
+    v2 point = v2(0, 0);
+    float t = 0; // In multiples of the ray's direction
+    Direction dir = HORIZONTAL;
+    Block type = NO_WALL;
+};
+
+// A batch of rays cast from a single origin, stored as parallel
+// arrays. The caller fills in the directions, World::castRays fills in
+// the rest.
+struct RayBatch {
+    int count = 0;
+    std::vector<float> dir_x, dir_y;
+    std::vector<float> hit_x, hit_y;
+    std::vector<float> dist;
+    std::vector<Direction> hit_dir;
+    std::vector<Block> hit_type;
+
+    void resize(int count);
+};
+
+// Number of solid cells in each 2^k x 2^k block of a grid, for
+// k = 1, 2, ... up to a single block covering everything. A block
+// with no solid cells can be skipped over whole.
+struct OccupancyPyramid {
+    struct Level {
+        int width, height;
+        std::vector<uint32_t> counts;
+    };
+    // levels[0] is k = 1
+    std::vector<Level> levels;
+
+    void resize(int width, int height);
+    void add(int x, int y, int delta);
+    void recount();
+    uint32_t count(int level, int x, int y) const;
+};
+
+enum LevelStyle {
+    LEVEL_ROOMS, // Rooms joined by corridors
+    LEVEL_CAVES, // Smoothed noise
+    LEVEL_MAZE,  // Corridors a cell wide, with one way between any two places
+};
+
+// Doors and thin walls, each a plane through the middle of its cell.
+// They live here rather than in the grid, sorted by cell, so sliding
+// them never touches it. The grid holds a door's cell as DOOR_WALL
+// until it's all the way open, and as open floor from then until it
+// starts to close, which waits for nothing to be in the cell.
+struct Doors {
+    static constexpr float seconds_to_open = 0.75;
+
+    struct Door {
+        int cell;         // Grid index
+        Direction along;  // HORIZONTAL spans the cell west to east
+        bool sliding;     // Thin walls don't
+        bool opening = false;
+        float open = 0;   // How far it's slid along its plane, 0 to 1
+    };
+    std::vector<Door> doors;
+
+    Door* find(int cell);
+    const Door* find(int cell) const;
+};
+
+// A point light, fixed in place for as long as the level lasts
+struct Light {
+    v2 pos;
+    float radius;    // In cells. It lights nothing further away.
+    float intensity; // Right next to it, where 1 is full brightness
+};
+
+// What changed in a World since some revision, for a copy of it to
+// catch up with: every cell after a new level, or when the edit log
+// doesn't go back far enough, otherwise just the ones edited. Doors
+// come along every time, since they slide without touching the grid.
+struct WorldChanges {
+    bool whole = false;
+    int width = 0, height = 0;
+    std::vector<int> cells;     // Grid indices, unless whole
+    std::vector<Block> blocks;  // What each of `cells` became, or every cell if whole
+    OccupancyPyramid occupancy; // If whole
+    std::vector<Light> lights;  // If whole
+    float ambient = 1;
+    Doors doors;
+};
+
+// Threads started once, one per core past the first, that sleep until
+// someone forks work out to them. A fork from inside another one only
+// gets the workers that are idle, so however deeply forks nest, no more
+// threads run at once than the pool has plus whoever forked.
+struct WorkerPool {
+private:
+    struct Fork {
+        const std::function<void()>* job;
+        int wanted;  // Helpers still to join in
+        int running; // Helpers in job
+    };
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable wake;     // A fork wants helpers, or the pool is quitting
+    std::condition_variable finished; // A helper is done
+    std::vector<Fork*> forks;         // Wanting helpers, newest last
+    bool quitting = false;
+
+    void work();
+
+public:
+    WorkerPool();
+    ~WorkerPool();
+    int size() const;
+    void fork(int helpers, const std::function<void()>& job);
+};
+
 struct World {
     int width, height;
+    std::vector<Light> lights;
+    float ambient = 1; // How lit a wall face is with no light on it
     
 private:
     Block* walls;
+    OccupancyPyramid occupancy;
+    // Cells changed by set(), as grid indices. edit_log[0] was edit
+    // number `edit_base`.
+    std::vector<int> edit_log;
+    uint64_t edit_base = 0;
+    Doors doors;
+
+    void put(int x, int y, Block type);
     
 public:
     World(int width, int height);
@@ -55,41 +318,668 @@ public:
     ~World();
     void set(int x, int y, Block type);
     Block get(int x, int y);
+    void generate(WorkerPool& pool, int width, int height, LevelStyle style, uint64_t seed);
+    void placeDoor(int x, int y, Direction along, bool sliding);
+    bool toggleDoor(int x, int y);
+    void moveDoors(float delta, const struct Entities& entities);
+    const Doors::Door* door(int x, int y) const;
+    uint64_t revision();
+    bool editsSince(uint64_t revision, std::vector<int>* cells);
+    void changes(uint64_t* revision, WorldChanges* out);
+    void apply(const WorldChanges& changes);
     v2 nextBoundary(v2 pos, v2 dir, Direction* hit_dir = nullptr);
     v2 wallBoundary(v2 pos, v2 dir, WallInfo* wall_info = nullptr);
+    int wallBoundary(v2 pos, v2 dir, WallHit* hits, int max_hits);
+    void castRays(v2 origin, RayBatch* rays);
+    bool anySolid(int x1, int y1, int x2, int y2);
+    bool clearLine(v2 from, v2 to);
+    v2 sweepCircle(v2 pos, float radius, v2 move);
+    void stepCircles(
+        float delta, int count, float* pos_x, float* pos_y,
+        const float* vel_x, const float* vel_y, const float* radius, uint8_t* blocked);
+    const OccupancyPyramid& pyramid();
+};
+
+enum EntityType : uint8_t {
+    ENTITY_PLAYER,
+    ENTITY_ENEMY,
+    ENTITY_PROJECTILE,
+};
+
+// Names an entity for as long as it lives. Once it's removed the
+// handle goes stale, rather than picking up whatever took its place.
+struct EntityHandle {
+    uint32_t slot = 0;
+    uint32_t generation = 0;
+};
+
+// Every actor in a level, one array per field, so systems run down
+// just the fields they need. Entities 0..count-1 are live and packed:
+// removing one moves the last entity into its place.
+struct Entities {
+    int count = 0;
+    std::vector<float> pos_x, pos_y;
+    std::vector<float> vel_x, vel_y;
+    std::vector<float> radius;
+    std::vector<float> angle; // Radians
+    std::vector<EntityType> type;
+
+private:
+    // Where the entity behind each handle slot currently lives
+    struct Slot {
+        int index;
+        uint32_t generation;
+    };
+    std::vector<Slot> slots;
+    std::vector<uint32_t> free_slots;
+    std::vector<uint32_t> slot_of; // Per entity
+    std::vector<uint8_t> blocked;  // Scratch for move()
+    std::vector<std::pair<int, int>> contacts; // Scratch for collide()
+    std::vector<EntityHandle> dead;            // Scratch for collide()
+
+public:
+    EntityHandle spawn(EntityType type, v2 pos, v2 vel, float radius, float angle);
+    void remove(EntityHandle handle);
+    void removeAt(int index);
+    int index(EntityHandle handle);
+    EntityHandle handle(int index);
+    v2 position(int index);
+    v2 velocity(int index);
+    void move(World& world, float delta);
+    void collide(World& world, struct SpatialHash* hash);
+};
+
+// Entities bucketed by the world cell their center is in, or with
+// `covering`, by every cell they overlap. Cells hash into a
+// power-of-two number of buckets sized to the entity count, so the
+// map's size doesn't matter. Rebuilt every tick with a counting sort,
+// in time linear in the number of entities.
+struct SpatialHash {
+    uint32_t mask = 0;
+    float max_radius = 0;
+    std::vector<uint32_t> starts; // Per bucket, into items, plus an end
+    std::vector<uint32_t> items;  // Entity indices, grouped by bucket
+
+    uint32_t bucket(int x, int y);
+    void build(Entities& entities, bool covering = false);
+    void overlaps(Entities& entities, std::vector<std::pair<int, int>>* pairs);
+};
+
+// "Can A see B" checks, queued up over a tick and answered in one go
+struct LineOfSight {
+    struct Query {
+        v2 from = v2(0, 0), to = v2(0, 0);
+        uint32_t tile, ticket;
+    };
+    std::vector<Query> queries;
+    std::vector<Query> sorted;     // Scratch for sorting `queries`
+    std::vector<uint64_t> visible; // One bit per ticket
+    int answered = 0;
+
+    int ask(v2 from, v2 to);
+    void resolve(World& world);
+    bool result(int ticket);
+};
+
+enum HitKind {
+    HIT_NOTHING,
+    HIT_WALL,
+    HIT_ENTITY,
+};
+
+struct Hit {
+    HitKind kind = HIT_NOTHING;
+    float dist = 0;
+    v2 point = v2(0, 0);
+    v2 normal = v2(0, 0);       // Out of the surface hit
+    Block wall = NO_WALL;       // HIT_WALL
+    Direction wall_dir = HORIZONTAL; // HIT_WALL
+    EntityHandle entity;        // HIT_ENTITY
+};
+
+// Instant-hit shots, queued up over a tick and resolved in one go.
+// hits[n] is the result for the n-th shot fired since the last resolve.
+struct Hitscan {
+    struct Shot {
+        v2 origin = v2(0, 0), dir = v2(0, 0);
+        float range;
+        EntityHandle shooter;
+    };
+    std::vector<Shot> shots;
+    std::vector<Hit> hits;
+    SpatialHash cells;
+
+    int fire(v2 origin, v2 dir, float range, EntityHandle shooter);
+    void resolve(World& world, Entities& entities);
+};
+
+// Which way to step from every cell to get to one target cell by the
+// shortest path, shared by everything chasing that target. Paths are
+// measured in steps to the 4 neighbours; the way to go from a cell is
+// then whichever of its 8 neighbours is furthest along, never cutting a
+// wall's corner.
+//
+// update() keeps the field current with the target and the world.
+// Agents read it through direction() from any thread, without locking:
+// each update is made on a copy and published, along with its size,
+// with one atomic store. A reader sees a whole field as long as it's
+// done with it before the update after next, which reuses that copy.
+struct FlowField {
+    static constexpr uint8_t NO_STEP = 8;
+
+    int width = 0, height = 0;
+    int target_x = -1, target_y = -1;
+
+private:
+    // Everything is kept on a grid padded with a ring of walls, so
+    // neighbours never need bounds checks. `stride` is its width.
+    int stride = 0;
+    uint64_t revision = 0;
+    // Per padded cell: 0 for a wall, UINT32_MAX if the target can't be
+    // reached, otherwise the number of steps to the target plus 1
+    std::vector<uint32_t> cost;
+    std::vector<uint8_t> steps;           // Neighbour to step to, or NO_STEP
+    // Copies of `steps` for readers, each with the size it was made at
+    struct Published {
+        int width = 0, height = 0, stride = 0;
+        std::vector<uint8_t> steps;
+    };
+    Published published[2];
+    std::atomic<const Published*> current {nullptr};
+    // Padded rows of `steps` redone by this update, and by the last one,
+    // which the copy being written missed
+    int redone_first = 0, redone_last = -1;
+    int missed_first = 0, missed_last = -1;
+    std::vector<std::pair<uint32_t, int>> seeds; // Cost, cell
+    std::vector<int> buckets[2];
+    std::vector<int> edits, stale;
+    int dirty_first = 0, dirty_last = 0; // Range of cells whose cost changed
+
+    void touch(int cell);
+    void flood();
+    void load(World& world);
+    void rebuild();
+    void repair(World& world);
+    void orient(int y1, int y2);
+
+public:
+    void update(World& world, v2 target);
+    uint8_t step(int x, int y) const;
+    v2 direction(v2 pos) const;
+};
+
+// Point-to-point paths on big maps, found in two levels. The world is
+// cut into clusters, with entrances where open cells face each other
+// across a cluster border, and the cost between every two entrances of
+// a cluster is worked out ahead of time. A search crosses that graph of
+// entrances first, then fills in each leg with a jump point search
+// confined to one cluster. Paths step to any of the 8 neighbours, but
+// never cut a wall's corner.
+//
+// update() keeps the graph current with the world, redoing only the
+// clusters and borders that edits touch.
+struct Pathfinder {
+    static constexpr int cluster_shift = 4;
+    static constexpr int cluster_size = 1 << cluster_shift;
+    // Per border. Entrances need a wall between them, so there can't
+    // be more than one for every two cells.
+    static constexpr int max_entrances = cluster_size / 2;
+
+    enum Border { NORTH, EAST, SOUTH, WEST };
+
+    struct Cluster {
+        uint8_t counts[4] = {};                // Entrances on each border
+        uint8_t offsets[4][max_entrances];     // Where along the border each is
+        std::vector<uint16_t> costs;           // Between every two entrances, in border order
+    };
+
+    int width = 0, height = 0;
+    int clusters_x = 0, clusters_y = 0;
+    std::vector<Cluster> clusters;
+
+private:
+    uint64_t revision = 0;
+    std::vector<int> edits;
+    std::vector<int> dirty; // Clusters whose costs need redoing
+
+    // Per entrance slot: cluster * 4 * max_entrances + border *
+    // max_entrances + index. The search state is only good while
+    // `search` is the current one.
+    struct Slot {
+        uint32_t cell = 0; // In the world, as x + y * width
+        uint32_t search = 0;
+        uint32_t cost = 0;
+        uint32_t came_from = 0;
+    };
+    std::vector<Slot> slots;
+    uint32_t search = 0;
+    std::vector<std::vector<uint32_t>> open; // Slots by estimated cost
+
+    // Which part of the graph each slot is in, so a search for a goal
+    // that can't be reached doesn't flood the map finding that out.
+    // Relabelled by the first search after the graph changes.
+    std::vector<uint32_t> regions;
+    bool relabel = true;
+
+    void buildBorder(World& world, int cx, int cy, Border border);
+    void buildCosts(World& world, int cluster);
+    void label();
+
+public:
+    void update(World& world);
+    bool find(World& world, v2 from, v2 to, std::vector<v2>* path);
+};
+
+// What can be seen from one cell, and every cell that ever has been.
+// Found by symmetric shadowcasting: each quadrant is scanned a row at a
+// time outward from the eye, and every wall narrows the slopes still in
+// view for the rows past it. A floor cell is only in view if its middle
+// is, which makes sight symmetric: A sees B exactly when B sees A.
+// Walls are in view if any of them is.
+//
+// update() only recomputes when the eye moves to another cell or a cell
+// the last scan looked at changes. Nothing else can change what's in
+// view.
+struct FieldOfView {
+    static constexpr int radius = 64;
+
+    int width = 0, height = 0;
+    int eye_x = -1, eye_y = -1;
+
+private:
+    // A bit per cell. `view` and `scanned` cover the square the radius
+    // reaches around the eye, `explored` the whole world.
+    static constexpr int span = 2 * radius + 1;
+    static constexpr int span_words = (span + 63) / 64;
+    uint64_t view[span * span_words] = {};
+    uint64_t scanned[span * span_words] = {};
+    std::vector<uint64_t> explored;
+    int row_words = 0; // Of `explored`
+    uint64_t revision = 0;
+    std::vector<int> edits;
+    std::vector<int> revealed; // Cells explored since the last takeRevealed()
+    bool forgot = false;
+
+    bool around(const uint64_t* bits, int x, int y) const;
+    void reveal(int x, int y);
+
+public:
+    void update(World& world, v2 eye);
+    bool visible(int x, int y) const;
+    bool seen(int x, int y) const;
+    bool takeRevealed(std::vector<int>* cells);
+};
+
+// How lit each wall face is: the world's ambient light, plus every
+// light the face turns toward and has a clear line to, fading to
+// nothing at the light's radius. Baked on a worker pool whenever the
+// world is replaced.
+//
+// After that, update() relights just the faces around lights an edit
+// could have changed, on a thread of its own that sleeps between
+// relights. Each relight is made on a copy and published with one
+// atomic store, so as with FlowField, a reader sees a whole map as long
+// as it's done with it before the relight after next.
+struct Lightmap {
+    enum Side { NORTH, EAST, SOUTH, WEST };
+    static constexpr uint8_t FULL = 255;
+
+    int width = 0, height = 0;
+
+private:
+    struct Area {
+        int x1, y1, x2, y2; // Cells [x1, x2) x [y1, y2)
+    };
+    // Part of the world as it was, so relighting doesn't race edits
+    struct Snapshot {
+        int x = 0, y = 0, width = 0, height = 0;
+        std::vector<Block> walls;
+
+        void take(World& world, Area area);
+        Block get(int x, int y) const;
+    };
+
+    // Per cell, from 0 to FULL for each side in Side order
+    std::vector<uint8_t> faces[2];
+    std::atomic<const uint8_t*> current {nullptr};
+    std::vector<Light> lights; // By y
+    float max_radius = 0;
+    float ambient = 1;
+    uint64_t revision = 0;
+    std::vector<int> edits, pending;
+
+    // The relighting thread, started by the first relight
+    std::thread worker;
+    std::mutex lock;
+    std::condition_variable wake; // A relight is queued, or we're quitting
+    std::condition_variable idle; // The relight in flight is done
+    std::atomic<bool> working {false};
+    bool queued = false;
+    bool quitting = false;
+    Area next = {0, 0, 0, 0};    // The relight queued
+    Snapshot snapshot;           // What the relight in flight sees
+    Area relit = {0, 0, 0, 0};   // By the last relight, in the copy it published
+
+    void light(const Snapshot& grid, Area area, uint8_t* out) const;
+    void relight(Area area);
+    void serve();
+
+public:
+    ~Lightmap();
+    void update(WorkerPool& pool, World& world);
+    void finish();
+    uint8_t face(int x, int y, Side side) const;
+};
+
+// What the 3D view saw, a column at a time, kept after drawing so
+// nothing else has to cast the same rays again
+struct ViewFrame {
+    static constexpr int max_layers = 4; // Most walls a column shows, through grates
+
+    int width = 0;
+    v2 eye = v2(0, 0);
+    float angle = 0, fov = 0;
+
+    // Per column, the nearest wall
+    std::vector<float> dir_x, dir_y;
+    std::vector<float> dist;  // Along the ray
+    std::vector<float> depth; // Straight ahead of the eye
+    std::vector<float> hit_x, hit_y;
+    std::vector<int> cell_x, cell_y;
+    std::vector<Lightmap::Side> face;
+    std::vector<Block> type;
+    // And every wall it shows, nearest first, max_layers to a column
+    std::vector<uint8_t> layers;
+    std::vector<WallHit> walls;
+
+    void capture(World& world, v2 eye, float angle, float fov, const RayBatch& rays);
+    int column(v2 point) const;
+    bool sees(v2 point) const;
+};
+
+// Lights that move, worked out afresh every frame: muzzle flashes,
+// impacts, projectiles. Each is shadowcast over the grid from where it
+// is, and adds to the wall columns it reaches, on top of the lightmap.
+// They're taken brightest and nearest first; once the frame's time
+// budget is spent, the rest sit the frame out.
+struct DynamicLights {
+    static constexpr int max_radius = 16;
+
+    std::vector<Light> lights; // This frame's, filled in by the game
+    float budget = 0.001;      // Seconds a frame for shadowcasting
+    int lit = 0;               // How many of `lights` made it in
+
+private:
+    // Around each light, a word per row of the square its radius reaches
+    static constexpr int span = 2 * max_radius + 1;
+    std::vector<Light> order;    // By importance
+    std::vector<uint8_t> done;   // Whether each was cast in time
+    std::vector<uint64_t> seen;
+
+public:
+    void cast(WorkerPool& pool, World& world, v2 eye);
+    void shade(WorkerPool& pool, const ViewFrame& frame, float* levels) const;
+};
+
+struct Raster;
+
+// A wall texture with gaps in it, stored a column at a time. Each
+// column's opaque texels are kept as runs, so the gaps are skipped whole
+// rather than tested texel by texel.
+struct MaskedTexture {
+    struct Run {
+        uint16_t start, end; // Rows [start, end)
+    };
+    int size = 0;
+    std::vector<uint32_t> texels; // Column-major
+    std::vector<uint32_t> starts; // Per column, into `runs`, plus an end
+    std::vector<Run> runs;
+
+    static MaskedTexture grate(const uint32_t* texels, int pitch, int size, int bars);
+};
+
+// A square image for billboards, stored a column at a time since that's
+// how it's drawn. Each column is opaque over one run of rows and clear
+// everywhere else, which is enough for the round things we draw.
+struct SpriteImage {
+    int size = 0;
+    std::vector<uint32_t> texels;      // Column-major
+    std::vector<uint16_t> top, bottom; // Per column, the opaque rows [top, bottom)
+
+    static SpriteImage ball(const Raster* raster, int size, uint8_t r, uint8_t g, uint8_t b);
+};
+
+// Things drawn into the 3D view as images facing the eye, hidden column
+// by column behind walls nearer than them
+struct Billboards {
+    static constexpr float near = 0.05; // Anything closer isn't drawn
+    static constexpr int block = 16;    // Columns per entry of `farthest`
+
+    int drawn = 0;  // Last frame, sprites at least partly in view
+    int hidden = 0; // And ones in the view cone but behind walls
+
+private:
+    struct Sprite {
+        const SpriteImage* image;
+        float depth;
+        float left, right; // Edges, in columns
+        int x1, x2;        // Columns it covers, clipped to the view
+        float top, height; // Rows
+    };
+    v2 eye = v2(0, 0), forward = v2(1, 0);
+    float half_fov = 0, rads_per_pixel = 0;
+    int width = 0, height = 0;
+    std::vector<Sprite> sprites;
+    std::vector<float> farthest; // Per block of columns, the farthest wall in it
+    // Scratch for draw(): per column, a bit for each row nearer sprites
+    // have drawn over, and one run of rows known to be covered, to skip
+    // most sprites without looking at the bits
+    std::vector<uint64_t> covered;
+    int cover_words = 0;
+    std::vector<int> cover_top, cover_bottom;
+
+public:
+    void begin(v2 eye, float angle, float fov, int width, int height);
+    void add(const SpriteImage* image, v2 pos, float size, float lift);
+    void draw(WorkerPool& pool, uint32_t* pixels, int pitch, const float* depth);
+};
+
+enum CpuTier {
+    TIER_SCALAR = 0,
+    TIER_SSE2,
+    TIER_AVX2,
+    TIER_AVX512,
+};
+
+// The hot loops, each bound once at startup to the fastest version the
+// CPU supports.
+struct Kernels {
+    CpuTier fill_tier, span_tier, column_tier, ray_tier, move_tier, flow_tier;
+
+    void (*fillSpan)(uint32_t* dest, int count, uint32_t color);
+    void (*scaleSpan)(uint32_t* dest, const uint32_t* src, int count, uint32_t pos, uint32_t step);
+    void (*scaleColumn)(
+        uint32_t* dest, int pitch, int surface_height, int top, int column_height,
+        const uint32_t* texels, int texel_pitch, int texture_height);
+    void (*castRays)(
+        const Block* walls, int width, int height, const OccupancyPyramid* occupancy,
+        v2 origin, RayBatch* rays);
+    void (*moveClear)(
+        const Block* walls, int width, int height, float delta, int count,
+        float* pos_x, float* pos_y, const float* vel_x, const float* vel_y,
+        const float* radius, uint8_t* blocked);
+    void (*flowSteps)(const uint32_t* cost, int stride, int count, uint8_t* steps);
+
+    static CpuTier detect();
+    static void select(CpuTier limit, bool force);
+};
+
+struct Line {
+    int x1, y1, x2, y2;
+    uint32_t color;
+};
+
+// Drawing routines for the canvas's pixel format. Every surface we draw
+// to shares it, so nothing here converts pixels, and only packing a
+// color depends on which format it is. Engine picks the one matching
+// the canvas at startup.
+struct Raster {
+    uint32_t format;
+    uint32_t (*rgb)(uint8_t r, uint8_t g, uint8_t b);
+
+    static void fill(SDL_Surface* surface, const SDL_Rect* rect, uint32_t color);
+    static void blitScaled(SDL_Surface* src, const SDL_Rect* src_rect, SDL_Surface* dest, const SDL_Rect* dest_rect);
+    static void lines(SDL_Surface* surface, const Line* lines, int count);
+    static const Raster* forFormat(uint32_t format);
 };
 
 struct Engine;
 
+// The part of the world shown in the top-down view
+struct Viewport {
+    v2 center = v2(0, 0); // In cells
+    float zoom = 1;       // Pixels per cell
+    int size = 0;         // Pixels across
+
+    v2 toScreen(v2 world) {
+        return (world - center) * zoom + v2(size, size) / 2;
+    }
+    v2 toWorld(v2 screen) {
+        return (screen - v2(size, size) / 2) / zoom + center;
+    }
+    bool operator ==(const Viewport& v) const {
+        return center.x == v.center.x && center.y == v.center.y && zoom == v.zoom && size == v.size;
+    }
+};
+
+// Work split into tasks, each waiting on some of the ones added before
+// it. run() starts every task as soon as all it waits on are done, on
+// as many of the pool's cores as there are tasks ready, and times each
+// one.
+struct TaskGraph {
+    struct Task {
+        const char* name;
+        std::function<void()> work;
+        std::vector<int> after; // Tasks it waits on
+        double seconds = 0;     // Taken in the last run()
+    };
+    std::vector<Task> tasks;
+
+    int add(const char* name, std::function<void()> work, std::vector<int> after = {});
+    void run(WorkerPool& pool);
+};
+
+// One tick of the game as the renderer needs it, copied out whole so
+// it can be drawn while the next tick runs. The game fills a scene in
+// after update(); from then on only the renderer touches it, until it's
+// been drawn and goes back to be filled again.
+struct Scene {
+    WorldChanges world; // Since the scene before
+    Entities entities;
+    EntityHandle player;
+    std::vector<Light> lights; // That move, as of this tick
+    std::vector<v2> tracers;   // Where each shot of the last volley started
+    std::vector<Hit> hits;     // And where it ended
+    float tracer_time = 0;
+    std::vector<v2> route;
+    Viewport minimap_view;
+    bool fog = true;
+    bool timings = false;
+    bool mouse_control = false;
+    float fov_degrees = 60;
+    float motion = 0; // Of the mouse, across
+
+    SDL_Surface* canvas = nullptr; // Drawn into, then shown. The engine's.
+};
+
 static float fov_degrees = 60.0;
 static float fov = fov_degrees * M_PI / 180.0;
 static float half_fov = fov / 2.0;
 static float plane_distance = 1.0;
 
+// update() and render() may run on different threads at once. Each
+// keeps to its own half of the game, and the only thing passed between
+// them is a Scene.
 struct Game {
 private:    
     Engine* engine;
+
+    // The simulation, only touched by update() and snapshot()
     World world;
-    v2 player;
-    float view_angle; // Radians
+    Entities entities;
+    EntityHandle player;
+    SpatialHash entity_hash;
+    Hitscan hitscan;
+    FlowField chase;
+    Pathfinder paths;
+    std::vector<v2> route; // From the player to `route_target`, if set
+    v2 route_target = v2(0, 0);
+    bool routing = false;
+    std::vector<Light> lights; // That move, filled in every tick
+    bool fog = true; // Keep what the player hasn't seen off the minimap
+    bool timings = false; // Show how long each part of the last frame took
+    std::vector<v2> tracers; // Where each shot of the last volley started
+    float tracer_time = 0;   // Seconds left to show it for
     bool mouse_control = false;
+    int levels_generated = 0;
+    Viewport minimap_view; // Panned and zoomed by the mouse
+    uint64_t scene_revision = 0; // Of `world`, as of the last scene
 
+    // The presentation, only touched by render(): the world as of the
+    // scene being drawn, and everything worked out from it
+    World shown;
+    FieldOfView sight;
+    Lightmap lighting;
+    DynamicLights moving_lights;
+    WorkerPool workers;
+
+    // Never changed after loading
     SDL_Surface* dark_wall;
     SDL_Surface* light_wall;
     SDL_Surface* sky;
+    MaskedTexture grate;
+    SpriteImage enemy_sprite;
+    SpriteImage projectile_sprite;
+
+    RayBatch rays;
+    ViewFrame frame; // What render3D saw, for everything drawn after it
+    std::vector<float> column_light; // Per column of the 3D view, 0 to 1
+    Billboards billboards;
+
+    SDL_Surface* view_surface = nullptr; // 3D
+    SDL_Surface* map_surface = nullptr;  // Top-down
+    std::vector<std::pair<const char*, double>> task_times; // Seconds, for the last frame
+
+    // Tiles and grid of the top-down view, drawn for `minimap_drawn`
+    // as of revision `minimap_revision` of `shown`
+    Viewport minimap_drawn;
+    SDL_Surface* minimap = nullptr;
+    bool minimap_fog = true;
+    uint64_t minimap_revision = 0;
+    std::vector<int> minimap_edits;
+    std::vector<int> minimap_revealed;
+
+    void fitMinimap(int size);
+    void drawMinimapCell(int x, int y);
+    void drawMinimapDensity(int level, int x1, int y1, int x2, int y2);
+    void updateMinimap(const Scene& scene, int size);
+    void nextLevel();
 
 public:
     Game(Engine* engine);
     Game(const Game&) = default;
     ~Game();
     void update();
-    void render3D(SDL_Surface* surface, int width, int height);
-    void renderTopDown(SDL_Surface* surface, int size);
-    void render();
+    void snapshot(Scene* scene);
+    void castView(Scene& scene, int width);
+    void render3D(Scene& scene, SDL_Surface* surface, int width, int height);
+    void renderTopDown(Scene& scene, SDL_Surface* surface, int size);
+    void render(Scene& scene);
 };
 
 struct Input {
     v2 motion = {0, 0};
+    int wheel = 0;
     
 private:
     int num_keys;
@@ -112,21 +1002,52 @@ public:
     v2 mousePos();
 };
 
+// Text and its drop shadow, rendered but not drawn yet
+struct Caption {
+    SDL_Surface* text;
+    SDL_Surface* shadow;
+    int x, y;
+};
+
+// Events, updates and showing frames in the window run on the main
+// thread. With a pipeline depth past 0, drawing runs on `renderer` a
+// tick behind, or up to depth ticks behind if it falls back; with 0,
+// each tick is drawn before the next, for the least latency.
 struct Engine {
     SDL_Surface* canvas;
+    const Raster* raster;
     float delta;
     int width, height;
     Input* input;
     TTF_Font* font;
+    int pipeline_depth;
 
 private:
     SDL_Window* window;
+    SDL_Surface* window_surface;
     uint64_t last_tick;
     Game* game;
 
+    // pipeline_depth + 1 of them. Each is either free, being filled on
+    // the main thread, queued, or drawn and waiting to be shown; the
+    // front of the queue is being drawn.
+    std::vector<Scene> scenes;
+    std::vector<Scene*> free_scenes;
+    std::deque<Scene*> queued;
+    std::deque<Scene*> drawn;
+    std::mutex scenes_lock;
+    std::condition_variable scenes_changed;
+    std::thread renderer;
+    bool quitting = false;
+
+    void draw(Scene& scene);
+    void present(Scene& scene);
+    void drawQueued();
+
 public:
-    Engine(const char* title, int width, int height);
+    Engine(const char* title, int width, int height, int pipeline_depth);
     ~Engine();
-    void renderText(const char* title, int x, int y);
+    Caption renderText(const char* msg, int x, int y);
+    void drawText(SDL_Surface* surface, Caption caption);
     bool frame();
 };